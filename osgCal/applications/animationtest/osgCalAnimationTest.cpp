@@ -0,0 +1,196 @@
+/*
+    Copyright (C) 2008 Vladimir Shabanov <vshabanoff@gmail.com>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+#include <stdio.h>
+#include <math.h>
+#include <algorithm>
+#include <stdexcept>
+
+#include <osg/ref_ptr>
+
+#include <osgCal/AnimationEvaluator>
+#include <osgCal/CoreModel>
+#include <osgCal/Mixer>
+
+using namespace osgCal;
+
+// Plays every animation of model as cycle with CalMixer and with
+// AnimationEvaluator (baked keys) and checks that bone states are
+// the same, also after the loop wraps. Cycle is started by CalMixer
+// (which closes the loop in cal3d tracks only) or by osgCal::Mixer
+// (which marks baked animation as closed). Returns non zero when
+// states differ.
+
+static const float EPSILON = 1e-5f;
+
+/**
+ * Not a multiple of key interval, so the time between the last key
+ * and animation duration is hit before the loop wraps.
+ */
+static const float FRAME_TIME = 0.0123f;
+
+enum CycleStarter
+{
+    CAL_MIXER,
+    OSGCAL_MIXER,
+    STARTERS_COUNT
+};
+
+static const char* starterNames[] = { "CalMixer", "osgCal::Mixer" };
+
+static
+bool
+equal( const CalVector& a,
+       const CalVector& b )
+{
+    return fabsf( a.x - b.x ) <= EPSILON * std::max( 1.0f, fabsf( a.x ) )
+        && fabsf( a.y - b.y ) <= EPSILON * std::max( 1.0f, fabsf( a.y ) )
+        && fabsf( a.z - b.z ) <= EPSILON * std::max( 1.0f, fabsf( a.z ) );
+}
+
+static
+bool
+equal( const CalQuaternion& a,
+       const CalQuaternion& b )
+{
+    return fabsf( a.x - b.x ) <= EPSILON
+        && fabsf( a.y - b.y ) <= EPSILON
+        && fabsf( a.z - b.z ) <= EPSILON
+        && fabsf( a.w - b.w ) <= EPSILON;
+}
+
+/**
+ * Play animation <code>id</code> for three loops, return false at
+ * the first bone state mismatch.
+ */
+static
+bool
+testCycle( CoreModel*   coreModel,
+           int          id,
+           CycleStarter starter )
+{
+    CalCoreModel* calCoreModel = coreModel->getCalCoreModel();
+
+    CalModel reference( calCoreModel );
+    CalModel tested( calCoreModel );
+
+    CalMixer* referenceMixer = (CalMixer*)reference.getAbstractMixer();
+    CalMixer* testedCalMixer = (CalMixer*)tested.getAbstractMixer();
+    Mixer     testedMixer( &tested, 8, coreModel );
+
+    if ( starter == OSGCAL_MIXER )
+    {
+        testedMixer.blendCycle( id, 1.0f, 0.0f );
+        referenceMixer->blendCycle( id, 1.0f, 0.0f );
+    }
+    else
+    {
+        referenceMixer->blendCycle( id, 1.0f, 0.0f );
+        testedCalMixer->blendCycle( id, 1.0f, 0.0f );
+    }
+
+    AnimationEvaluator evaluator( coreModel );
+
+    const float duration = calCoreModel->getCoreAnimation( id )->getDuration();
+    const int   frames = (int)( 3 * duration / FRAME_TIME ) + 1;
+
+    const std::vector< CalBone* >& referenceBones = reference.getSkeleton()->getVectorBone();
+    const std::vector< CalBone* >& testedBones = tested.getSkeleton()->getVectorBone();
+
+    for ( int f = 0; f < frames; f++ )
+    {
+        referenceMixer->updateAnimation( FRAME_TIME );
+        referenceMixer->updateSkeleton();
+
+        if ( starter == OSGCAL_MIXER )
+        {
+            testedMixer.updateAnimation( FRAME_TIME );
+            evaluator.updateSkeleton( &testedMixer, tested.getSkeleton() );
+        }
+        else
+        {
+            testedCalMixer->updateAnimation( FRAME_TIME );
+            evaluator.updateSkeleton( testedCalMixer, tested.getSkeleton() );
+        }
+
+        for ( size_t b = 0; b < referenceBones.size(); b++ )
+        {
+            if ( !equal( referenceBones[b]->getTranslationAbsolute(),
+                         testedBones[b]->getTranslationAbsolute() )
+                 || !equal( referenceBones[b]->getRotationAbsolute(),
+                            testedBones[b]->getRotationAbsolute() ) )
+            {
+                printf( "      bone %d differs at time %g of %g\n",
+                        (int)b, fmodf( ( f + 1 ) * FRAME_TIME, duration ), duration );
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+// -- Main --
+
+int
+main( int argc,
+      const char** argv )
+{
+    if ( argc != 2 )
+    {
+        puts( "Usage: osgCalAnimationTest <cal3d.cfg file name>" );
+        return 2;
+    }
+
+    int failures = 0;
+
+    for ( int s = 0; s < STARTERS_COUNT; s++ )
+    {
+        // cycles change cal3d tracks of core model, so each starter
+        // gets its own
+        osg::ref_ptr< CoreModel > coreModel = new CoreModel;
+
+        try
+        {
+            coreModel->load( argv[1] );
+        }
+        catch ( std::runtime_error& e )
+        {
+            printf( "Can't load model %s:\n%s\n", argv[1], e.what() );
+            return 2;
+        }
+
+        const std::vector< std::string >& names = coreModel->getAnimationNames();
+
+        for ( size_t a = 0; a < names.size(); a++ )
+        {
+            const bool ok = testCycle( coreModel.get(), a, (CycleStarter)s );
+
+            printf( "%-14s %-24s %s\n",
+                    starterNames[ s ], names[ a ].c_str(), ok ? "ok" : "FAILED" );
+
+            failures += ok ? 0 : 1;
+        }
+    }
+
+    if ( failures )
+    {
+        printf( "%d failures\n", failures );
+    }
+
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,340 @@
+/*
+    Copyright (C) 2008 Vladimir Shabanov <vshabanoff@gmail.com>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+
+#include <osg/Timer>
+
+#include <osgCal/AnimationEvaluator>
+#include <osgCal/CoreModel>
+#include <osgCal/Model>
+#include <osgCal/Skinning>
+
+using namespace osgCal;
+
+void
+usage()
+{
+    puts( "Usage: osgCalBenchmark [-frames N] <cal3d.cfg file name> ...\n"
+          "\n"
+          "Measures CPU skinning of all non-rigid meshes with each\n"
+          "supported kernel using interleaved (AoS) mesh buffers and\n"
+          "SoA skinning streams, and skeleton update with all animations\n"
+          "running using cal3d mixer, keyframe cursors and baked animations,\n"
+          "e.g.:\n"
+          "\n"
+          "  osgCalBenchmark models/Abdulla/cal3d.cfg models/Gulchatai/cal3d.cfg" );
+}
+
+static const double FRAME_TIME = 1.0 / 30.0;
+
+static
+const char*
+kernelName( SkinningKernel k )
+{
+    switch ( k )
+    {
+        case SKINNING_SCALAR: return "scalar";
+        case SKINNING_SSE:    return "sse";
+        case SKINNING_AVX:    return "avx";
+        default:              return "auto";
+    }
+}
+
+// -- Skinning --
+
+/**
+ * Non-rigid mesh with bone palettes recorded for each frame.
+ */
+struct SkinnedMesh
+{
+        const MeshData*                 data;
+        std::vector< SkinningPalette >  palettes;
+};
+
+static
+void
+recordPalettes( Model*                      model,
+                int                         frames,
+                std::vector< SkinnedMesh >& meshes )
+{
+    const CoreModel::MeshVector& coreMeshes = model->getCoreModel()->getMeshes();
+
+    for ( size_t i = 0; i < coreMeshes.size(); i++ )
+    {
+        if ( !coreMeshes[i]->data->rigid )
+        {
+            SkinnedMesh m;
+            m.data = coreMeshes[i]->data.get();
+            meshes.push_back( m );
+        }
+    }
+
+    for ( int f = 0; f < frames; f++ )
+    {
+        model->update( FRAME_TIME );
+
+        for ( size_t i = 0; i < meshes.size(); i++ )
+        {
+            SkinningPalette p( meshes[i].data->getBonesCount() );
+
+            for ( int b = 0; b < meshes[i].data->getBonesCount(); b++ )
+            {
+                const ModelData::BoneParams& bp =
+                    model->getModelData()->getBoneParams( meshes[i].data->getBoneId( b ) );
+
+                p.set( b, bp.rotation, bp.translation );
+            }
+
+            meshes[i].palettes.push_back( p );
+        }
+    }
+}
+
+/**
+ * Skin all recorded frames, return time in seconds.
+ */
+static
+double
+skinFrames( const std::vector< SkinnedMesh >& meshes,
+            int                               frames,
+            bool                              streams,
+            std::vector< osg::Vec3f >&        output )
+{
+    osg::Timer_t start = osg::Timer::instance()->tick();
+
+    for ( int f = 0; f < frames; f++ )
+    {
+        for ( size_t i = 0; i < meshes.size(); i++ )
+        {
+            const MeshData* d = meshes[i].data;
+            osg::BoundingBox bb;
+
+            if ( streams )
+            {
+                skinVertices( meshes[i].palettes[f], d->maxBonesInfluence,
+                              *d->skinningStreams, 0,
+                              &output.front(), d->vertexBuffer->size(), bb );
+            }
+            else
+            {
+                skinVertices( meshes[i].palettes[f], d->maxBonesInfluence,
+                              &d->vertexBuffer->front(),
+                              &d->weightBuffer->front(),
+                              &d->matrixIndexBuffer->front(),
+                              &output.front(), d->vertexBuffer->size(), bb );
+            }
+        }
+    }
+
+    return osg::Timer::instance()->delta_s( start,
+                                            osg::Timer::instance()->tick() );
+}
+
+static
+void
+benchmarkSkinning( Model* model,
+                   int    frames )
+{
+    std::vector< SkinnedMesh > meshes;
+
+    recordPalettes( model, frames, meshes );
+
+    size_t vertices = 0;
+    size_t maxVertices = 0;
+
+    for ( size_t i = 0; i < meshes.size(); i++ )
+    {
+        size_t n = meshes[i].data->vertexBuffer->size();
+        vertices += n;
+        maxVertices = std::max( maxVertices, n );
+    }
+
+    printf( "  skinning: %d meshes, %d vertices, %d frames\n",
+            (int)meshes.size(), (int)vertices, frames );
+
+    if ( vertices == 0 )
+    {
+        return;
+    }
+
+    std::vector< osg::Vec3f > output( maxVertices );
+
+    const SkinningKernel kernels[] = { SKINNING_SCALAR, SKINNING_SSE, SKINNING_AVX };
+
+    for ( size_t k = 0; k < sizeof ( kernels ) / sizeof ( kernels[0] ); k++ )
+    {
+        setSkinningKernel( kernels[k] );
+
+        if ( getSkinningKernel() != kernels[k] )
+        {
+            continue; // not supported
+        }
+
+        double aos = skinFrames( meshes, frames, false, output );
+        double soa = skinFrames( meshes, frames, true, output );
+
+        printf( "    %-6s  AoS %6.2f ns/vertex  SoA %6.2f ns/vertex  (SoA speedup %+.0f%%)\n",
+                kernelName( kernels[k] ),
+                aos * 1e9 / ( vertices * frames ),
+                soa * 1e9 / ( vertices * frames ),
+                ( aos / soa - 1.0 ) * 100.0 );
+    }
+
+    setSkinningKernel( SKINNING_AUTO );
+}
+
+// -- Animation --
+
+/**
+ * Run animations of calModel for all frames using cal3d mixer (when
+ * evaluator is null) or evaluator, return time in seconds spent in
+ * skeleton update.
+ */
+static
+double
+animateFrames( CalModel*           calModel,
+               AnimationEvaluator* evaluator,
+               int                 frames )
+{
+    CalMixer* mixer = (CalMixer*)calModel->getAbstractMixer();
+    double    time = 0;
+
+    for ( int f = 0; f < frames; f++ )
+    {
+        mixer->updateAnimation( FRAME_TIME );
+
+        osg::Timer_t start = osg::Timer::instance()->tick();
+
+        if ( evaluator )
+        {
+            evaluator->updateSkeleton( mixer, calModel->getSkeleton() );
+        }
+        else
+        {
+            mixer->updateSkeleton();
+        }
+
+        time += osg::Timer::instance()->delta_s( start,
+                                                 osg::Timer::instance()->tick() );
+    }
+
+    return time;
+}
+
+static
+void
+benchmarkAnimation( CoreModel* coreModel,
+                    int        frames )
+{
+    CalCoreModel* calCoreModel = coreModel->getCalCoreModel();
+
+    size_t tracks = 0; // bones animated by all animations
+
+    for ( int a = 0; a < calCoreModel->getCoreAnimationCount(); a++ )
+    {
+        tracks += calCoreModel->getCoreAnimation( a )->getListCoreTrack().size();
+    }
+
+    printf( "  animation: %d animations, %d tracks, %d frames\n",
+            calCoreModel->getCoreAnimationCount(), (int)tracks, frames );
+
+    if ( tracks == 0 )
+    {
+        return;
+    }
+
+    const char* methods[] = { "cal3d", "cursors", "baked" };
+
+    for ( int m = 0; m < 3; m++ )
+    {
+        CalModel calModel( calCoreModel );
+        CalMixer* mixer = (CalMixer*)calModel.getAbstractMixer();
+
+        for ( int a = 0; a < calCoreModel->getCoreAnimationCount(); a++ )
+        {
+            mixer->blendCycle( a, 1.0f, 0.0f );
+        }
+
+        AnimationEvaluator evaluator( m == 2 ? coreModel : 0 );
+
+        double time = animateFrames( &calModel, m == 0 ? 0 : &evaluator, frames );
+
+        printf( "    %-7s  %6.2f ns/bone/animation\n",
+                methods[m], time * 1e9 / ( tracks * frames ) );
+    }
+}
+
+// -- Main --
+
+int
+main( int argc,
+      const char** argv )
+{
+    int frames = 300;
+    int firstModel = 1;
+
+    if ( argc > 2 && strcmp( argv[1], "-frames" ) == 0 )
+    {
+        frames = atoi( argv[2] );
+        firstModel = 3;
+    }
+
+    if ( argc <= firstModel || frames <= 0 )
+    {
+        usage();
+        return 2;
+    }
+
+    osg::ref_ptr< MeshParameters > p = new MeshParameters;
+    p->useSkinningStreams = true;
+
+    osg::ref_ptr< MeshParametersSelector > ps = new ConstMeshParametersSelector( p.get() );
+
+    for ( int i = firstModel; i < argc; i++ )
+    {
+        osg::ref_ptr< CoreModel > coreModel = new CoreModel;
+
+        try
+        {
+            coreModel->load( argv[i], ps.get() );
+        }
+        catch ( std::runtime_error& e )
+        {
+            printf( "Can't load model %s:\n%s\n", argv[i], e.what() );
+            return 2;
+        }
+
+        printf( "%s\n", argv[i] );
+
+        osg::ref_ptr< Model > model = new Model;
+        model->load( coreModel.get() );
+        model->setAutoUpdate( false );
+
+        for ( size_t a = 0; a < coreModel->getAnimationNames().size(); a++ )
+        {
+            model->blendCycle( a, 1.0f, 0.0f );
+        }
+
+        benchmarkSkinning( model.get(), frames );
+        benchmarkAnimation( coreModel.get(), frames );
+    }
+
+    return 0;
+}
@@ -16,8 +16,13 @@
     Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
 */
 #include <sys/stat.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <string.h>
 #include <osgCal/MeshLoader>
 #include <osgCal/CoreModel>
+#include <osgCal/CompressedAnimation>
+#include <osgCal/PaletteAnimation>
 #include <osgDB/FileNameUtils>
 
 using namespace osgCal;
@@ -25,14 +30,119 @@ using namespace osgCal;
 void
 usage()
 {
-    puts( "Usage: osgCalPreparer <cal3d.cfg file name>" );
+    puts( "Usage: osgCalPreparer [options] <cal3d.cfg file name>\n"
+          "Options:\n"
+          "  -animations              also save compressed animations cache\n"
+          "  -reduce-keys             remove keys reproduced by interpolation\n"
+          "                           and unused tracks before compression\n"
+          "                           (implies -animations)\n"
+          "  -rotation-error E        max rotation error in radians (default 0.001)\n"
+          "  -translation-error E     max translation error in model units\n"
+          "                           (default 0.001)\n"
+          "  -palettes FPS            also save animations baked into bone\n"
+          "                           palettes sampled FPS times per second\n"
+          "  -bones-per-mesh N        split meshes influenced by more than N bones\n"
+          "                           (default 30, up to 256 for models drawn\n"
+          "                           with bone palette texture)\n"
+          "Error bounds are applied separately to keys reduction and compression." );
+}
+
+/**
+ * Count keyframes of all core animations.
+ */
+int
+keyframesCount( CalCoreModel* calCoreModel )
+{
+    int count = 0;
+
+    for ( int i = 0; i < calCoreModel->getCoreAnimationCount(); i++ )
+    {
+        std::list< CalCoreTrack* >& tracks =
+            calCoreModel->getCoreAnimation( i )->getListCoreTrack();
+
+        for ( std::list< CalCoreTrack* >::iterator
+                  t    = tracks.begin(),
+                  tEnd = tracks.end();
+              t != tEnd; ++t )
+        {
+            count += (*t)->getCoreKeyframeCount();
+        }
+    }
+
+    return count;
+}
+
+/**
+ * Memory used by cal3d keyframes of animation (approximately).
+ */
+size_t
+calAnimationSize( CalCoreAnimation* a )
+{
+    size_t size = 0;
+    std::list< CalCoreTrack* >& tracks = a->getListCoreTrack();
+
+    for ( std::list< CalCoreTrack* >::iterator
+              t    = tracks.begin(),
+              tEnd = tracks.end();
+          t != tEnd; ++t )
+    {
+        size += sizeof ( CalCoreTrack )
+            + (*t)->getCoreKeyframeCount()
+            * ( sizeof ( CalCoreKeyframe ) + sizeof ( CalCoreKeyframe* ) );
+    }
+
+    return size;
 }
 
 int
 main( int argc,
       const char** argv )
 {
-    if ( argc < 2 )
+    bool  compressAnimations  = false;
+    bool  reduceKeys          = false;
+    float maxRotationError    = 0.001f;
+    float maxTranslationError = 0.001f;
+    float palettesFrameRate   = 0;
+    int   maxBonesPerMesh     = Constants::MAX_BONES_PER_MESH;
+
+    int arg = 1;
+
+    for ( ; arg < argc && argv[ arg ][ 0 ] == '-'; arg++ )
+    {
+        if ( !strcmp( argv[ arg ], "-animations" ) )
+        {
+            compressAnimations = true;
+        }
+        else if ( !strcmp( argv[ arg ], "-reduce-keys" ) )
+        {
+            compressAnimations = true;
+            reduceKeys = true;
+        }
+        else if ( !strcmp( argv[ arg ], "-rotation-error" ) && arg + 1 < argc )
+        {
+            maxRotationError = atof( argv[ ++arg ] );
+        }
+        else if ( !strcmp( argv[ arg ], "-translation-error" ) && arg + 1 < argc )
+        {
+            maxTranslationError = atof( argv[ ++arg ] );
+        }
+        else if ( !strcmp( argv[ arg ], "-palettes" ) && arg + 1 < argc
+                  && atof( argv[ arg + 1 ] ) > 0 )
+        {
+            palettesFrameRate = atof( argv[ ++arg ] );
+        }
+        else if ( !strcmp( argv[ arg ], "-bones-per-mesh" ) && arg + 1 < argc )
+        {
+            maxBonesPerMesh = atoi( argv[ ++arg ] );
+        }
+        else
+        {
+            usage();
+            return 2;
+        }
+    }
+
+    if ( arg + 1 != argc )
     {
         usage();
         return 2;
@@ -49,7 +159,7 @@ main( int argc,
         return 2;                               \
     }
    
-    std::string cfgFileName = argv[ 1 ];
+    std::string cfgFileName = argv[ arg ];
 
     std::string dir = osgDB::getFilePath( cfgFileName );
 
@@ -68,13 +178,94 @@ main( int argc,
 
     BRACKET_ERROR( calCoreModel = loadCoreModel( cfgFileName, scale ),
                    "Can't load model:\n%s" );
-    BRACKET_ERROR( loadMeshes( calCoreModel, meshesData ),
+    BRACKET_ERROR( loadMeshes( calCoreModel, meshesData, maxBonesPerMesh ),
                    "Can't load meshes from core model:\n%s" );
     BRACKET_ERROR( saveMeshes( calCoreModel,
                                meshesData,
                                meshesCacheFileName( cfgFileName ) ),
                    "Can't save meshes cache:\n%s" );
 
+    // -- Bake palettes (from original keys, before reduction) --
+    std::string palettesFileName = paletteAnimationsCacheFileName( cfgFileName );
+
+    if ( palettesFrameRate > 0 )
+    {
+        PaletteAnimations palettes;
+        size_t palettesSize = 0;
+
+        for ( int i = 0; i < calCoreModel->getCoreAnimationCount(); i++ )
+        {
+            PaletteAnimation* p = 0;
+
+            BRACKET_ERROR( p = new PaletteAnimation( calCoreModel, i, palettesFrameRate ),
+                           "Can't bake palettes:\n%s" );
+
+            palettes.push_back( p );
+            palettesSize += p->getDataSize();
+        }
+
+        BRACKET_ERROR( savePaletteAnimations( palettes, palettesFileName ),
+                       "Can't save palettes cache:\n%s" );
+
+        printf( "\n  palettes: %d animations at %g fps, %u bytes",
+                (int)palettes.size(), palettesFrameRate, (unsigned)palettesSize );
+    }
+    else if ( remove( palettesFileName.c_str() ) == 0 )
+    {
+        // otherwise stale palettes will be loaded
+        printf( "\n  removed old %s", palettesFileName.c_str() );
+    }
+
+    // -- Compress animations --
+    std::string animationsFileName = animationsCacheFileName( cfgFileName );
+
+    if ( compressAnimations )
+    {
+        if ( reduceKeys )
+        {
+            const int keysCount = keyframesCount( calCoreModel );
+
+            reduceKeyframes( calCoreModel, maxRotationError, maxTranslationError );
+
+            printf( "\n  keyframes reduced from %d to %d",
+                    keysCount, keyframesCount( calCoreModel ) );
+        }
+
+        CompressedAnimations animations;
+        size_t calSize = 0;
+        size_t compressedSize = 0;
+        float  rotationError = 0;
+        float  translationError = 0;
+
+        for ( int i = 0; i < calCoreModel->getCoreAnimationCount(); i++ )
+        {
+            CalCoreAnimation* a = calCoreModel->getCoreAnimation( i );
+            CompressedAnimation* ca =
+                new CompressedAnimation( a, maxRotationError, maxTranslationError );
+
+            animations.push_back( ca );
+
+            calSize += calAnimationSize( a );
+            compressedSize += ca->getDataSize();
+            rotationError = std::max( rotationError, ca->rotationError );
+            translationError = std::max( translationError, ca->translationError );
+        }
+
+        BRACKET_ERROR( saveAnimations( animations, animationsFileName ),
+                       "Can't save animations cache:\n%s" );
+
+        printf( "\n  animations: %d, cal3d keys %u bytes, compressed %u bytes"
+                "\n  max rotation error %g, max translation error %g\n",
+                (int)animations.size(),
+                (unsigned)calSize, (unsigned)compressedSize,
+                rotationError, translationError );
+    }
+    else if ( remove( animationsFileName.c_str() ) == 0 )
+    {
+        // otherwise stale animations will be loaded instead of .caf files
+        printf( "\n  removed old %s\n", animationsFileName.c_str() );
+    }
+
     delete calCoreModel;
 
     puts( "ok" );
@@ -0,0 +1,464 @@
+/*
+    Copyright (C) 2008 Vladimir Shabanov <vshabanoff@gmail.com>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <algorithm>
+#include <functional>
+
+#include <osg/ref_ptr>
+
+#include <osgCal/Skinning>
+
+using namespace osgCal;
+
+// Runs scalar, SSE and AVX skinning kernels on the same random
+// mesh and checks that SIMD results match the scalar ones. Returns
+// non zero when they don't.
+
+static const int   VERTICES = 1003; // not multiple of 4 or 8 to test tails
+// small palette has identity at IDENTITY_INDEX, large one is
+// indexed past 31 bones
+static const int   BONES[]  = { 20, 200 };
+static const float EPSILON  = 1e-5f;
+
+static
+const char*
+kernelName( SkinningKernel k )
+{
+    switch ( k )
+    {
+        case SKINNING_SCALAR: return "scalar";
+        case SKINNING_SSE:    return "sse";
+        case SKINNING_AVX:    return "avx";
+        default:              return "auto";
+    }
+}
+
+static
+float
+randomFloat( float min,
+             float max )
+{
+    return min + ( max - min ) * ( rand() / (float)RAND_MAX );
+}
+
+// -- Input --
+
+/**
+ * Random mesh in both interleaved (AoS) and SoA streams layouts.
+ */
+struct TestMesh
+{
+        std::vector< osg::Vec3f >                       vertices;
+        std::vector< NormalBuffer::value_type >         normals;
+        std::vector< osg::Vec4f >                       weights;
+        std::vector< MatrixIndexBuffer::value_type >    matrixIndices;
+        osg::ref_ptr< SkinningStreams >                 streams;
+};
+
+/**
+ * Matrix index of unrigged vertices: identity bone of small
+ * palettes, last (identity) bone of large ones like MeshLoader adds.
+ */
+static
+int
+unriggedIndex( int bones )
+{
+    return bones <= SkinningPalette::IDENTITY_INDEX
+        ? (int)SkinningPalette::IDENTITY_INDEX
+        : bones - 1;
+}
+
+static
+void
+makeMesh( int       bones,
+          int       maxBonesInfluence,
+          TestMesh& m )
+{
+    m.vertices.resize( VERTICES );
+    m.normals.resize( VERTICES );
+    m.weights.resize( VERTICES );
+    m.matrixIndices.resize( VERTICES );
+
+    for ( int i = 0; i < VERTICES; i++ )
+    {
+        m.vertices[i].set( randomFloat( -2, 2 ), randomFloat( -2, 2 ), randomFloat( -2, 2 ) );
+
+        osg::Vec3f n( randomFloat( -1, 1 ), randomFloat( -1, 1 ), randomFloat( -1, 1 ) );
+        n.normalize();
+        m.normals[i] = n;
+
+        osg::Vec4f&                    w  = m.weights[i];
+        MatrixIndexBuffer::value_type& mi = m.matrixIndices[i];
+
+        // unused influences have zero weight and garbage index
+        // (kernels must not read outside of palette)
+        w.set( 0, 0, 0, 0 );
+        for ( int k = 0; k < 4; k++ )
+        {
+            mi[k] = rand() % 256;
+        }
+
+        if ( i % 17 == 0 ) // unrigged vertex (see MeshLoader)
+        {
+            w[0] = 1.0f;
+            mi[0] = unriggedIndex( bones );
+            continue;
+        }
+
+        const int influences = 1 + rand() % maxBonesInfluence;
+        float     sum = 0;
+
+        for ( int k = 0; k < influences; k++ )
+        {
+            w[k] = randomFloat( 0.05f, 1.0f );
+            mi[k] = rand() % bones;
+            sum += w[k];
+        }
+
+        // weights are normalized and sorted in descending order
+        std::sort( &w[0], &w[0] + influences, std::greater< float >() );
+        for ( int k = 0; k < influences; k++ )
+        {
+            w[k] /= sum;
+        }
+    }
+
+    // the same layout as buildSkinningStreams makes
+    m.streams = new SkinningStreams;
+    SkinningStreams& s = *m.streams;
+
+    s.count = VERTICES;
+    s.paddedCount = ( s.count + SkinningStreams::PADDING - 1 )
+        / SkinningStreams::PADDING * SkinningStreams::PADDING;
+
+    s.x.resize( s.paddedCount, 0.0f );
+    s.y.resize( s.paddedCount, 0.0f );
+    s.z.resize( s.paddedCount, 0.0f );
+    s.nx.resize( s.paddedCount, 0.0f );
+    s.ny.resize( s.paddedCount, 0.0f );
+    s.nz.resize( s.paddedCount, 0.0f );
+
+    for ( int k = 0; k < 4; k++ )
+    {
+        s.weights[ k ].resize( s.paddedCount, 0.0f );
+        s.matrixIndices[ k ].resize( s.paddedCount, 0 );
+    }
+
+    for ( int i = 0; i < VERTICES; i++ )
+    {
+        s.x[i] = m.vertices[i].x();
+        s.y[i] = m.vertices[i].y();
+        s.z[i] = m.vertices[i].z();
+
+        const osg::Vec3f n = m.normals[i];
+        s.nx[i] = n.x();
+        s.ny[i] = n.y();
+        s.nz[i] = n.z();
+
+        for ( int k = 0; k < 4; k++ )
+        {
+            s.weights[ k ][ i ] = m.weights[i][k];
+            s.matrixIndices[ k ][ i ] = m.matrixIndices[i][k];
+        }
+    }
+}
+
+static
+void
+makePalette( int              bones,
+             SkinningPalette& p )
+{
+    p.resize( bones );
+
+    for ( int b = 0; b < bones; b++ )
+    {
+        // rotation from random unit quaternion
+        float x = randomFloat( -1, 1 );
+        float y = randomFloat( -1, 1 );
+        float z = randomFloat( -1, 1 );
+        float w = randomFloat( -1, 1 );
+        float l = sqrtf( x*x + y*y + z*z + w*w );
+        x /= l; y /= l; z /= l; w /= l;
+
+        osg::Matrix3 r( 1 - 2*(y*y + z*z),     2*(x*y - z*w),     2*(x*z + y*w),
+                            2*(x*y + z*w), 1 - 2*(x*x + z*z),     2*(y*z - x*w),
+                            2*(x*z - y*w),     2*(y*z + x*w), 1 - 2*(x*x + y*y) );
+
+        p.set( b, r, osg::Vec3f( randomFloat( -5, 5 ), randomFloat( -5, 5 ), randomFloat( -5, 5 ) ) );
+    }
+
+    p.setIdentity( unriggedIndex( bones ) );
+}
+
+// -- Output --
+
+struct Result
+{
+        std::vector< osg::Vec3f >   vertices;
+        std::vector< osg::Vec3f >   normals;
+        osg::BoundingBox            bb;
+};
+
+enum Layout
+{
+    AOS,
+    STREAMS,
+    STREAMS_CHUNKED, // two calls with odd first vertex
+    LAYOUTS_COUNT
+};
+
+static const char* layoutNames[] = { "AoS", "SoA", "SoA chunked" };
+
+static
+void
+skin( const SkinningPalette& p,
+      int                    maxBonesInfluence,
+      const TestMesh&        m,
+      Layout                 layout,
+      bool                   normals,
+      Result&                r )
+{
+    r.vertices.assign( VERTICES, osg::Vec3f() );
+    r.normals.assign( VERTICES, osg::Vec3f() );
+    r.bb.init();
+
+    if ( layout == AOS )
+    {
+        if ( normals )
+        {
+            skinVerticesAndNormals( p, maxBonesInfluence,
+                                    &m.vertices.front(), &m.normals.front(),
+                                    &m.weights.front(), &m.matrixIndices.front(),
+                                    &r.vertices.front(), &r.normals.front(),
+                                    VERTICES, r.bb );
+        }
+        else
+        {
+            skinVertices( p, maxBonesInfluence,
+                          &m.vertices.front(),
+                          &m.weights.front(), &m.matrixIndices.front(),
+                          &r.vertices.front(),
+                          VERTICES, r.bb );
+        }
+        return;
+    }
+
+    const size_t split = ( layout == STREAMS_CHUNKED ? 517 : VERTICES );
+    const size_t first[2] = { 0, split };
+    const size_t count[2] = { split, VERTICES - split };
+
+    for ( int c = 0; c < 2; c++ )
+    {
+        if ( count[c] == 0 )
+        {
+            continue;
+        }
+
+        if ( normals )
+        {
+            skinVerticesAndNormals( p, maxBonesInfluence, *m.streams, first[c],
+                                    &r.vertices[ first[c] ], &r.normals[ first[c] ],
+                                    count[c], r.bb );
+        }
+        else
+        {
+            skinVertices( p, maxBonesInfluence, *m.streams, first[c],
+                          &r.vertices[ first[c] ],
+                          count[c], r.bb );
+        }
+    }
+}
+
+static
+bool
+equal( const osg::Vec3f& a,
+       const osg::Vec3f& b )
+{
+    for ( int i = 0; i < 3; i++ )
+    {
+        if ( fabsf( a[i] - b[i] ) > EPSILON * std::max( 1.0f, fabsf( a[i] ) ) )
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Compare result with reference one, print first mismatch.
+ */
+static
+bool
+compare( const Result& reference,
+         const Result& r,
+         bool          normals )
+{
+    for ( int i = 0; i < VERTICES; i++ )
+    {
+        if ( !equal( reference.vertices[i], r.vertices[i] ) )
+        {
+            printf( "      vertex %d: (%g %g %g) != (%g %g %g)\n", i,
+                    r.vertices[i].x(), r.vertices[i].y(), r.vertices[i].z(),
+                    reference.vertices[i].x(), reference.vertices[i].y(), reference.vertices[i].z() );
+            return false;
+        }
+
+        if ( normals && !equal( reference.normals[i], r.normals[i] ) )
+        {
+            printf( "      normal %d: (%g %g %g) != (%g %g %g)\n", i,
+                    r.normals[i].x(), r.normals[i].y(), r.normals[i].z(),
+                    reference.normals[i].x(), reference.normals[i].y(), reference.normals[i].z() );
+            return false;
+        }
+    }
+
+    if ( !equal( reference.bb._min, r.bb._min )
+         || !equal( reference.bb._max, r.bb._max ) )
+    {
+        printf( "      bounding box differs\n" );
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * Compare transformDistance2 of kernel with scalar one on random
+ * transforms.
+ */
+static
+bool
+testTransformDistance( SkinningKernel k )
+{
+    for ( int i = 0; i < 100; i++ )
+    {
+        osg::Matrix3 r[2];
+        osg::Vec3f   t[2];
+
+        for ( int j = 0; j < 2; j++ )
+        {
+            r[j].set( randomFloat( -1, 1 ), randomFloat( -1, 1 ), randomFloat( -1, 1 ),
+                      randomFloat( -1, 1 ), randomFloat( -1, 1 ), randomFloat( -1, 1 ),
+                      randomFloat( -1, 1 ), randomFloat( -1, 1 ), randomFloat( -1, 1 ) );
+            t[j].set( randomFloat( -5, 5 ), randomFloat( -5, 5 ), randomFloat( -5, 5 ) );
+        }
+
+        setSkinningKernel( SKINNING_SCALAR );
+        const float reference = transformDistance2( r[0], t[0], r[1], t[1] );
+
+        setSkinningKernel( k );
+        const float d = transformDistance2( r[0], t[0], r[1], t[1] );
+
+        if ( fabsf( d - reference ) > EPSILON * std::max( 1.0f, reference )
+             || transformDistance2( r[0], t[0], r[0], t[0] ) != 0.0f )
+        {
+            printf( "      transform distance %g != %g\n", d, reference );
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// -- Main --
+
+int
+main( int,
+      const char** )
+{
+    srand( 1 );
+
+    const SkinningKernel kernels[] = { SKINNING_SSE, SKINNING_AVX };
+    int failures = 0;
+
+    for ( size_t bi = 0; bi < sizeof ( BONES ) / sizeof ( BONES[0] ); bi++ )
+    {
+        const int bones = BONES[ bi ];
+
+        SkinningPalette palette;
+        makePalette( bones, palette );
+
+        for ( int influences = 1; influences <= 4; influences++ )
+        {
+            TestMesh mesh;
+            makeMesh( bones, influences, mesh );
+
+            for ( int layout = 0; layout < LAYOUTS_COUNT; layout++ )
+            {
+                for ( int normals = 0; normals < 2; normals++ )
+                {
+                    Result reference;
+                    setSkinningKernel( SKINNING_SCALAR );
+                    skin( palette, influences, mesh, (Layout)layout, normals != 0, reference );
+
+                    for ( size_t k = 0; k < sizeof ( kernels ) / sizeof ( kernels[0] ); k++ )
+                    {
+                        setSkinningKernel( kernels[k] );
+
+                        if ( getSkinningKernel() != kernels[k] )
+                        {
+                            continue; // not supported
+                        }
+
+                        Result r;
+                        skin( palette, influences, mesh, (Layout)layout, normals != 0, r );
+
+                        const bool ok = compare( reference, r, normals != 0 );
+
+                        printf( "%-6s %3d bones, %d influences, %-11s %-8s %s\n",
+                                kernelName( kernels[k] ), bones, influences,
+                                layoutNames[ layout ],
+                                normals ? "normals" : "",
+                                ok ? "ok" : "FAILED" );
+
+                        failures += ok ? 0 : 1;
+                    }
+                }
+            }
+        }
+    }
+
+    for ( size_t k = 0; k < sizeof ( kernels ) / sizeof ( kernels[0] ); k++ )
+    {
+        setSkinningKernel( kernels[k] );
+
+        if ( getSkinningKernel() != kernels[k] )
+        {
+            continue; // not supported
+        }
+
+        const bool ok = testTransformDistance( kernels[k] );
+
+        printf( "%-6s transform distance          %s\n",
+                kernelName( kernels[k] ), ok ? "ok" : "FAILED" );
+
+        failures += ok ? 0 : 1;
+    }
+
+    setSkinningKernel( SKINNING_AUTO );
+
+    if ( failures )
+    {
+        printf( "%d failures\n", failures );
+    }
+
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,290 @@
+/*
+    Copyright (C) 2008 Vladimir Shabanov <vshabanoff@gmail.com>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <stdexcept>
+
+#include <osg/Camera>
+#include <osg/GraphicsContext>
+#include <osg/Image>
+#include <osg/Viewport>
+#include <osgViewer/Viewer>
+
+#include <osgCal/CoreModel>
+#include <osgCal/Crowd>
+#include <osgCal/Model>
+
+using namespace osgCal;
+
+void
+usage()
+{
+    puts( "Usage: osgCalSmokeTest [-frames N] <cal3d.cfg file name>\n"
+          "\n"
+          "Draws animated model into offscreen pbuffer using display\n"
+          "lists, vertex buffer objects, bone palette texture and\n"
+          "instanced crowd, and fails when nothing is drawn or OpenGL\n"
+          "reports errors. Works headless with Mesa llvmpipe, e.g.:\n"
+          "\n"
+          "  LIBGL_ALWAYS_SOFTWARE=1 xvfb-run osgCalSmokeTest models/paladin/cal3d.cfg" );
+}
+
+static const int WIDTH  = 256;
+static const int HEIGHT = 256;
+
+enum Mode
+{
+    DISPLAY_LISTS,
+    BUFFER_OBJECTS,
+    BONE_PALETTE_TEXTURE,
+    CROWD,
+    MODES_COUNT
+};
+
+static const char* modeNames[] = { "display lists", "buffer objects",
+                                   "bone palette texture", "crowd" };
+
+static const int CROWD_SIZE = 9;
+
+/**
+ * Read back frame after drawing and check OpenGL errors.
+ */
+struct CheckFrame : public osg::Camera::DrawCallback
+{
+        CheckFrame()
+            : image( new osg::Image )
+            , glErrors( false )
+        {}
+
+        virtual void operator () ( osg::RenderInfo& renderInfo ) const
+        {
+            image->readPixels( 0, 0, WIDTH, HEIGHT, GL_RGBA, GL_UNSIGNED_BYTE );
+            glErrors |= renderInfo.getState()->checkGLErrors( "osgCalSmokeTest" );
+        }
+
+        /**
+         * Count of pixels which differ from black clear color.
+         */
+        int drawnPixels() const
+        {
+            const unsigned char* p = image->data();
+            int drawn = 0;
+
+            for ( int i = 0; i < WIDTH * HEIGHT; i++, p += 4 )
+            {
+                drawn += ( p[0] | p[1] | p[2] ) ? 1 : 0;
+            }
+
+            return drawn;
+        }
+
+        osg::ref_ptr< osg::Image > image;
+        mutable bool               glErrors;
+};
+
+static
+osg::Node*
+makeScene( CoreModel* coreModel,
+           Mode       mode )
+{
+    const int animNum = coreModel->getAnimationNames().empty() ? -1 : 0;
+
+    if ( mode != CROWD )
+    {
+        Model* model = new Model;
+        model->load( coreModel );
+
+        if ( animNum != -1 )
+        {
+            model->blendCycle( animNum, 1.0f, 0 );
+        }
+
+        return model;
+    }
+
+    // -- Crowd on a small grid --
+    osg::BoundingBox bb;
+    const CoreModel::MeshVector& meshes = coreModel->getMeshes();
+
+    for ( size_t i = 0; i < meshes.size(); i++ )
+    {
+        bb.expandBy( meshes[i]->data->boundingBox );
+    }
+
+    const float step = bb.valid() ? bb.radius() * 2 : 1;
+    const int   side = (int)ceil( sqrt( (double)CROWD_SIZE ) );
+
+    Crowd* crowd = new Crowd;
+    crowd->load( coreModel );
+
+    for ( int i = 0; i < CROWD_SIZE; i++ )
+    {
+        int index = crowd->addInstance(
+            osg::Matrix::translate( (i % side) * step, (i / side) * step, 0 ) );
+
+        if ( animNum != -1 )
+        {
+            crowd->getInstance( index )->getMixer()->blendCycle( animNum, 1.0f, 0 );
+        }
+    }
+
+    return crowd;
+}
+
+/**
+ * Draw model in given mode for some frames, return true when
+ * model is visible and there were no OpenGL errors.
+ */
+static
+bool
+smokeTest( const char* fileName,
+           Mode        mode,
+           int         frames )
+{
+    // -- Load model --
+    osg::ref_ptr< CoreModel >      coreModel = new CoreModel;
+    osg::ref_ptr< MeshParameters > p = new MeshParameters;
+
+    p->useVertexBufferObjects = ( mode != DISPLAY_LISTS );
+
+    if ( mode == BONE_PALETTE_TEXTURE )
+    {
+        p->useBonePaletteTexture = true;
+        coreModel->setMaxBonesPerMesh( Constants::MAX_BONES_PER_PALETTE_MESH );
+    }
+
+    coreModel->load( fileName, p.get() );
+
+    osg::ref_ptr< osg::Node > scene = makeScene( coreModel.get(), mode );
+
+    // -- Setup offscreen viewer --
+    osg::ref_ptr< osg::GraphicsContext::Traits > traits = new osg::GraphicsContext::Traits;
+    traits->x = 0;
+    traits->y = 0;
+    traits->width = WIDTH;
+    traits->height = HEIGHT;
+    traits->red = traits->green = traits->blue = traits->alpha = 8;
+    traits->depth = 24;
+    traits->windowDecoration = false;
+    traits->doubleBuffer = false;
+    traits->pbuffer = true;
+
+    osg::ref_ptr< osg::GraphicsContext > gc =
+        osg::GraphicsContext::createGraphicsContext( traits.get() );
+
+    if ( !gc.valid() )
+    {
+        throw std::runtime_error( "can't create pbuffer" );
+    }
+
+    osg::ref_ptr< CheckFrame > checkFrame = new CheckFrame;
+
+    osgViewer::Viewer viewer;
+    viewer.setThreadingModel( osgViewer::Viewer::SingleThreaded );
+
+    osg::Camera* camera = viewer.getCamera();
+    camera->setGraphicsContext( gc.get() );
+    camera->setViewport( new osg::Viewport( 0, 0, WIDTH, HEIGHT ) );
+    camera->setDrawBuffer( GL_FRONT );
+    camera->setReadBuffer( GL_FRONT );
+    camera->setClearColor( osg::Vec4( 0, 0, 0, 1 ) );
+    camera->setFinalDrawCallback( checkFrame.get() );
+
+    viewer.setSceneData( scene.get() );
+    viewer.realize();
+
+    // -- Look at model from the front (cal3d models are Z-up) --
+    const osg::BoundingSphere bs = scene->getBound();
+    const double              r  = bs.radius() > 0 ? bs.radius() : 1;
+
+    camera->setProjectionMatrixAsPerspective( 45, (double)WIDTH / HEIGHT, r * 0.1, r * 10 );
+    camera->setViewMatrixAsLookAt( bs.center() + osg::Vec3d( 0, -3 * r, 0 ),
+                                   bs.center(),
+                                   osg::Vec3d( 0, 0, 1 ) );
+
+    // -- Draw --
+    int drawn = 0;
+
+    for ( int f = 0; f < frames; f++ )
+    {
+        viewer.frame();
+        drawn = checkFrame->drawnPixels();
+    }
+
+    if ( drawn == 0 )
+    {
+        printf( "      nothing is drawn\n" );
+    }
+
+    if ( checkFrame->glErrors )
+    {
+        printf( "      OpenGL errors\n" );
+    }
+
+    return drawn > 0 && !checkFrame->glErrors;
+}
+
+// -- Main --
+
+int
+main( int argc,
+      const char** argv )
+{
+    int frames = 10;
+    int fileArg = 1;
+
+    if ( argc > 2 && strcmp( argv[1], "-frames" ) == 0 )
+    {
+        frames = atoi( argv[2] );
+        fileArg = 3;
+    }
+
+    if ( argc != fileArg + 1 || frames <= 0 )
+    {
+        usage();
+        return 2;
+    }
+
+    int failures = 0;
+
+    for ( int mode = 0; mode < MODES_COUNT; mode++ )
+    {
+        bool ok = false;
+
+        try
+        {
+            ok = smokeTest( argv[ fileArg ], (Mode)mode, frames );
+        }
+        catch ( std::runtime_error& e )
+        {
+            printf( "      %s\n", e.what() );
+        }
+
+        printf( "%-21s %s\n", modeNames[ mode ], ok ? "ok" : "FAILED" );
+
+        failures += ok ? 0 : 1;
+    }
+
+    if ( failures )
+    {
+        printf( "%d failures\n", failures );
+    }
+
+    return failures ? 1 : 0;
+}
@@ -7,6 +7,8 @@
  * To Public License, Version 2, as published by Sam Hocevar. See
  * http://sam.zoy.org/wtfpl/COPYING for more details.
  */
+#include <math.h>
+
 #include <osgViewer/Viewer>
 #include <osg/ArgumentParser>
 #include <osg/MatrixTransform>
@@ -35,6 +37,7 @@
 
 #include <osgCal/CoreModel>
 #include <osgCal/Model>
+#include <osgCal/Crowd>
 
 osg::Node*
 makeModel( osgCal::CoreModel* cm,
@@ -53,6 +56,44 @@ makeModel( osgCal::CoreModel* cm,
     return model;
 }
 
+/**
+ * Crowd of <code>count</code> instances placed on a square grid.
+ */
+osg::Node*
+makeCrowd( osgCal::CoreModel* cm,
+           int count,
+           int animNum = -1 )
+{
+    osgCal::Crowd* crowd = new osgCal::Crowd();
+
+    crowd->load( cm );
+
+    // -- Grid step from rest pose size --
+    osg::BoundingBox bb;
+    const osgCal::CoreModel::MeshVector& meshes = cm->getMeshes();
+
+    for ( size_t i = 0; i < meshes.size(); i++ )
+    {
+        bb.expandBy( meshes[i]->data->boundingBox );
+    }
+
+    const float step = bb.valid() ? bb.radius() * 2 : 1;
+    const int   side = (int)ceil( sqrt( (double)count ) );
+
+    for ( int i = 0; i < count; i++ )
+    {
+        int index = crowd->addInstance(
+            osg::Matrix::translate( (i % side) * step, (i / side) * step, 0 ) );
+
+        if ( animNum != -1 )
+        {
+            crowd->getInstance( index )->getMixer()->blendCycle( animNum, 1.0f, 0 );
+        }
+    }
+
+    return crowd;
+}
+
 template < typename T >
 T normalize( const T& v )
 {
@@ -255,6 +296,9 @@ main( int argc,
     arguments.getApplicationUsage()->addCommandLineOption("--sw", "Use software skinning and fixed-function drawing");
     arguments.getApplicationUsage()->addCommandLineOption("--hw", "Use hardware (GLSL) skinning and drawing");
     arguments.getApplicationUsage()->addCommandLineOption("--df", "Use depth first meshes (improve performance when pixel shading is a bottleneck)");
+    arguments.getApplicationUsage()->addCommandLineOption("--vbo", "Draw hardware meshes from vertex buffer objects instead of display lists");
+    arguments.getApplicationUsage()->addCommandLineOption("--bone-palette", "Take bones from model wide buffer texture instead of per-mesh uniforms (meshes are not split)");
+    arguments.getApplicationUsage()->addCommandLineOption("--crowd <n>", "Draw n instances of model as hardware instanced crowd (animation keys don't work)");
     arguments.getApplicationUsage()->addCommandLineOption("--no-debug", "Don't display debug information");
     arguments.getApplicationUsage()->addCommandLineOption("--four-window", "Run viewer in four window setup (to test multi-context applications)");
     arguments.getApplicationUsage()->addCommandLineOption("-h or --help","Display command line parameters");
@@ -286,6 +330,10 @@ main( int argc,
         return 1;
     }
     
+    // read before file name lookup, since count is not an option
+    int crowdSize = 0;
+    arguments.read( "--crowd", crowdSize );
+
     std::string fn;
 
     // note currently doesn't delete the loaded file entries from the command line yet...
@@ -325,6 +373,17 @@ main( int argc,
             p->useDepthFirstMesh = true;
         }
 
+        while ( arguments.read( "--vbo" ) )
+        {
+            p->useVertexBufferObjects = true;
+        }
+
+        while ( arguments.read( "--bone-palette" ) )
+        {
+            p->useBonePaletteTexture = true;
+            coreModel->setMaxBonesPerMesh( osgCal::Constants::MAX_BONES_PER_PALETTE_MESH );
+        }
+
         while ( arguments.read( "--sw" ) )
         {
             p->software = true;
@@ -378,6 +437,8 @@ main( int argc,
                     {
                         cm->scale( coreModel->getScale() );
                     }
+
+                    coreModel->bakeAnimations(); // for new and rescaled animations
                 }
             }
             else if ( ext == "cmf" )
@@ -397,9 +458,18 @@ main( int argc,
             return EXIT_FAILURE;
         }
 
-        root->addChild( makeModel( coreModel.get(),
-                                   meshAdder.get(),
-                                   animNum ) );
+        if ( crowdSize > 0 )
+        {
+            root->addChild( makeCrowd( coreModel.get(),
+                                       crowdSize,
+                                       animNum ) );
+        }
+        else
+        {
+            root->addChild( makeModel( coreModel.get(),
+                                       meshAdder.get(),
+                                       animNum ) );
+        }
 
         animationNames = coreModel->getAnimationNames();
     } // end of model's ref_ptr scope
@@ -434,7 +504,12 @@ main( int argc,
     viewer.addEventHandler(new osgViewer::HelpHandler( arguments.getApplicationUsage() ) );
 
     // add the animation toggle handler
-    viewer.addEventHandler( new AnimationToggleHandler( (osgCal::Model*)root->getChild(0), animationNames ) );
+    osgCal::Model* model = dynamic_cast< osgCal::Model* >( root->getChild(0) );
+
+    if ( model )
+    {
+        viewer.addEventHandler( new AnimationToggleHandler( model, animationNames ) );
+    }
     
     // add the pause handler
     bool paused = false;
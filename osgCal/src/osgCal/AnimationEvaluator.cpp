@@ -0,0 +1,725 @@
+/* -*- c++ -*-
+    Copyright (C) 2008 Vladimir Shabanov <vshabanoff@gmail.com>
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+#include <osgCal/AnimationEvaluator>
+#include <osgCal/CoreModel>
+#include <osgCal/Mixer>
+
+using namespace osgCal;
+
+/**
+ * How many keyframes cursor may be advanced before we give up and
+ * use binary search (big time steps or high keyframe rate).
+ */
+static const int MAX_CURSOR_STEPS = 4;
+
+/**
+ * Key times of cal3d track (baked tracks use plain float array).
+ */
+struct TrackTimes
+{
+        CalCoreTrack* track;
+
+        float operator [] ( int i ) const
+        {
+            return track->getCoreKeyframe( i )->getTime();
+        }
+};
+
+/**
+ * Same as CalCoreTrack::getUpperBound(), but returns index.
+ */
+template < typename Times >
+static
+int
+upperBound( const Times& times,
+            int          keysCount,
+            float        time )
+{
+    int lowerBound = 0;
+    int upperBound = keysCount - 1;
+
+    while ( lowerBound < upperBound - 1 )
+    {
+        int middle = ( lowerBound + upperBound ) / 2;
+
+        if ( time >= times[ middle ] )
+        {
+            lowerBound = middle;
+        }
+        else
+        {
+            upperBound = middle;
+        }
+    }
+
+    return upperBound;
+}
+
+/**
+ * Find key after time (as upperBound does) starting from cursor
+ * and update cursor, keysCount must be at least 2.
+ *
+ * Cursor is valid when key before it is not after time, then we
+ * move it forward until key after time is found. Result is the same
+ * as of binary search, since there is only one such key.
+ */
+template < typename Times >
+static
+int
+findKey( const Times& times,
+         int          keysCount,
+         int&         cursor,
+         float        time )
+{
+    int after = cursor;
+
+    if ( after < 1 || after > keysCount - 1
+         || ( after > 1 && time < times[ after - 1 ] ) )
+    {
+        after = upperBound( times, keysCount, time ); // seek or loop
+    }
+    else
+    {
+        for ( int steps = 0;
+              after < keysCount - 1 && time >= times[ after ];
+              steps++ )
+        {
+            if ( steps == MAX_CURSOR_STEPS )
+            {
+                after = upperBound( times, keysCount, time );
+                break;
+            }
+
+            after++;
+        }
+    }
+
+    cursor = after;
+
+    return after;
+}
+
+/**
+ * Same as CalCoreTrack::getState(), but starts keyframe search from
+ * cursor and updates it.
+ */
+static
+void
+getState( CalCoreTrack*  track,
+          int&           cursor,
+          float          time,
+          CalVector&     translation,
+          CalQuaternion& rotation )
+{
+    const int count = track->getCoreKeyframeCount();
+
+    if ( count <= 1 )
+    {
+        if ( count == 1 )
+        {
+            CalCoreKeyframe* k = track->getCoreKeyframe( 0 );
+            translation = k->getTranslation();
+            rotation = k->getRotation();
+        }
+
+        return;
+    }
+
+    TrackTimes times = { track };
+    int after = findKey( times, count, cursor, time );
+
+    // -- Blend keyframes --
+    // (note that cal3d extrapolates before first and after last
+    // keyframes, we do the same)
+    CalCoreKeyframe* before = track->getCoreKeyframe( after - 1 );
+    CalCoreKeyframe* next   = track->getCoreKeyframe( after );
+
+    float blendFactor =
+        ( time - before->getTime() ) / ( next->getTime() - before->getTime() );
+
+    translation = before->getTranslation();
+    translation.blend( blendFactor, next->getTranslation() );
+
+    rotation = before->getRotation();
+    rotation.blend( blendFactor, next->getRotation() );
+}
+
+/**
+ * The same for baked track. When <code>loopDuration</code> is
+ * nonzero tracks are closed (see BakedAnimation::loopClosed) and
+ * after the last key we blend towards the first one at
+ * <code>loopDuration</code>, as cal3d does with the key added by
+ * mixer.
+ */
+static
+void
+getState( const BakedAnimation&        a,
+          const BakedAnimation::Track& track,
+          int&                         cursor,
+          float                        time,
+          float                        loopDuration,
+          CalVector&                   translation,
+          CalQuaternion&               rotation )
+{
+    const int first = track.firstKey;
+
+    if ( track.keysCount <= 1 )
+    {
+        if ( track.keysCount == 1 )
+        {
+            translation = a.translations[ first ];
+            rotation = a.rotations[ first ];
+        }
+
+        return;
+    }
+
+    const int last = first + track.keysCount - 1;
+
+    if ( loopDuration > 0.0f
+         && a.times[ last ] < loopDuration
+         && time >= a.times[ last ] )
+    {
+        float blendFactor =
+            ( time - a.times[ last ] ) / ( loopDuration - a.times[ last ] );
+
+        translation = a.translations[ last ];
+        translation.blend( blendFactor, a.translations[ first ] );
+
+        rotation = a.rotations[ last ];
+        rotation.blend( blendFactor, a.rotations[ first ] );
+
+        cursor = track.keysCount - 1;
+        return;
+    }
+
+    const float* times = &a.times[ first ];
+    int after = first + findKey( times, track.keysCount, cursor, time );
+
+    float blendFactor =
+        ( time - a.times[ after - 1 ] ) / ( a.times[ after ] - a.times[ after - 1 ] );
+
+    translation = a.translations[ after - 1 ];
+    translation.blend( blendFactor, a.translations[ after ] );
+
+    rotation = a.rotations[ after - 1 ];
+    rotation.blend( blendFactor, a.rotations[ after ] );
+}
+
+/**
+ * Dequantized key times of compressed track.
+ */
+struct CompressedTimes
+{
+        const unsigned short* times;
+        float                 timeStep;
+
+        float operator [] ( int i ) const
+        {
+            return times[ i ] * timeStep;
+        }
+};
+
+/**
+ * The same for compressed track.
+ */
+static
+void
+getState( const CompressedAnimation&        a,
+          const CompressedAnimation::Track& track,
+          int&                              cursor,
+          float                             time,
+          CalVector&                        translation,
+          CalQuaternion&                    rotation )
+{
+    if ( track.keysCount <= 1 )
+    {
+        a.getTranslation( track, 0, translation );
+        a.getRotation( track, 0, rotation );
+        return;
+    }
+
+    CompressedTimes times = { &a.times[ track.firstKey ], a.timeStep };
+    const int last = track.keysCount - 1;
+
+    if ( a.loopClosed
+         && a.duration > 0.0f
+         && times.times[ last ] < 65535 // last key is before duration
+         && time >= times[ last ] )
+    {
+        // blend to the first key at duration (see loopClosed)
+        const float lastTime = times[ last ];
+        const float blendFactor = ( time - lastTime ) / ( a.duration - lastTime );
+
+        CalVector firstTranslation;
+        a.getTranslation( track, last, translation );
+        a.getTranslation( track, 0, firstTranslation );
+        translation.blend( blendFactor, firstTranslation );
+
+        CalQuaternion firstRotation;
+        a.getRotation( track, last, rotation );
+        a.getRotation( track, 0, firstRotation );
+        rotation.blend( blendFactor, firstRotation );
+
+        cursor = last;
+        return;
+    }
+
+    int after = findKey( times, track.keysCount, cursor, time );
+
+    // keys can get the same time after quantization
+    const float beforeTime = times[ after - 1 ];
+    const float timeDiff = times[ after ] - beforeTime;
+    const float blendFactor = timeDiff > 0.0f ? ( time - beforeTime ) / timeDiff : 0.0f;
+
+    CalVector nextTranslation;
+    a.getTranslation( track, after - 1, translation );
+    a.getTranslation( track, after, nextTranslation );
+    translation.blend( blendFactor, nextTranslation );
+
+    CalQuaternion nextRotation;
+    a.getRotation( track, after - 1, rotation );
+    a.getRotation( track, after, nextRotation );
+    rotation.blend( blendFactor, nextRotation );
+}
+
+/**
+ * CalSkeleton with the same state interface as FlatSkeleton.
+ */
+struct CalSkeletonAdapter
+{
+        CalSkeleton*                skeleton;
+        std::vector< CalBone* >&    bones;
+
+        void clearState() { skeleton->clearState(); }
+        void lockState() { skeleton->lockState(); }
+        void calculateState() { skeleton->calculateState(); }
+
+        void blendState( int                  boneId,
+                         float                weight,
+                         const CalVector&     translation,
+                         const CalQuaternion& rotation )
+        {
+            bones[ boneId ]->blendState( weight, translation, rotation );
+        }
+
+        bool isBoneLocked( int ) const { return false; } // unknown
+};
+
+/**
+ * Weight of track of bone in animation blended with
+ * <code>weight</code>, zero when track needn't be evaluated
+ * (bone is collapsed, masked out or already fully locked by
+ * previous animations, so blending can't change it).
+ */
+template < typename Skeleton >
+static
+inline
+float
+trackWeight( int                boneId,
+             float              weight,
+             const BoneMask*    mask,
+             const SkeletonLod* skeletonLod,
+             const Skeleton&    skeleton )
+{
+    if ( skeletonLod && skeletonLod->isCollapsed( boneId ) )
+    {
+        return 0.0f;
+    }
+
+    if ( mask )
+    {
+        weight *= mask->getWeight( boneId );
+    }
+
+    if ( weight == 0.0f || skeleton.isBoneLocked( boneId ) )
+    {
+        return 0.0f;
+    }
+
+    return weight;
+}
+
+// -- BoneMask --
+
+BoneMask::BoneMask( CalCoreSkeleton* skeleton,
+                    float            weight )
+    : weights( skeleton->getVectorCoreBone().size(), weight )
+{}
+
+void
+BoneMask::setSubtreeWeight( CalCoreSkeleton* skeleton,
+                            int              boneId,
+                            float            weight )
+{
+    weights[ boneId ] = weight;
+
+    std::list< int >& children = skeleton->getCoreBone( boneId )->getListChildId();
+
+    for ( std::list< int >::iterator c = children.begin(); c != children.end(); ++c )
+    {
+        setSubtreeWeight( skeleton, *c, weight );
+    }
+}
+
+// -- AnimationEvaluator --
+
+AnimationEvaluator::AnimationEvaluator( const CoreModel* cm )
+    : coreModel( cm )
+    , skeletonLod( 0 )
+    , frame( 0 )
+{}
+
+template < typename Skeleton >
+void
+AnimationEvaluator::blendAnimation( CalAnimation*   animation,
+                                    float           time,
+                                    float           weight,
+                                    const BoneMask* mask,
+                                    Skeleton&       skeleton )
+{
+    CalCoreAnimation* coreAnimation = animation->getCoreAnimation();
+
+    // -- Get cursors --
+    Cursors& c = cursors[ animation ];
+
+    if ( c.coreAnimation != coreAnimation )
+    {
+        // new animation (or new one at address of deleted)
+        c.coreAnimation = coreAnimation;
+        c.compressedAnimation = coreModel ? coreModel->getCompressedAnimation( coreAnimation ) : 0;
+        c.bakedAnimation = coreModel ? coreModel->getBakedAnimation( coreAnimation ) : 0;
+        c.keyframes.clear();
+    }
+
+    c.frame = frame;
+
+    if ( weight == 0.0f )
+    {
+        return; // blending with zero weight changes nothing
+    }
+
+    // -- Blend tracks --
+    if ( c.compressedAnimation.valid() )
+    {
+        const CompressedAnimation& a = *c.compressedAnimation;
+
+        c.keyframes.resize( a.tracks.size() );
+        int* cursor = c.keyframes.empty() ? 0 : &c.keyframes.front();
+
+        for ( std::vector< CompressedAnimation::Track >::const_iterator
+                  t    = a.tracks.begin(),
+                  tEnd = a.tracks.end();
+              t != tEnd; ++t, ++cursor )
+        {
+            const int   boneId = t->boneId;
+            const float w = trackWeight( boneId, weight, mask, skeletonLod, skeleton );
+
+            if ( w == 0.0f )
+            {
+                continue;
+            }
+
+            CalVector     translation;
+            CalQuaternion rotation;
+
+            getState( a, *t, *cursor, time, translation, rotation );
+
+            skeleton.blendState( boneId, w, translation, rotation );
+        }
+    }
+    else if ( c.bakedAnimation.valid() )
+    {
+        const BakedAnimation& a = *c.bakedAnimation;
+
+        // CalMixer closes the loop only in cal3d tracks, so we also
+        // check whether they got more keys than baked ones
+        const bool loopClosed =
+            a.loopClosed
+            || ( !a.tracks.empty()
+                 && coreAnimation->getListCoreTrack().front()->getCoreKeyframeCount()
+                    > a.tracks.front().keysCount );
+        const float loopDuration = loopClosed ? coreAnimation->getDuration() : 0.0f;
+
+        c.keyframes.resize( a.tracks.size() );
+        int* cursor = c.keyframes.empty() ? 0 : &c.keyframes.front();
+
+        for ( std::vector< BakedAnimation::Track >::const_iterator
+                  t    = a.tracks.begin(),
+                  tEnd = a.tracks.end();
+              t != tEnd; ++t, ++cursor )
+        {
+            const int   boneId = t->boneId;
+            const float w = trackWeight( boneId, weight, mask, skeletonLod, skeleton );
+
+            if ( w == 0.0f )
+            {
+                continue;
+            }
+
+            CalVector     translation;
+            CalQuaternion rotation;
+
+            getState( a, *t, *cursor, time, loopDuration, translation, rotation );
+
+            skeleton.blendState( boneId, w, translation, rotation );
+        }
+    }
+    else
+    {
+        std::list< CalCoreTrack* >& tracks = coreAnimation->getListCoreTrack();
+
+        c.keyframes.resize( tracks.size() );
+        int* cursor = c.keyframes.empty() ? 0 : &c.keyframes.front();
+
+        for ( std::list< CalCoreTrack* >::iterator
+                  t    = tracks.begin(),
+                  tEnd = tracks.end();
+              t != tEnd; ++t, ++cursor )
+        {
+            const int   boneId = (*t)->getCoreBoneId();
+            const float w = trackWeight( boneId, weight, mask, skeletonLod, skeleton );
+
+            if ( w == 0.0f )
+            {
+                continue;
+            }
+
+            CalVector     translation;
+            CalQuaternion rotation;
+
+            getState( *t, *cursor, time, translation, rotation );
+
+            skeleton.blendState( boneId, w, translation, rotation );
+        }
+    }
+}
+
+template < typename Actions >
+void
+AnimationEvaluator::addActions( const Actions& actions,
+                                Pose&          pose ) const
+{
+    for ( typename Actions::const_iterator
+              a    = actions.begin(),
+              aEnd = actions.end();
+          a != aEnd; ++a )
+    {
+        Layer l = { *a, (*a)->getTime(), (*a)->getWeight(), true,
+                    getBoneMask( (*a)->getCoreAnimation() ) };
+        pose.push_back( l );
+    }
+}
+
+template < typename Cycles >
+void
+AnimationEvaluator::addCycles( const Cycles&  cycles,
+                               float          animationTime,
+                               float          animationDuration,
+                               Pose&          pose ) const
+{
+    for ( typename Cycles::const_iterator
+              c    = cycles.begin(),
+              cEnd = cycles.end();
+          c != cEnd; ++c )
+    {
+        float time;
+
+        if ( (*c)->getState() == CalAnimation::STATE_SYNC )
+        {
+            if ( animationDuration == 0.0f )
+            {
+                time = 0.0f;
+            }
+            else
+            {
+                time = animationTime
+                    * (*c)->getCoreAnimation()->getDuration()
+                    / animationDuration;
+            }
+        }
+        else
+        {
+            time = (*c)->getTime();
+        }
+
+        Layer l = { *c, time, (*c)->getWeight(), false,
+                    getBoneMask( (*c)->getCoreAnimation() ) };
+        pose.push_back( l );
+    }
+}
+
+void
+AnimationEvaluator::getPose( CalMixer* mixer,
+                             Pose&     pose ) const
+{
+    pose.clear();
+    addActions( mixer->getAnimationActionList(), pose );
+    addCycles( mixer->getAnimationCycle(),
+               mixer->getAnimationTime(), mixer->getAnimationDuration(),
+               pose );
+}
+
+void
+AnimationEvaluator::getPose( const Mixer* mixer,
+                             Pose&        pose ) const
+{
+    pose.clear();
+    addActions( mixer->getActions(), pose );
+    addCycles( mixer->getCycles(),
+               mixer->getAnimationTime(), mixer->getAnimationDuration(),
+               pose );
+}
+
+void
+AnimationEvaluator::getPose( const Mixer* mixer,
+                             CalMixer*    calMixer,
+                             Pose&        pose ) const
+{
+    pose.clear();
+    addActions( mixer->getActions(), pose );
+    addActions( calMixer->getAnimationActionList(), pose );
+    addCycles( mixer->getCycles(),
+               mixer->getAnimationTime(), mixer->getAnimationDuration(),
+               pose );
+    addCycles( calMixer->getAnimationCycle(),
+               calMixer->getAnimationTime(), calMixer->getAnimationDuration(),
+               pose );
+}
+
+void
+AnimationEvaluator::setBoneMask( CalCoreAnimation* animation,
+                                 const BoneMask*   mask )
+{
+    if ( mask )
+    {
+        boneMasks[ animation ] = mask;
+    }
+    else
+    {
+        boneMasks.erase( animation );
+    }
+}
+
+const BoneMask*
+AnimationEvaluator::getBoneMask( CalCoreAnimation* animation ) const
+{
+    if ( boneMasks.empty() )
+    {
+        return 0;
+    }
+
+    BoneMasksMap::const_iterator m = boneMasks.find( animation );
+
+    return m != boneMasks.end() ? m->second.get() : 0;
+}
+
+void
+AnimationEvaluator::updateSkeleton( CalMixer*    mixer,
+                                    CalSkeleton* skeleton )
+{
+    getPose( mixer, pose );
+    updateSkeleton( pose, skeleton );
+}
+
+void
+AnimationEvaluator::updateSkeleton( const Pose&  pose,
+                                    CalSkeleton* skeleton )
+{
+    CalSkeletonAdapter s = { skeleton, skeleton->getVectorBone() };
+    blendPose( pose, s );
+}
+
+void
+AnimationEvaluator::updateSkeleton( CalMixer*     mixer,
+                                    FlatSkeleton& skeleton )
+{
+    getPose( mixer, pose );
+    updateSkeleton( pose, skeleton );
+}
+
+void
+AnimationEvaluator::updateSkeleton( const Pose&   pose,
+                                    FlatSkeleton& skeleton )
+{
+    blendPose( pose, skeleton );
+}
+
+void
+AnimationEvaluator::updateSkeleton( const Mixer* mixer,
+                                    CalSkeleton* skeleton )
+{
+    getPose( mixer, pose );
+    updateSkeleton( pose, skeleton );
+}
+
+void
+AnimationEvaluator::updateSkeleton( const Mixer*  mixer,
+                                    FlatSkeleton& skeleton )
+{
+    getPose( mixer, pose );
+    updateSkeleton( pose, skeleton );
+}
+
+template < typename Skeleton >
+void
+AnimationEvaluator::blendPose( const Pose& pose,
+                               Skeleton&   skeleton )
+{
+    frame++;
+
+    skeleton.clearState();
+
+    // actions are locked before cycles are blended (as in CalMixer)
+    bool actionsLocked = false;
+
+    for ( Pose::const_iterator
+              l    = pose.begin(),
+              lEnd = pose.end();
+          l != lEnd; ++l )
+    {
+        if ( !l->action && !actionsLocked )
+        {
+            skeleton.lockState();
+            actionsLocked = true;
+        }
+
+        blendAnimation( l->animation, l->time, l->weight, l->mask, skeleton );
+    }
+
+    if ( !actionsLocked )
+    {
+        skeleton.lockState();
+    }
+
+    skeleton.lockState();
+    skeleton.calculateState();
+
+    // -- Forget cursors of finished animations --
+    for ( CursorsMap::iterator i = cursors.begin(); i != cursors.end(); )
+    {
+        if ( i->second.frame != frame )
+        {
+            cursors.erase( i++ );
+        }
+        else
+        {
+            ++i;
+        }
+    }
+}
@@ -0,0 +1,65 @@
+/* -*- c++ -*-
+    Copyright (C) 2008 Vladimir Shabanov <vshabanoff@gmail.com>
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+#include <osgCal/BakedAnimation>
+
+using namespace osgCal;
+
+BakedAnimation::BakedAnimation( CalCoreAnimation* a )
+    : coreAnimation( a )
+    , loopClosed( false )
+{
+    std::list< CalCoreTrack* >& coreTracks = a->getListCoreTrack();
+
+    // -- Count keys --
+    size_t keysCount = 0;
+
+    for ( std::list< CalCoreTrack* >::iterator
+              t    = coreTracks.begin(),
+              tEnd = coreTracks.end();
+          t != tEnd; ++t )
+    {
+        keysCount += (*t)->getCoreKeyframeCount();
+    }
+
+    tracks.reserve( coreTracks.size() );
+    times.reserve( keysCount );
+    rotations.reserve( keysCount );
+    translations.reserve( keysCount );
+
+    // -- Copy keys --
+    for ( std::list< CalCoreTrack* >::iterator
+              t    = coreTracks.begin(),
+              tEnd = coreTracks.end();
+          t != tEnd; ++t )
+    {
+        Track track;
+        track.boneId    = (*t)->getCoreBoneId();
+        track.firstKey  = times.size();
+        track.keysCount = (*t)->getCoreKeyframeCount();
+        tracks.push_back( track );
+
+        for ( int k = 0; k < track.keysCount; k++ )
+        {
+            CalCoreKeyframe* kf = (*t)->getCoreKeyframe( k );
+
+            times.push_back( kf->getTime() );
+            rotations.push_back( kf->getRotation() );
+            translations.push_back( kf->getTranslation() );
+        }
+    }
+}
@@ -0,0 +1,723 @@
+/* -*- c++ -*-
+    Copyright (C) 2008 Vladimir Shabanov <vshabanoff@gmail.com>
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+#include <stdio.h>
+#include <stdexcept>
+#include <algorithm>
+
+#include <osgCal/CompressedAnimation>
+
+#include "FileIO.h"
+
+using namespace osgCal;
+
+// -- Compression --
+
+/**
+ * Angle between two rotations in radians (calculated from chord
+ * length, since acos of dot product is imprecise for small angles).
+ */
+static
+float
+angleBetween( const CalQuaternion& a,
+              const CalQuaternion& b )
+{
+    double la = sqrt( a.x*a.x + a.y*a.y + a.z*a.z + a.w*a.w );
+    double lb = sqrt( b.x*b.x + b.y*b.y + b.z*b.z + b.w*b.w );
+
+    if ( a.x*b.x + a.y*b.y + a.z*b.z + a.w*b.w < 0 )
+    {
+        lb = -lb; // q and -q are the same rotation
+    }
+
+    const double dx = a.x / la - b.x / lb;
+    const double dy = a.y / la - b.y / lb;
+    const double dz = a.z / la - b.z / lb;
+    const double dw = a.w / la - b.w / lb;
+
+    const double chord = sqrt( dx*dx + dy*dy + dz*dz + dw*dw );
+
+    return (float)( 4.0 * asin( chord >= 2.0 ? 1.0 : chord / 2.0 ) );
+}
+
+static
+float
+distanceBetween( const CalVector& a,
+                 const CalVector& b )
+{
+    return sqrtf( (a.x-b.x)*(a.x-b.x) + (a.y-b.y)*(a.y-b.y) + (a.z-b.z)*(a.z-b.z) );
+}
+
+static
+unsigned short
+quantizeUnit( float x,      // [0..1]
+              int   maxValue )
+{
+    int q = (int)floor( x * maxValue + 0.5f );
+    return (unsigned short)( q < 0 ? 0 : ( q > maxValue ? maxValue : q ) );
+}
+
+void
+CompressedAnimation::quantize( const CalQuaternion& q,
+                               QuantizedQuaternion& qq )
+{
+    const float range = 0.70710678f;
+
+    float c[4] = { q.x, q.y, q.z, q.w };
+
+    // normalize, so restored largest component is right
+    const float l = sqrtf( c[0]*c[0] + c[1]*c[1] + c[2]*c[2] + c[3]*c[3] );
+
+    int largest = 0;
+
+    for ( int i = 0; i < 4; i++ )
+    {
+        c[i] /= l;
+
+        if ( fabsf( c[i] ) > fabsf( c[ largest ] ) )
+        {
+            largest = i;
+        }
+    }
+
+    // q and -q are the same rotation, make dropped component positive
+    const float sign = c[ largest ] < 0.0f ? -1.0f : 1.0f;
+
+    unsigned short v[3];
+
+    for ( int i = 0, j = 0; i < 4; i++ )
+    {
+        if ( i != largest )
+        {
+            v[ j++ ] = quantizeUnit( ( sign * c[i] + range ) / ( 2.0f * range ), 32767 );
+        }
+    }
+
+    qq.c[0] = v[0] | ( ( largest & 1 ) << 15 );
+    qq.c[1] = v[1] | ( ( largest >> 1 ) << 15 );
+    qq.c[2] = v[2];
+}
+
+CompressedAnimation::CompressedAnimation()
+    : duration( 0 )
+    , timeStep( 0 )
+    , rotationError( 0 )
+    , translationError( 0 )
+    , loopClosed( false )
+{}
+
+CompressedAnimation::CompressedAnimation( CalCoreAnimation* a,
+                                          float             maxRotationError,
+                                          float             maxTranslationError )
+    : name( a->getName() )
+    , duration( a->getDuration() )
+    , timeStep( a->getDuration() > 0 ? a->getDuration() / 65535.0f : 0.0f )
+    , rotationError( 0 )
+    , translationError( 0 )
+    , loopClosed( false )
+{
+    std::list< CalCoreTrack* >& coreTracks = a->getListCoreTrack();
+
+    for ( std::list< CalCoreTrack* >::iterator
+              ct    = coreTracks.begin(),
+              ctEnd = coreTracks.end();
+          ct != ctEnd; ++ct )
+    {
+        const int n = (*ct)->getCoreKeyframeCount();
+
+        if ( n == 0 )
+        {
+            continue; // cal3d can't evaluate such tracks either
+        }
+
+        std::vector< float >         keyTimes( n );
+        std::vector< CalQuaternion > rotations( n );
+        std::vector< CalVector >     translations( n );
+
+        for ( int k = 0; k < n; k++ )
+        {
+            CalCoreKeyframe* kf = (*ct)->getCoreKeyframe( k );
+            keyTimes[k]     = kf->getTime();
+            rotations[k]    = kf->getRotation();
+            translations[k] = kf->getTranslation();
+        }
+
+        // -- Detect constant channels --
+        float rotationDeviation = 0;
+        float translationDeviation = 0;
+
+        for ( int k = 1; k < n; k++ )
+        {
+            rotationDeviation = std::max( rotationDeviation,
+                                          angleBetween( rotations[k], rotations[0] ) );
+            translationDeviation = std::max( translationDeviation,
+                                             distanceBetween( translations[k], translations[0] ) );
+        }
+
+        const bool constantRotation    = rotationDeviation <= maxRotationError;
+        const bool constantTranslation = translationDeviation <= maxTranslationError;
+
+        Track t;
+        t.boneId    = (*ct)->getCoreBoneId();
+        t.keysCount = ( constantRotation && constantTranslation ) ? 1 : n;
+        t.firstKey  = times.size();
+
+        // -- Times --
+        if ( t.keysCount > 1 )
+        {
+            for ( int k = 0; k < n; k++ )
+            {
+                times.push_back( timeStep > 0
+                                 ? quantizeUnit( keyTimes[k] / duration, 65535 )
+                                 : 0 );
+            }
+        }
+
+        // -- Rotations --
+        if ( constantRotation )
+        {
+            t.rotationFormat = CONSTANT;
+            t.rotationOffset = rawRotations.size();
+            rawRotations.push_back( rotations[0] );
+            rotationError = std::max( rotationError, rotationDeviation );
+        }
+        else
+        {
+            std::vector< QuantizedQuaternion > qr( n );
+            float error = 0;
+
+            for ( int k = 0; k < n; k++ )
+            {
+                CalQuaternion r;
+                quantize( rotations[k], qr[k] );
+                dequantize( qr[k], r );
+                error = std::max( error, angleBetween( r, rotations[k] ) );
+            }
+
+            if ( error <= maxRotationError )
+            {
+                t.rotationFormat = QUANTIZED;
+                t.rotationOffset = quantizedRotations.size();
+                quantizedRotations.insert( quantizedRotations.end(), qr.begin(), qr.end() );
+                rotationError = std::max( rotationError, error );
+            }
+            else
+            {
+                t.rotationFormat = RAW;
+                t.rotationOffset = rawRotations.size();
+                rawRotations.insert( rawRotations.end(), rotations.begin(), rotations.end() );
+            }
+        }
+
+        // -- Translations --
+        if ( constantTranslation )
+        {
+            t.translationFormat = CONSTANT;
+            t.translationOffset = rawTranslations.size();
+            rawTranslations.push_back( translations[0] );
+            translationError = std::max( translationError, translationDeviation );
+        }
+        else
+        {
+            CalVector minV = translations[0];
+            CalVector maxV = translations[0];
+
+            for ( int k = 1; k < n; k++ )
+            {
+                minV.x = std::min( minV.x, translations[k].x );
+                minV.y = std::min( minV.y, translations[k].y );
+                minV.z = std::min( minV.z, translations[k].z );
+                maxV.x = std::max( maxV.x, translations[k].x );
+                maxV.y = std::max( maxV.y, translations[k].y );
+                maxV.z = std::max( maxV.z, translations[k].z );
+            }
+
+            t.translationMin  = minV;
+            t.translationStep = CalVector( ( maxV.x - minV.x ) / 65535.0f,
+                                           ( maxV.y - minV.y ) / 65535.0f,
+                                           ( maxV.z - minV.z ) / 65535.0f );
+
+            std::vector< QuantizedVector > qt( n );
+            float error = 0;
+
+            for ( int k = 0; k < n; k++ )
+            {
+                const CalVector& v = translations[k];
+
+                qt[k].c[0] = maxV.x > minV.x ? quantizeUnit( ( v.x - minV.x ) / ( maxV.x - minV.x ), 65535 ) : 0;
+                qt[k].c[1] = maxV.y > minV.y ? quantizeUnit( ( v.y - minV.y ) / ( maxV.y - minV.y ), 65535 ) : 0;
+                qt[k].c[2] = maxV.z > minV.z ? quantizeUnit( ( v.z - minV.z ) / ( maxV.z - minV.z ), 65535 ) : 0;
+
+                CalVector d( minV.x + qt[k].c[0] * t.translationStep.x,
+                             minV.y + qt[k].c[1] * t.translationStep.y,
+                             minV.z + qt[k].c[2] * t.translationStep.z );
+
+                error = std::max( error, distanceBetween( d, v ) );
+            }
+
+            if ( error <= maxTranslationError )
+            {
+                t.translationFormat = QUANTIZED;
+                t.translationOffset = quantizedTranslations.size();
+                quantizedTranslations.insert( quantizedTranslations.end(), qt.begin(), qt.end() );
+                translationError = std::max( translationError, error );
+            }
+            else
+            {
+                t.translationFormat = RAW;
+                t.translationOffset = rawTranslations.size();
+                rawTranslations.insert( rawTranslations.end(), translations.begin(), translations.end() );
+            }
+        }
+
+        tracks.push_back( t );
+    }
+}
+
+size_t
+CompressedAnimation::getDataSize() const
+{
+    return tracks.size()                * sizeof ( Track )
+        +  times.size()                 * sizeof ( unsigned short )
+        +  quantizedRotations.size()    * sizeof ( QuantizedQuaternion )
+        +  quantizedTranslations.size() * sizeof ( QuantizedVector )
+        +  rawRotations.size()          * sizeof ( CalQuaternion )
+        +  rawTranslations.size()       * sizeof ( CalVector );
+}
+
+// -- Keyframe reduction --
+
+/**
+ * Keys of track in plain arrays.
+ */
+struct TrackKeys
+{
+        std::vector< float >         times;
+        std::vector< CalQuaternion > rotations;
+        std::vector< CalVector >     translations;
+
+        TrackKeys( CalCoreTrack* track )
+        {
+            const int n = track->getCoreKeyframeCount();
+
+            times.resize( n );
+            rotations.resize( n );
+            translations.resize( n );
+
+            for ( int k = 0; k < n; k++ )
+            {
+                CalCoreKeyframe* kf = track->getCoreKeyframe( k );
+                times[k]        = kf->getTime();
+                rotations[k]    = kf->getRotation();
+                translations[k] = kf->getTranslation();
+            }
+        }
+
+        /**
+         * State at time interpolated (or extrapolated) between
+         * keys a and b the same way as CalCoreTrack::getState() does.
+         */
+        void interpolate( int            a,
+                          int            b,
+                          float          time,
+                          CalVector&     translation,
+                          CalQuaternion& rotation ) const
+        {
+            const float timeDiff = times[b] - times[a];
+            const float blendFactor = timeDiff > 0.0f ? ( time - times[a] ) / timeDiff : 0.0f;
+
+            translation = translations[a];
+            translation.blend( blendFactor, translations[b] );
+
+            rotation = rotations[a];
+            rotation.blend( blendFactor, rotations[b] );
+        }
+
+        /**
+         * Check that state at time is reproduced by keys a and b.
+         */
+        bool isReproduced( int                  a,
+                           int                  b,
+                           float                time,
+                           const CalVector&     translation,
+                           const CalQuaternion& rotation,
+                           float                maxRotationError,
+                           float                maxTranslationError ) const
+        {
+            CalVector     t;
+            CalQuaternion r;
+
+            interpolate( a, b, time, t, r );
+
+            return angleBetween( r, rotation ) <= maxRotationError
+                && distanceBetween( t, translation ) <= maxTranslationError;
+        }
+
+        /**
+         * Check that all keys between a and b (and extrapolated
+         * state at animation ends when a or b are the end keys) are
+         * reproduced by keys a and b.
+         */
+        bool isSegmentReproduced( int   a,
+                                  int   b,
+                                  float duration,
+                                  float maxRotationError,
+                                  float maxTranslationError ) const
+        {
+            const int last = times.size() - 1;
+
+            for ( int k = a + 1; k < b; k++ )
+            {
+                if ( !isReproduced( a, b, times[k], translations[k], rotations[k],
+                                    maxRotationError, maxTranslationError ) )
+                {
+                    return false;
+                }
+            }
+
+            CalVector     t;
+            CalQuaternion r;
+
+            if ( a == 0 && times[0] > 0.0f )
+            {
+                interpolate( 0, 1, 0.0f, t, r );
+
+                if ( !isReproduced( a, b, 0.0f, t, r,
+                                    maxRotationError, maxTranslationError ) )
+                {
+                    return false;
+                }
+            }
+
+            if ( b == last && times[ last ] < duration )
+            {
+                interpolate( last - 1, last, duration, t, r );
+
+                if ( !isReproduced( a, b, duration, t, r,
+                                    maxRotationError, maxTranslationError ) )
+                {
+                    return false;
+                }
+            }
+
+            return true;
+        }
+};
+
+/**
+ * Check that all keys of track are within error bounds of the given
+ * state.
+ */
+static
+bool
+isConstant( const TrackKeys&     keys,
+            const CalQuaternion& rotation,
+            const CalVector&     translation,
+            float                maxRotationError,
+            float                maxTranslationError )
+{
+    for ( size_t k = 0; k < keys.times.size(); k++ )
+    {
+        if ( angleBetween( keys.rotations[k], rotation ) > maxRotationError
+             || distanceBetween( keys.translations[k], translation ) > maxTranslationError )
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void
+osgCal::reduceKeyframes( CalCoreModel* coreModel,
+                         float         maxRotationError,
+                         float         maxTranslationError )
+{
+    std::vector< CalCoreBone* >& bones =
+        coreModel->getCoreSkeleton()->getVectorCoreBone();
+
+    // -- Find bones which are at rest pose in all animations --
+    std::vector< bool > restBones( bones.size(), true );
+
+    for ( int i = 0; i < coreModel->getCoreAnimationCount(); i++ )
+    {
+        CalCoreAnimation* a = coreModel->getCoreAnimation( i );
+
+        if ( a == 0 )
+        {
+            continue;
+        }
+
+        std::list< CalCoreTrack* >& coreTracks = a->getListCoreTrack();
+
+        for ( std::list< CalCoreTrack* >::iterator
+                  ct    = coreTracks.begin(),
+                  ctEnd = coreTracks.end();
+              ct != ctEnd; ++ct )
+        {
+            const int boneId = (*ct)->getCoreBoneId();
+
+            if ( boneId >= 0 && boneId < (int)bones.size() && restBones[ boneId ]
+                 && !isConstant( TrackKeys( *ct ),
+                                 bones[ boneId ]->getRotation(),
+                                 bones[ boneId ]->getTranslation(),
+                                 maxRotationError, maxTranslationError ) )
+            {
+                restBones[ boneId ] = false;
+            }
+        }
+    }
+
+    // -- Reduce tracks --
+    for ( int i = 0; i < coreModel->getCoreAnimationCount(); i++ )
+    {
+        CalCoreAnimation* a = coreModel->getCoreAnimation( i );
+
+        if ( a == 0 )
+        {
+            continue;
+        }
+
+        std::list< CalCoreTrack* >& coreTracks = a->getListCoreTrack();
+
+        for ( std::list< CalCoreTrack* >::iterator ct = coreTracks.begin();
+              ct != coreTracks.end(); )
+        {
+            const int boneId = (*ct)->getCoreBoneId();
+
+            if ( boneId >= 0 && boneId < (int)bones.size() && restBones[ boneId ] )
+            {
+                (*ct)->destroy();
+                delete (*ct);
+                ct = coreTracks.erase( ct );
+                continue;
+            }
+
+            const int n = (*ct)->getCoreKeyframeCount();
+
+            if ( n <= 1 )
+            {
+                ++ct;
+                continue;
+            }
+
+            TrackKeys keys( *ct );
+            std::vector< int > keptKeys( 1, 0 );
+
+            if ( !isConstant( keys, keys.rotations[0], keys.translations[0],
+                              maxRotationError, maxTranslationError ) )
+            {
+                // -- Greedily extend segments while they reproduce skipped keys --
+                for ( int first = 0; first < n - 1; )
+                {
+                    int last = first + 1;
+
+                    while ( last < n - 1
+                            && keys.isSegmentReproduced( first, last + 1, a->getDuration(),
+                                                         maxRotationError, maxTranslationError ) )
+                    {
+                        last++;
+                    }
+
+                    keptKeys.push_back( last );
+                    first = last;
+                }
+            }
+
+            if ( (int)keptKeys.size() == n )
+            {
+                ++ct;
+                continue;
+            }
+
+            // -- Replace track with reduced one --
+            CalCoreTrack* track = new CalCoreTrack;
+            track->setCoreBoneId( boneId );
+
+            for ( size_t k = 0; k < keptKeys.size(); k++ )
+            {
+                CalCoreKeyframe* kf = new CalCoreKeyframe;
+                kf->setTime( keys.times[ keptKeys[k] ] );
+                kf->setRotation( keys.rotations[ keptKeys[k] ] );
+                kf->setTranslation( keys.translations[ keptKeys[k] ] );
+                track->addCoreKeyframe( kf );
+            }
+
+            (*ct)->destroy();
+            delete (*ct);
+            *ct = track;
+            ++ct;
+        }
+    }
+}
+
+// -- Compressed animations I/O --
+
+std::string
+osgCal::animationsCacheFileName( const std::string& cfgFileName )
+{
+    return cfgFileName + ".animations.cache";
+}
+
+static const int ANIMATIONS_FILE_VERSION = 0xCA3DA001;
+
+/**
+ * Check that track keys are inside of animation arrays, so broken
+ * file can't crash evaluator.
+ */
+static
+bool
+isTrackValid( const CompressedAnimation&        a,
+              const CompressedAnimation::Track& t )
+{
+    if ( t.boneId < 0 || t.keysCount < 1 || t.firstKey < 0
+         || t.rotationOffset < 0 || t.translationOffset < 0 )
+    {
+        return false;
+    }
+
+    if ( t.keysCount > 1 && (size_t)( t.firstKey + t.keysCount ) > a.times.size() )
+    {
+        return false;
+    }
+
+    const size_t rotationKeys = t.rotationFormat == CompressedAnimation::CONSTANT ? 1 : t.keysCount;
+    const size_t translationKeys = t.translationFormat == CompressedAnimation::CONSTANT ? 1 : t.keysCount;
+
+    const size_t rotationsSize = t.rotationFormat == CompressedAnimation::QUANTIZED
+        ? a.quantizedRotations.size() : a.rawRotations.size();
+    const size_t translationsSize = t.translationFormat == CompressedAnimation::QUANTIZED
+        ? a.quantizedTranslations.size() : a.rawTranslations.size();
+
+    return t.rotationFormat >= CompressedAnimation::CONSTANT
+        && t.rotationFormat <= CompressedAnimation::RAW
+        && t.translationFormat >= CompressedAnimation::CONSTANT
+        && t.translationFormat <= CompressedAnimation::RAW
+        && t.rotationOffset + rotationKeys <= rotationsSize
+        && t.translationOffset + translationKeys <= translationsSize;
+}
+
+void
+osgCal::loadAnimations( const std::string&    fn,
+                        CompressedAnimations& animations )
+{
+    FILE* f = fopen( fn.c_str(), "rb" );
+
+    if ( f == NULL )
+    {
+        throw std::runtime_error( "Can't open " + fn );
+    }
+
+    FileCloser closeOnExit( f );
+
+    // -- Check version --
+    int version;
+
+    READ_I32( version );
+    if ( version != ANIMATIONS_FILE_VERSION )
+    {
+        throw std::runtime_error( "Incorrect file version " + fn + ". Try rerun osgCalPreparer." );
+    }
+
+    // -- Read animations --
+    int animationsCount = 0;
+
+    READ_I32( animationsCount );
+    animations.resize( animationsCount );
+
+    for ( int i = 0; i < animationsCount; i++ )
+    {
+        CompressedAnimation* a = new CompressedAnimation;
+        animations[i] = a;
+
+        int nameBufSize = 0;
+        READ_I32( nameBufSize );
+        if ( nameBufSize < 0 || nameBufSize > 1024 )
+        {
+            throw std::runtime_error( "Incorrect animation name size in " + fn );
+        }
+
+        char name[ 1024 ];
+        if ( nameBufSize > 0 )
+        {
+            READ_( a->name, name, nameBufSize );
+        }
+        a->name = std::string( name, nameBufSize );
+
+        READ_STRUCT( a->duration );
+        READ_STRUCT( a->timeStep );
+        READ_STRUCT( a->rotationError );
+        READ_STRUCT( a->translationError );
+
+        READ_VECTOR( a->tracks );
+        READ_VECTOR( a->times );
+        READ_VECTOR( a->quantizedRotations );
+        READ_VECTOR( a->quantizedTranslations );
+        READ_VECTOR( a->rawRotations );
+        READ_VECTOR( a->rawTranslations );
+
+        for ( size_t t = 0; t < a->tracks.size(); t++ )
+        {
+            if ( !isTrackValid( *a, a->tracks[t] ) )
+            {
+                throw std::runtime_error( "Incorrect track of animation " + a->name
+                                          + " in " + fn );
+            }
+        }
+    }
+}
+
+void
+osgCal::saveAnimations( const CompressedAnimations& animations,
+                        const std::string&          fn )
+{
+    FILE* f = fopen( fn.c_str(), "wb" );
+
+    if ( f == NULL )
+    {
+        throw std::runtime_error( "Can't create " + fn );
+    }
+
+    FileCloser closeOnExit( f );
+
+    WRITE_I32( ANIMATIONS_FILE_VERSION );
+
+    WRITE_I32( animations.size() );
+
+    for ( size_t i = 0; i < animations.size(); i++ )
+    {
+        const CompressedAnimation* a = animations[i].get();
+
+        WRITE_I32( a->name.size() );
+        if ( !a->name.empty() )
+        {
+            WRITE_( a->name, a->name.data(), a->name.size() );
+        }
+
+        WRITE_STRUCT( a->duration );
+        WRITE_STRUCT( a->timeStep );
+        WRITE_STRUCT( a->rotationError );
+        WRITE_STRUCT( a->translationError );
+
+        WRITE_VECTOR( a->tracks );
+        WRITE_VECTOR( a->times );
+        WRITE_VECTOR( a->quantizedRotations );
+        WRITE_VECTOR( a->quantizedTranslations );
+        WRITE_VECTOR( a->rawRotations );
+        WRITE_VECTOR( a->rawTranslations );
+    }
+}
@@ -17,9 +17,46 @@
 */
 #include <osgCal/CoreMesh>
 #include <osgCal/CoreModel>
+#include <osgCal/MeshLoader>
+#include <osgCal/Skinning>
 
 using namespace osgCal;
 
+static
+void
+checkBonesCount( const MeshData*       data,
+                 const MeshParameters* p )
+{
+    if ( !p->software
+         && !p->useBonePaletteTexture
+         && data->getBonesCount() > Constants::MAX_BONES_PER_MESH )
+    {
+        throw std::runtime_error( "CoreMesh: mesh " + data->name + " has too many bones "
+                                  "for shader uniforms, use MeshParameters::useBonePaletteTexture "
+                                  "or lower CoreModel::setMaxBonesPerMesh" );
+    }
+
+    if ( data->getBonesCount() > SkinningPalette::MAX_SIZE )
+    {
+        throw std::runtime_error( "CoreMesh: mesh " + data->name + " has too many bones "
+                                  "for byte matrix indices, lower CoreModel::setMaxBonesPerMesh" );
+    }
+}
+
+static
+void
+prepareSkinningStreams( MeshData*             data,
+                        const MeshParameters* p )
+{
+    if ( p->useSkinningStreams
+         && !data->rigid
+         && ( !data->skinningStreams.valid()
+              || ( p->software && !data->skinningStreams->hasNormals() ) ) )
+    {
+        buildSkinningStreams( data, p->software );
+    }
+}
+
 CoreMesh::CoreMesh( const CoreModel* model,
                     MeshData*        _data,
                     const Material*  _material,
@@ -28,11 +65,14 @@ CoreMesh::CoreMesh( const CoreModel* model,
     , material( const_cast< Material* >( _material ) )
     , parameters( const_cast< MeshParameters* >( _p ) )
     , displayLists( new MeshDisplayLists )
+    , bufferObjects( new MeshBufferObjects )
     , stateSets( new MeshStateSets( model->getStateSetCache(),
                                     _data,
                                     _material,
                                     _p ) )
 {
+    checkBonesCount( data.get(), parameters.get() );
+    prepareSkinningStreams( data.get(), parameters.get() );
 }
 
 CoreMesh::CoreMesh( const CoreModel* model,
@@ -43,16 +83,27 @@ CoreMesh::CoreMesh( const CoreModel* model,
     , material( const_cast< Material* >( newMaterial ) )
     , parameters( const_cast< MeshParameters* >( newP ) )
     , displayLists( mesh->displayLists.get() )
+    , bufferObjects( mesh->bufferObjects.get() )
     , stateSets( new MeshStateSets( model->getStateSetCache(),
                                     mesh->data.get(),
                                     newMaterial,
                                     newP ) )
 {
+    if ( newP->useBonePaletteTexture != mesh->parameters->useBonePaletteTexture )
+    {
+        // matrix indices in display lists and buffers differ
+        displayLists = new MeshDisplayLists;
+        bufferObjects = new MeshBufferObjects;
+    }
+
+    checkBonesCount( data.get(), parameters.get() );
+    prepareSkinningStreams( data.get(), parameters.get() );
 }
 
 void
 CoreMesh::releaseGLObjects( osg::State* state ) const
 {
     displayLists->releaseGLObjects( state );
+    bufferObjects->releaseGLObjects( state );
     stateSets->releaseGLObjects( state );    
 }
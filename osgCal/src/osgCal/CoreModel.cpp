@@ -26,6 +26,7 @@
 #include <osgDB/FileNameUtils>
 
 #include <osgCal/MeshLoader>
+#include <osgCal/CompressedAnimation>
 
 #include <osgCal/CoreModel>
 
@@ -51,6 +52,7 @@ public:
 ////////////////////////////////////////////////////////////////////////////////
 CoreModel::CoreModel()
     : calCoreModel( 0 )
+    , maxBonesPerMesh( Constants::MAX_BONES_PER_MESH )
 {
     stateSetCache = StateSetCache::instance();
 //    stateSetCache = new StateSetCache;
@@ -126,10 +128,14 @@ CoreModel::load( const std::string& cfgFileNameOriginal,
 
     MeshesVector meshesData;
 
+    const bool compressedAnimationsExists =
+        isFileExists( animationsCacheFileName( cfgFileName ) );
+
     if ( isFileExists( meshesCacheFileName( cfgFileName ) ) == false )
     {
-        calCoreModel = loadCoreModel( cfgFileName, scale );
-        loadMeshes( calCoreModel, meshesData );
+        calCoreModel = loadCoreModel( cfgFileName, scale, false,
+                                      compressedAnimationsExists );
+        loadMeshes( calCoreModel, meshesData, maxBonesPerMesh );
     }
     else
     {
@@ -137,11 +143,17 @@ CoreModel::load( const std::string& cfgFileNameOriginal,
         // in any order. So, yes, if cache file doesn't correspond to
         // model we can SIGSEGV.
         calCoreModel =
-            loadCoreModel( cfgFileName, scale, true/*ignoreMeshes*/ );
+            loadCoreModel( cfgFileName, scale, true/*ignoreMeshes*/,
+                           compressedAnimationsExists );
         loadMeshes( meshesCacheFileName( cfgFileName ),
                     calCoreModel, meshesData );
     }
 
+    if ( compressedAnimationsExists )
+    {
+        loadCompressedAnimations( animationsCacheFileName( cfgFileName ) );
+    }
+
     // -- Preparing meshes and materials for fast Model creation --
     for ( MeshesVector::iterator
               meshData = meshesData.begin(),
@@ -177,6 +189,472 @@ CoreModel::load( const std::string& cfgFileNameOriginal,
         animationDurations.push_back(
             calCoreModel->getCoreAnimation( i )->getDuration() );
     }
+
+    bakeAnimations();
+
+    if ( isFileExists( paletteAnimationsCacheFileName( cfgFileName ) ) )
+    {
+        loadPaletteAnimations( paletteAnimationsCacheFileName( cfgFileName ) );
+    }
+}
+
+void
+CoreModel::setMaxBonesPerMesh( int n )
+{
+    if ( calCoreModel )
+    {
+        throw std::runtime_error( "CoreModel::setMaxBonesPerMesh: model already loaded" );
+    }
+
+    if ( n < 1 || n > Constants::MAX_BONES_PER_PALETTE_MESH )
+    {
+        throw std::runtime_error( "CoreModel::setMaxBonesPerMesh: bones count is out of range" );
+    }
+
+    maxBonesPerMesh = n;
+}
+
+void
+CoreModel::loadPaletteAnimations( const std::string& fileName )
+{
+    PaletteAnimations animations;
+
+    osgCal::loadPaletteAnimations( fileName, animations );
+
+    const int bonesCount =
+        calCoreModel->getCoreSkeleton()->getVectorCoreBone().size() + 1;
+
+    if ( animations.size() != animationNames.size() )
+    {
+        throw std::runtime_error(
+            "Palette animations in " + fileName
+            + " don't correspond to model. Try rerun osgCalPreparer." );
+    }
+
+    for ( size_t i = 0; i < animations.size(); i++ )
+    {
+        if ( animations[i]->name != animationNames[i]
+             || animations[i]->bonesCount != bonesCount )
+        {
+            throw std::runtime_error(
+                "Palette animation " + animations[i]->name + " in " + fileName
+                + " doesn't correspond to model. Try rerun osgCalPreparer." );
+        }
+    }
+
+    paletteAnimations.swap( animations );
+}
+
+void
+CoreModel::loadCompressedAnimations( const std::string& fileName )
+{
+    CompressedAnimations animations;
+
+    loadAnimations( fileName, animations );
+
+    const int bonesCount =
+        calCoreModel->getCoreSkeleton()->getVectorCoreBone().size();
+
+    for ( CompressedAnimations::iterator
+              a    = animations.begin(),
+              aEnd = animations.end();
+          a != aEnd; ++a )
+    {
+        for ( size_t t = 0; t < (*a)->tracks.size(); t++ )
+        {
+            if ( (*a)->tracks[t].boneId >= bonesCount )
+            {
+                throw std::runtime_error(
+                    "Animation " + (*a)->name + " in " + fileName
+                    + " doesn't correspond to skeleton. Try rerun osgCalPreparer." );
+            }
+        }
+
+        // Core animation without tracks, only to be played by
+        // osgCal::Mixer (CalMixer refuses to blend track-less
+        // cycles), keys are taken from compressed animation by
+        // AnimationEvaluator.
+        CalCoreAnimation* ca = new CalCoreAnimation;
+        ca->setName( (*a)->name );
+        ca->setDuration( (*a)->duration );
+        calCoreModel->addCoreAnimation( ca );
+
+        compressedAnimations[ ca ] = *a;
+    }
+}
+
+void
+CoreModel::bakeAnimations()
+{
+    bakedAnimations.clear();
+
+    for ( int i = 0; i < calCoreModel->getCoreAnimationCount(); i++ )
+    {
+        CalCoreAnimation* a = calCoreModel->getCoreAnimation( i );
+
+        if ( a // can be null after unloadCoreAnimation
+             && getCompressedAnimation( a ) == 0 )
+        {
+            bakedAnimations[ a ] = new BakedAnimation( a );
+        }
+    }
+}
+
+const BakedAnimation*
+CoreModel::getBakedAnimation( const CalCoreAnimation* a ) const
+{
+    BakedAnimationsMap::const_iterator i = bakedAnimations.find( a );
+
+    if ( i != bakedAnimations.end() )
+    {
+        return i->second.get();
+    }
+    else
+    {
+        return 0;
+    }
+}
+
+BakedAnimation*
+CoreModel::getBakedAnimation( const CalCoreAnimation* a )
+{
+    BakedAnimationsMap::iterator i = bakedAnimations.find( a );
+
+    if ( i != bakedAnimations.end() )
+    {
+        return i->second.get();
+    }
+    else
+    {
+        return 0;
+    }
+}
+
+const PaletteAnimation*
+CoreModel::getPaletteAnimation( int id ) const
+{
+    if ( id >= 0 && id < (int)paletteAnimations.size() )
+    {
+        return paletteAnimations[ id ].get();
+    }
+    else
+    {
+        return 0;
+    }
+}
+
+void
+CoreModel::bakePaletteAnimation( int id,
+                                 float frameRate )
+{
+    if ( id < 0 || id >= calCoreModel->getCoreAnimationCount() )
+    {
+        throw std::runtime_error( "bakePaletteAnimation: invalid animation id" );
+    }
+
+    if ( (int)paletteAnimations.size() < calCoreModel->getCoreAnimationCount() )
+    {
+        paletteAnimations.resize( calCoreModel->getCoreAnimationCount() );
+    }
+
+    paletteAnimations[ id ] = new PaletteAnimation( calCoreModel, id, frameRate, this );
+}
+
+const CompressedAnimation*
+CoreModel::getCompressedAnimation( const CalCoreAnimation* a ) const
+{
+    CompressedAnimationsMap::const_iterator i = compressedAnimations.find( a );
+
+    if ( i != compressedAnimations.end() )
+    {
+        return i->second.get();
+    }
+    else
+    {
+        return 0;
+    }
+}
+
+CompressedAnimation*
+CoreModel::getCompressedAnimation( const CalCoreAnimation* a )
+{
+    CompressedAnimationsMap::iterator i = compressedAnimations.find( a );
+
+    if ( i != compressedAnimations.end() )
+    {
+        return i->second.get();
+    }
+    else
+    {
+        return 0;
+    }
+}
+
+// -- Skeleton LOD --
+
+/**
+ * Fill bone map for subtree of <code>boneId</code>. Bones from
+ * <code>collapsed</code> set and all their children map to the
+ * surviving parent.
+ */
+static
+void
+mapBones( CalCoreSkeleton*           skeleton,
+          int                        boneId,
+          int                        parentId,
+          const std::vector< bool >& collapsed,
+          SkeletonLod*               lod )
+{
+    if ( parentId >= 0 // root bones can't be collapsed
+         && ( collapsed[ boneId ] || lod->isCollapsed( parentId ) ) )
+    {
+        lod->boneMap[ boneId ] = lod->boneMap[ parentId ];
+    }
+    else
+    {
+        lod->boneMap[ boneId ] = boneId;
+        lod->survivingBonesCount++;
+    }
+
+    const std::list< int >& children =
+        skeleton->getCoreBone( boneId )->getListChildId();
+
+    for ( std::list< int >::const_iterator
+              c    = children.begin(),
+              cEnd = children.end();
+          c != cEnd; ++c )
+    {
+        mapBones( skeleton, *c, boneId, collapsed, lod );
+    }
+}
+
+void
+CoreModel::addSkeletonLod( float maxPixelSize,
+                           const std::vector< int >& collapsedBones )
+{
+    CalCoreSkeleton* skeleton = calCoreModel->getCoreSkeleton();
+    const int bonesCount = skeleton->getVectorCoreBone().size();
+
+    std::vector< bool > collapsed( bonesCount, false );
+
+    for ( size_t i = 0; i < collapsedBones.size(); i++ )
+    {
+        if ( collapsedBones[ i ] < 0 || collapsedBones[ i ] >= bonesCount )
+        {
+            throw std::runtime_error( "addSkeletonLod: invalid bone id" );
+        }
+
+        collapsed[ collapsedBones[ i ] ] = true;
+    }
+
+    osg::ref_ptr< SkeletonLod > lod = new SkeletonLod( maxPixelSize );
+    lod->boneMap.resize( bonesCount );
+
+    const std::list< int >& roots = skeleton->getListRootCoreBoneId();
+
+    for ( std::list< int >::const_iterator
+              r    = roots.begin(),
+              rEnd = roots.end();
+          r != rEnd; ++r )
+    {
+        mapBones( skeleton, *r, -1, collapsed, lod.get() );
+    }
+
+    addSkeletonLod( lod.get() );
+}
+
+/**
+ * Calculate bounding box of bone subtree influence. Subtrees
+ * smaller than <code>minRadius</code> are added to
+ * <code>collapsedBones</code>.
+ */
+static
+osg::BoundingBox
+calculateBoneSubtreeBox( CalCoreSkeleton*                     skeleton,
+                         int                                  boneId,
+                         const std::vector< osg::BoundingBox >& boneBoxes,
+                         float                                minRadius,
+                         bool                                 isRoot,
+                         std::vector< int >&                  collapsedBones )
+{
+    osg::BoundingBox box = boneBoxes[ boneId ];
+    std::vector< int > collapsedChildren;
+
+    const std::list< int >& children =
+        skeleton->getCoreBone( boneId )->getListChildId();
+
+    for ( std::list< int >::const_iterator
+              c    = children.begin(),
+              cEnd = children.end();
+          c != cEnd; ++c )
+    {
+        box.expandBy( calculateBoneSubtreeBox( skeleton, *c, boneBoxes, minRadius,
+                                               false, collapsedChildren ) );
+    }
+
+    if ( !isRoot && ( !box.valid() || box.radius() < minRadius ) )
+    {
+        // whole subtree is collapsed with us, no need to list children
+        collapsedBones.push_back( boneId );
+    }
+    else
+    {
+        collapsedBones.insert( collapsedBones.end(),
+                               collapsedChildren.begin(), collapsedChildren.end() );
+    }
+
+    return box;
+}
+
+void
+CoreModel::addSkeletonLod( float maxPixelSize,
+                           float minBoneExtent )
+{
+    CalCoreSkeleton* skeleton = calCoreModel->getCoreSkeleton();
+    const int bonesCount = skeleton->getVectorCoreBone().size();
+
+    // -- Calculate bones influence --
+    std::vector< osg::BoundingBox > boneBoxes( bonesCount );
+    osg::BoundingBox modelBox;
+
+    for ( MeshVector::const_iterator
+              coreMesh = meshes.begin(),
+              coreMeshEnd = meshes.end();
+          coreMesh != coreMeshEnd; ++coreMesh )
+    {
+        const MeshData* d = (*coreMesh)->data.get();
+
+        modelBox.expandBy( d->boundingBox );
+
+        if ( d->rigid )
+        {
+            if ( d->rigidBoneId >= 0 )
+            {
+                boneBoxes[ d->rigidBoneId ].expandBy( d->boundingBox );
+            }
+            continue;
+        }
+
+        const VertexBuffer&      vb  = *d->vertexBuffer.get();
+        const WeightBuffer&      wb  = *d->weightBuffer.get();
+        const MatrixIndexBuffer& mib = *d->matrixIndexBuffer.get();
+
+        for ( size_t i = 0; i < vb.size(); i++ )
+        {
+            for ( int k = 0; k < 4; k++ )
+            {
+                if ( wb[i][k] > 0.0f && mib[i][k] < d->bonesIndices.size() )
+                {
+                    int boneId = d->bonesIndices[ mib[i][k] ];
+
+                    if ( boneId < bonesCount ) // skip unrigged bone
+                    {
+                        boneBoxes[ boneId ].expandBy( vb[i] );
+                    }
+                }
+            }
+        }
+    }
+
+    // -- Collapse small subtrees --
+    std::vector< int > collapsedBones;
+    const std::list< int >& roots = skeleton->getListRootCoreBoneId();
+
+    for ( std::list< int >::const_iterator
+              r    = roots.begin(),
+              rEnd = roots.end();
+          r != rEnd; ++r )
+    {
+        calculateBoneSubtreeBox( skeleton, *r, boneBoxes,
+                                 minBoneExtent * modelBox.radius(),
+                                 true, collapsedBones );
+    }
+
+    addSkeletonLod( maxPixelSize, collapsedBones );
+}
+
+struct SkeletonLodGreater
+{
+        bool operator () ( const osg::ref_ptr< SkeletonLod >& a,
+                           const osg::ref_ptr< SkeletonLod >& b ) const
+        {
+            return a->maxPixelSize > b->maxPixelSize;
+        }
+};
+
+void
+CoreModel::addSkeletonLod( SkeletonLod* lod )
+{
+    if ( calCoreModel == 0 )
+    {
+        throw std::runtime_error( "addSkeletonLod: model is not loaded" );
+    }
+
+    for ( MeshVector::const_iterator
+              coreMesh = meshes.begin(),
+              coreMeshEnd = meshes.end();
+          coreMesh != coreMeshEnd; ++coreMesh )
+    {
+        const CoreMesh* m = coreMesh->get();
+
+        if ( m->data->rigid || m->parameters->software )
+        {
+            lod->meshes.push_back( 0 );
+        }
+        else
+        {
+            lod->meshes.push_back(
+                new CoreMesh( this,
+                              remapMeshBones( m->data.get(), lod->boneMap ),
+                              m->material.get(),
+                              m->parameters.get() ) );
+        }
+    }
+
+    osg::notify( osg::INFO )
+        << "skeleton LOD      : " << lod->survivingBonesCount << " of "
+        << lod->boneMap.size() << " bones below "
+        << lod->maxPixelSize << " pixels" << std::endl;
+
+    skeletonLods.push_back( lod );
+    std::stable_sort( skeletonLods.begin(), skeletonLods.end(), SkeletonLodGreater() );
+}
+
+int
+CoreModel::selectSkeletonLod( float pixelSize ) const
+{
+    int level = 0;
+
+    // levels are sorted from finest to coarsest
+    while ( level < (int)skeletonLods.size()
+            && pixelSize < skeletonLods[ level ]->maxPixelSize )
+    {
+        level++;
+    }
+
+    return level;
+}
+
+const CoreMesh*
+CoreModel::getSkeletonLodMesh( int level,
+                               const CoreMesh* mesh ) const
+{
+    const SkeletonLod* lod = getSkeletonLod( level );
+
+    if ( lod == 0 )
+    {
+        return 0;
+    }
+
+    for ( size_t i = 0; i < meshes.size(); i++ )
+    {
+        if ( meshes[ i ]->data == mesh->data )
+        {
+            return lod->meshes[ i ].get();
+        }
+    }
+
+    return 0;
 }
 
 bool
@@ -234,7 +712,8 @@ struct FileCloser
 CalCoreModel*
 osgCal::loadCoreModel( const std::string& cfgFileName,
                        float& scale,
-                       bool ignoreMeshes )
+                       bool ignoreMeshes,
+                       bool ignoreAnimations )
 {
     // -- Initial loading of model --
     scale = 1.0f;
@@ -309,6 +788,12 @@ osgCal::loadCoreModel( const std::string& cfgFileName,
             }
             else if ( !strcmp( buffer, "animation" ) )
             {
+                if ( ignoreAnimations )
+                {
+                    // compressed animations are loaded from cache
+                    continue;
+                }
+
                 int animationId = calCoreModel->loadCoreAnimation( fullpath );
                 if( animationId < 0 )
                 {
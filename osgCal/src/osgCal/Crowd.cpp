@@ -0,0 +1,408 @@
+/* -*- c++ -*-
+    Copyright (C) 2008 Vladimir Shabanov <vshabanoff@gmail.com>
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+#include <algorithm>
+#include <stdexcept>
+
+#include <osg/NodeCallback>
+#include <osg/Timer>
+
+#include <osgCal/Crowd>
+#include <osgCal/TaskPool>
+
+using namespace osgCal;
+
+/**
+ * Instances updated by one TaskPool task.
+ */
+static const size_t INSTANCES_PER_TASK = 16;
+
+/**
+ * Initial palette capacity (in instances).
+ */
+static const size_t MIN_PALETTE_CAPACITY = 16;
+
+class CrowdUpdateCallback: public osg::NodeCallback 
+{
+    public:
+
+        CrowdUpdateCallback()
+            : previous(0)
+            , prevTime(0)
+        {}
+
+        virtual void operator()( osg::Node*        node,
+                                 osg::NodeVisitor* nv )
+        {
+            Crowd* crowd = static_cast< Crowd* >( node );
+
+            if ( previous == 0 )
+            {
+                previous = timer.tick();
+            }
+            
+            double deltaTime = 0;
+
+            if (!nv->getFrameStamp())
+            {
+                osg::Timer_t current = timer.tick();
+                deltaTime = timer.delta_s(previous, current);
+                previous = current;
+            }
+            else
+            {
+                double time = nv->getFrameStamp()->getSimulationTime();
+                deltaTime = time - prevTime;
+                prevTime = time;
+            }
+
+            crowd->update( deltaTime > 0.0 ? deltaTime : 0.0 );
+            // ^ update even when time is stopped, so added or
+            // moved instances are packed
+
+            traverse(node, nv);
+        }
+
+    private:
+
+        osg::Timer timer;
+        osg::Timer_t previous;
+        double prevTime;
+
+};
+
+void
+Crowd::UpdateTask::run()
+{
+    changed = false;
+
+    for ( size_t i = first; i < end; i++ )
+    {
+        if ( crowd->updateInstance( i, deltaTime ) )
+        {
+            changed = true;
+        }
+    }
+}
+
+// -- Crowd --
+
+Crowd::Crowd()
+    : paletteBonesCount( 0 )
+    , paletteCapacity( 0 )
+{
+    setDataVariance( DYNAMIC ); // instances are added & animated
+}
+
+Crowd::Crowd( const Crowd&, const osg::CopyOp& )
+    : Geode() // to eliminate warning
+{
+    throw std::runtime_error( "Crowd copying is not supported" );
+}
+
+Crowd::~Crowd()
+{
+    setUpdateCallback( 0 );
+}
+
+void
+Crowd::load( CoreModel* _coreModel )
+{
+    if ( coreModel.valid() )
+    {
+        throw std::runtime_error( "Crowd already load" );
+    }
+
+    coreModel = _coreModel;
+    paletteBonesCount =
+        coreModel->getCalCoreModel()->getCoreSkeleton()->getVectorCoreBone().size() + 1;
+
+    // -- Setup palette --
+    palette = new osg::TextureBuffer;
+    palette->setInternalFormat( GL_RGBA32F_ARB );
+    palette->setDataVariance( osg::Object::DYNAMIC );
+
+    reservePalette();
+
+    osg::StateSet* stateSet = getOrCreateStateSet();
+    osg::Uniform*  sampler = new osg::Uniform( osg::Uniform::SAMPLER_BUFFER, "bonePalette" );
+
+    sampler->set( (int)Constants::BONE_PALETTE_TEXTURE_UNIT );
+    instanceStride = new osg::Uniform( "instanceStride", getInstanceStride() );
+
+    stateSet->setTextureAttribute( Constants::BONE_PALETTE_TEXTURE_UNIT, palette.get() );
+    stateSet->addUniform( sampler );
+    stateSet->addUniform( instanceStride.get() );
+
+    // -- Process meshes --
+    const CoreModel::MeshVector& coreMeshes = coreModel->getMeshes();
+    const int                    identityBoneId = paletteBonesCount - 1;
+
+    boneBoundingBoxes.resize( paletteBonesCount );
+
+    for ( size_t i = 0; i < coreMeshes.size(); i++ )
+    {
+        const CoreMesh* mesh = coreMeshes[i].get();
+        const MeshData* data = mesh->data.get();
+        CrowdMesh*      crowdMesh = new CrowdMesh( this, mesh );
+
+        addDrawable( crowdMesh );
+        meshes.push_back( crowdMesh );
+
+        // -- Collect bone boxes --
+        if ( data->rigid )
+        {
+            boneBoundingBoxes[ data->rigidBoneId >= 0 ? data->rigidBoneId : identityBoneId ]
+                .expandBy( data->boundingBox );
+        }
+        else if ( !data->boneBoundingBoxes.empty() )
+        {
+            for ( int b = 0; b < data->getBonesCount(); b++ )
+            {
+                boneBoundingBoxes[ data->getBoneId( b ) ].expandBy( data->boneBoundingBoxes[ b ] );
+            }
+        }
+        else
+        {
+            // no bone boxes, only instance transform is applied
+            // to rest pose box (as for meshes with
+            // noSoftwareVertexUpdate)
+            boneBoundingBoxes[ identityBoneId ].expandBy( data->boundingBox );
+        }
+    }
+
+    setAutoUpdate( true );
+}
+
+int
+Crowd::addInstance( const osg::Matrix& transform )
+{
+    if ( !coreModel.valid() )
+    {
+        throw std::runtime_error( "Crowd::addInstance() -- crowd is not loaded" );
+    }
+
+    Instance instance;
+
+    instance.data = new ModelData( coreModel.get(), 0 );
+    instance.transform = transform;
+
+    instances.push_back( instance );
+    reservePalette();
+
+    return instances.size() - 1;
+}
+
+void
+Crowd::removeInstance( int index )
+{
+    instances.erase( instances.begin() + index );
+
+    // following palettes are shifted, bounds are not
+    for ( size_t i = index; i < instances.size(); i++ )
+    {
+        instances[i].dirty = true;
+    }
+
+    updateInstancesBound();
+}
+
+void
+Crowd::setInstanceTransform( int                index,
+                             const osg::Matrix& transform )
+{
+    Instance& instance = instances[ index ];
+
+    instance.transform = transform;
+    instance.dirty = true;
+}
+
+void
+Crowd::setAutoUpdate( bool enabled )
+{
+    setUpdateCallback( enabled ? new CrowdUpdateCallback() : 0 );
+}
+
+void
+Crowd::update( double deltaTime )
+{
+    if ( instances.empty() )
+    {
+        return;
+    }
+
+    bool changed = false;
+
+    if ( instances.size() <= INSTANCES_PER_TASK )
+    {
+        for ( size_t i = 0; i < instances.size(); i++ )
+        {
+            if ( updateInstance( i, deltaTime ) )
+            {
+                changed = true;
+            }
+        }
+    }
+    else
+    {
+        const size_t tasksCount = ( instances.size() + INSTANCES_PER_TASK - 1 )
+            / INSTANCES_PER_TASK;
+
+        updateTasks.resize( tasksCount );
+        updateTaskPointers.resize( tasksCount );
+
+        for ( size_t i = 0; i < tasksCount; i++ )
+        {
+            UpdateTask& t = updateTasks[i];
+
+            t.crowd = this;
+            t.first = i * INSTANCES_PER_TASK;
+            t.end = std::min( t.first + INSTANCES_PER_TASK, instances.size() );
+            t.deltaTime = deltaTime;
+            updateTaskPointers[i] = &t;
+        }
+
+        getTaskPool()->run( updateTaskPointers );
+
+        for ( size_t i = 0; i < tasksCount; i++ )
+        {
+            changed = changed || updateTasks[i].changed;
+        }
+    }
+
+    if ( changed )
+    {
+        palette->getImage()->dirty(); // upload once per context at next apply
+        updateInstancesBound();
+    }
+}
+
+TaskPool*
+Crowd::getTaskPool() const
+{
+    return taskPool.valid() ? taskPool.get() : TaskPool::instance();
+}
+
+bool
+Crowd::updateInstance( size_t index,
+                       float  deltaTime )
+{
+    Instance& instance = instances[ index ];
+
+    const bool updated = deltaTime > 0 && instance.data->update( deltaTime );
+
+    if ( updated == false && instance.dirty == false )
+    {
+        return false;
+    }
+
+    packInstance( index );
+    instance.dirty = false;
+
+    return true;
+}
+
+void
+Crowd::packInstance( size_t index )
+{
+    Instance&        instance = instances[ index ];
+    const ModelData* data = instance.data.get();
+    GLfloat*         p = (GLfloat*)palette->getImage()->data() + index * getInstanceStride() * 4;
+
+    instance.bound.init();
+
+    for ( int b = 0; b < paletteBonesCount; b++, p += 12 )
+    {
+        // bone followed by instance transform, packed as in
+        // ModelData::packBonePalette
+        const osg::Matrix m = data->getBoneMatrix( b ) * instance.transform;
+
+        for ( int row = 0; row < 3; row++ )
+        {
+            p[ row*4 + 0 ] = m( row, 0 );
+            p[ row*4 + 1 ] = m( row, 1 );
+            p[ row*4 + 2 ] = m( row, 2 );
+            p[ row*4 + 3 ] = m( 3, row );
+        }
+
+        const osg::BoundingBox& bb = boneBoundingBoxes[ b ];
+
+        if ( bb.valid() )
+        {
+            for ( int c = 0; c < 8; c++ )
+            {
+                instance.bound.expandBy( bb.corner( c ) * m );
+            }
+        }
+    }
+}
+
+void
+Crowd::reservePalette()
+{
+    if ( palette->getImage() && instances.size() <= paletteCapacity )
+    {
+        return;
+    }
+
+    size_t capacity = std::max( paletteCapacity * 2, MIN_PALETTE_CAPACITY );
+
+    while ( capacity < instances.size() )
+    {
+        capacity *= 2;
+    }
+
+    osg::Image* image = new osg::Image;
+    image->allocateImage( capacity * getInstanceStride(), 1, 1, GL_RGBA, GL_FLOAT );
+    image->setInternalTextureFormat( GL_RGBA32F_ARB );
+
+    palette->setImage( image );
+    paletteCapacity = capacity;
+
+    // old palettes are not copied, all instances are repacked
+    // at the next update
+    for ( size_t i = 0; i < instances.size(); i++ )
+    {
+        instances[i].dirty = true;
+    }
+}
+
+void
+Crowd::updateInstancesBound()
+{
+    instancesBound.init();
+
+    for ( size_t i = 0; i < instances.size(); i++ )
+    {
+        instancesBound.expandBy( instances[i].bound );
+    }
+
+    for ( size_t i = 0; i < meshes.size(); i++ )
+    {
+        meshes[i]->dirtyBound();
+    }
+}
+
+void
+Crowd::releaseGLObjects( osg::State* state ) const
+{
+    if ( coreModel.valid() )
+    {
+        coreModel->releaseGLObjects( state );
+    }
+    osg::Geode::releaseGLObjects( state ); // crowd meshes & palette
+}
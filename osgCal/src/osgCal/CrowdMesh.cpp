@@ -0,0 +1,200 @@
+/* -*- c++ -*-
+    Copyright (C) 2008 Vladimir Shabanov <vshabanoff@gmail.com>
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+#include <algorithm>
+
+#include <osg/GLExtensions>
+
+#include <osgCal/CrowdMesh>
+#include <osgCal/Crowd>
+#include <osgCal/ShadersCache>
+
+using namespace osgCal;
+
+CrowdMesh::CrowdMesh( const Crowd*    _crowd,
+                      const CoreMesh* _mesh )
+    : crowd( _crowd )
+    , mesh( _mesh )
+    , rigidBoneId( -1 )
+{
+    setUseDisplayList( false );
+    setSupportsDisplayList( false );
+    setDataVariance( DYNAMIC ); // bound changes with instances
+
+    const MeshData* data = mesh->data.get();
+
+    // -- Buffer objects --
+    // core mesh buffers already contain bone ids when they are
+    // compiled for bone palette (and rigid meshes have no matrix
+    // indices at all)
+    if ( data->rigid || mesh->parameters->useBonePaletteTexture )
+    {
+        bufferObjects = mesh->bufferObjects;
+    }
+    else
+    {
+        bufferObjects = new MeshBufferObjects;
+    }
+
+    if ( data->rigid )
+    {
+        rigidBoneId = data->rigidBoneId >= 0
+            ? data->rigidBoneId
+            : crowd->getPaletteBonesCount() - 1; // identity bone
+    }
+
+    // -- State set --
+    // rigid meshes are drawn as meshes with one bone (they have
+    // no matrix transform per instance), crowd has no depth meshes
+    osg::ref_ptr< MeshParameters > p = new MeshParameters( *mesh->parameters );
+    p->useDepthFirstMesh = false;
+
+    setStateSet( crowd->getCoreModel()->getStateSetCache()->hwMeshStateSetCache->get(
+                     const_cast< Material* >( mesh->material.get() ),
+                     std::max( data->maxBonesInfluence, 1 ), p.get(), true ) );
+
+    dirtyBound();
+
+    setUserData( const_cast< MeshParameters* >
+                 ( MeshParameters::defaults() ) /*any referenced*/ );
+    // ^ make this node not redundant and not suitable for merging for osgUtil::Optimizer
+}
+
+static
+void
+drawElementsInstanced( const osg::GLExtensions*     ext,
+                       const IndexBuffer* ib,
+                       GLsizei                      instancesCount )
+{
+    ext->glDrawElementsInstanced( ib->getMode(), ib->getNumIndices(),
+                                  MeshBufferObjects::getIndexType( ib ), 0,
+                                  instancesCount );
+}
+
+void
+CrowdMesh::drawImplementation( osg::RenderInfo& renderInfo ) const
+{
+    const int instancesCount = crowd->getInstancesCount();
+
+    if ( instancesCount == 0 )
+    {
+        return;
+    }
+
+    osg::State& state = *renderInfo.getState();
+    const osg::GLExtensions* ext = osg::GLExtensions::Get( state.getContextID(), true );
+
+    if ( ext->glDrawElementsInstanced == 0 )
+    {
+        return; // no instancing -- no crowd
+    }
+
+    // -- Create buffer objects if not yet exist --
+    state.unbindVertexBufferObject();
+    state.unbindElementBufferObject();
+
+    const MeshBufferObjects::ContextBuffers* buffers =
+        bufferObjects->compile( state, mesh->data.get(), true );
+
+    if ( buffers == 0 )
+    {
+        return; // instanced draw needs buffer objects
+    }
+
+    const osg::Program* stateProgram =
+        static_cast< const osg::Program* >
+        ( state.getLastAppliedAttribute( osg::StateAttribute::PROGRAM ) );
+    const osg::Program::PerContextProgram* program =
+        stateProgram ? stateProgram->getPCP( state ) : 0;
+
+    if ( program == 0 )
+    {
+        return; // shader compilation failed?
+    }
+
+    MeshBufferObjects::bind( state, *buffers, mesh->data.get() );
+
+    if ( rigidBoneId >= 0 )
+    {
+        // constant weight & matrix index instead of arrays
+        state.MultiTexCoord( 2, 1.0f, 0.0f, 0.0f, 0.0f );
+        state.MultiTexCoord( 3, (float)rigidBoneId, 0.0f, 0.0f, 0.0f );
+    }
+
+    // -- Draw all instances --
+    // (front/back faces are drawn separately as in HardwareMesh)
+    const IndexBuffer* ib = mesh->data->indexBuffer.get();
+    bool  transparent = getStateSet()->getRenderingHint() & osg::StateSet::TRANSPARENT_BIN;
+    GLint frontFacing = ShadersCache::getProgramUniforms( program, state ).frontFacing;
+
+    if ( transparent )
+    {
+        glCullFace( GL_FRONT ); // first draw only back faces
+        if ( frontFacing >= 0 )
+        {
+            ext->glUniform1f( frontFacing, 0.0 );
+        }
+        drawElementsInstanced( ext, ib, instancesCount );
+        glCullFace( GL_BACK ); // then draw only front faces
+        if ( frontFacing >= 0 )
+        {
+            ext->glUniform1f( frontFacing, 1.0 );
+        }
+        drawElementsInstanced( ext, ib, instancesCount );
+    }
+    else if ( frontFacing >= 0 )
+    {
+        ext->glUniform1f( frontFacing, 1.0 );
+        drawElementsInstanced( ext, ib, instancesCount );
+        glCullFace( GL_FRONT ); 
+        ext->glUniform1f( frontFacing, 0.0 );
+        drawElementsInstanced( ext, ib, instancesCount );
+        glCullFace( GL_BACK ); // restore backfacing mode
+    }
+    else
+    {
+        drawElementsInstanced( ext, ib, instancesCount );
+    }
+
+    MeshBufferObjects::unbind( state );
+}
+
+void
+CrowdMesh::compileGLObjects( osg::RenderInfo& renderInfo ) const
+{
+    Geometry::compileGLObjects( renderInfo );
+
+    osg::State& state = *renderInfo.getState();
+
+    state.unbindVertexBufferObject();
+    state.unbindElementBufferObject();
+
+    bufferObjects->compile( state, mesh->data.get(), true );
+}
+
+void
+CrowdMesh::releaseGLObjects( osg::State* state ) const
+{
+    Geometry::releaseGLObjects( state );
+    bufferObjects->releaseGLObjects( state );
+}
+
+osg::BoundingBox
+CrowdMesh::computeBoundingBox() const
+{
+    return crowd->getInstancesBound();
+}
@@ -0,0 +1,112 @@
+/* -*- c++ -*-
+    Copyright (C) 2008 Vladimir Shabanov <vshabanoff@gmail.com>
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+#ifndef __OSGCAL__FILE_IO_H__
+#define __OSGCAL__FILE_IO_H__
+
+// Internal helpers for reading and writing cache files (meshes,
+// palette and compressed animations caches). Macros expect FILE* f
+// and std::string fn (file name for error messages) in scope and
+// throw std::runtime_error on failure.
+
+#include <stdio.h>
+#include <string>
+#include <stdexcept>
+
+#if defined(_MSC_VER)
+    typedef int int32_t;
+#else
+#   include <stdint.h>
+#endif
+
+#define READ_( _name, _buf, _size )                                                  \
+    if ( fread( _buf, _size, 1, f ) != 1 )                                           \
+    {                                                                                \
+        throw std::runtime_error( "Can't read "#_name + std::string(" from ") + fn );\
+    }
+
+#define READ( _buf )                                                    \
+    if ( fread( (void*)_buf->getDataPointer(), _buf->getTotalDataSize(), 1, f ) != 1 ) \
+    {                                                                   \
+        throw std::runtime_error( "Can't read "#_buf + std::string(" from ") + fn ); \
+    }
+
+#define READ_I32( _i )   { int32_t _i32_tmp = 0; READ_( _i, &_i32_tmp, 4 ); _i = _i32_tmp; }
+#define READ_STRUCT( _s ) READ_( _s, &_s, sizeof ( _s ) )
+
+#define READ_VECTOR( _v )                                               \
+    {                                                                   \
+        int _size = 0;                                                  \
+        READ_I32( _size );                                              \
+        if ( _size < 0 )                                                \
+        {                                                               \
+            throw std::runtime_error( "Incorrect "#_v" size in " + fn ); \
+        }                                                               \
+        _v.resize( _size );                                             \
+        if ( _size > 0 )                                                \
+        {                                                               \
+            READ_( _v, &_v.front(), _size * sizeof ( _v.front() ) );    \
+        }                                                               \
+    }
+
+#define WRITE_( _name, _buf, _size )                                                 \
+    if ( fwrite( _buf, _size, 1, f ) != 1 )                                          \
+    {                                                                                \
+        throw std::runtime_error( "Can't write "#_name + std::string(" to ") + fn ); \
+    }
+
+#define WRITE( _buf )                                                   \
+    if ( fwrite( _buf->getDataPointer(), _buf->getTotalDataSize(), 1, f ) != 1 ) \
+    {                                                                   \
+        throw std::runtime_error( "Can't write "#_buf + std::string(" to ") + fn ); \
+    }
+
+#define WRITE_I32( _i ) { int32_t _i32_tmp = _i; WRITE_( _i, &_i32_tmp, 4 ); }
+#define WRITE_STRUCT( _s ) WRITE_( _s, &_s, sizeof ( _s ) )
+
+#define WRITE_VECTOR( _v )                                              \
+    {                                                                   \
+        WRITE_I32( _v.size() );                                         \
+        if ( !_v.empty() )                                              \
+        {                                                               \
+            WRITE_( _v, &_v.front(), _v.size() * sizeof ( _v.front() ) ); \
+        }                                                               \
+    }
+
+namespace osgCal
+{
+
+    /**
+     * Simple FILE wrapper, needed to call fclose() on exception.
+     */
+    struct FileCloser
+    {
+            FILE*  f;
+
+            FileCloser( FILE* f )
+                : f( f )
+            {}
+
+            ~FileCloser()
+            {
+                fclose( f );
+            }
+    };
+
+}; // namespace osgCal
+
+#endif
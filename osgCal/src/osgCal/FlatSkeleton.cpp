@@ -0,0 +1,253 @@
+/* -*- c++ -*-
+    Copyright (C) 2008 Vladimir Shabanov <vshabanoff@gmail.com>
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+#include <algorithm>
+#include <list>
+#include <stdexcept>
+
+#include <osgCal/FlatSkeleton>
+
+using namespace osgCal;
+
+FlatSkeleton::FlatSkeleton( CalCoreSkeleton* coreSkeleton )
+    : dirtyBonesCount( 0 )
+    , allDirty( true )
+{
+    std::vector< CalCoreBone* >& coreBones = coreSkeleton->getVectorCoreBone();
+    const int bonesCount = coreBones.size();
+
+    // -- Sort bones in depth-first order --
+    // (subtrees are contiguous, parents go before children)
+    std::vector< int > stack;
+    std::list< int >& roots = coreSkeleton->getListRootCoreBoneId();
+
+    for ( std::list< int >::reverse_iterator r = roots.rbegin(); r != roots.rend(); ++r )
+    {
+        stack.push_back( *r );
+    }
+
+    indices.resize( bonesCount, -1 );
+
+    while ( !stack.empty() )
+    {
+        int boneId = stack.back();
+        stack.pop_back();
+
+        if ( boneId < 0 || boneId >= bonesCount || indices[ boneId ] != -1 )
+        {
+            throw std::runtime_error( "FlatSkeleton::FlatSkeleton() -- invalid bones hierarchy" );
+        }
+
+        CalCoreBone* cb = coreBones[ boneId ];
+        int parentId = cb->getParentId();
+
+        indices[ boneId ] = boneIds.size();
+        boneIds.push_back( boneId );
+        parents.push_back( parentId == -1 ? -1 : indices[ parentId ] );
+        coreTranslations.push_back( cb->getTranslation() );
+        coreRotations.push_back( cb->getRotation() );
+        coreTranslationsBoneSpace.push_back( cb->getTranslationBoneSpace() );
+        coreRotationsBoneSpace.push_back( cb->getRotationBoneSpace() );
+
+        std::list< int >& children = cb->getListChildId();
+
+        for ( std::list< int >::reverse_iterator c = children.rbegin(); c != children.rend(); ++c )
+        {
+            stack.push_back( *c );
+        }
+    }
+
+    if ( (int)boneIds.size() != bonesCount )
+    {
+        throw std::runtime_error( "FlatSkeleton::FlatSkeleton() -- some bones are not reachable from roots" );
+    }
+
+    // -- Initial state --
+    accumulatedWeights.resize( bonesCount, 0.0f );
+    accumulatedWeightsAbsolute.resize( bonesCount, 0.0f );
+    blendTranslations.resize( bonesCount );
+    blendRotations.resize( bonesCount );
+
+    translations = coreTranslations;
+    rotations = coreRotations;
+    translationsAbsolute.resize( bonesCount );
+    rotationsAbsolute.resize( bonesCount );
+    translationsBoneSpace.resize( bonesCount );
+    rotationsBoneSpace.resize( bonesCount );
+    transformMatrices.resize( bonesCount );
+
+    calculatedTranslations.resize( bonesCount );
+    calculatedRotations.resize( bonesCount );
+    dirty.resize( bonesCount, 1 );
+
+    calculateState();
+}
+
+void
+FlatSkeleton::clearState()
+{
+    std::fill( accumulatedWeights.begin(), accumulatedWeights.end(), 0.0f );
+    std::fill( accumulatedWeightsAbsolute.begin(), accumulatedWeightsAbsolute.end(), 0.0f );
+}
+
+void
+FlatSkeleton::blendState( int                  boneId,
+                          float                weight,
+                          const CalVector&     translation,
+                          const CalQuaternion& rotation )
+{
+    // the same as CalBone::blendState()
+    const int i = indices[ boneId ];
+    float& accumulated = accumulatedWeightsAbsolute[ i ];
+
+    if ( accumulated == 0.0f )
+    {
+        blendTranslations[ i ] = translation;
+        blendRotations[ i ] = rotation;
+        accumulated = weight;
+    }
+    else
+    {
+        const float factor = weight / ( accumulated + weight );
+
+        blendTranslations[ i ].blend( factor, translation );
+        blendRotations[ i ].blend( factor, rotation );
+        accumulated += weight;
+    }
+}
+
+void
+FlatSkeleton::lockState()
+{
+    // the same as CalBone::lockState()
+    const int bonesCount = boneIds.size();
+
+    for ( int i = 0; i < bonesCount; i++ )
+    {
+        float& weight = accumulatedWeights[ i ];
+        float& weightAbsolute = accumulatedWeightsAbsolute[ i ];
+
+        if ( weightAbsolute > 1.0f - weight )
+        {
+            weightAbsolute = 1.0f - weight;
+        }
+
+        if ( weightAbsolute > 0.0f )
+        {
+            if ( weight == 0.0f )
+            {
+                translations[ i ] = blendTranslations[ i ];
+                rotations[ i ] = blendRotations[ i ];
+                weight = weightAbsolute;
+            }
+            else
+            {
+                const float factor = weightAbsolute / ( weight + weightAbsolute );
+
+                translations[ i ].blend( factor, blendTranslations[ i ] );
+                rotations[ i ].blend( factor, blendRotations[ i ] );
+                weight += weightAbsolute;
+            }
+
+            weightAbsolute = 0.0f;
+        }
+    }
+}
+
+void
+FlatSkeleton::calculateState()
+{
+    // the same as CalBone::calculateState(), but parents are
+    // calculated before children by order of bones
+    const int bonesCount = boneIds.size();
+
+    dirtyBonesCount = 0;
+
+    for ( int i = 0; i < bonesCount; i++ )
+    {
+        if ( accumulatedWeights[ i ] == 0.0f )
+        {
+            // not touched by any animation
+            translations[ i ] = coreTranslations[ i ];
+            rotations[ i ] = coreRotations[ i ];
+        }
+
+        // -- Check for dirty --
+        const CalVector&     t = translations[ i ];
+        const CalQuaternion& r = rotations[ i ];
+        CalVector&           ct = calculatedTranslations[ i ];
+        CalQuaternion&       cr = calculatedRotations[ i ];
+        const int            parent = parents[ i ];
+
+        if ( !allDirty
+             && ( parent == -1 || !dirty[ parent ] )
+             && t.x == ct.x && t.y == ct.y && t.z == ct.z
+             && r.x == cr.x && r.y == cr.y && r.z == cr.z && r.w == cr.w )
+        {
+            dirty[ i ] = 0;
+            continue;
+        }
+
+        dirty[ i ] = 1;
+        dirtyBonesCount++;
+        ct = t;
+        cr = r;
+
+        // -- Calculate state --
+        CalVector&     translationAbsolute = translationsAbsolute[ i ];
+        CalQuaternion& rotationAbsolute = rotationsAbsolute[ i ];
+
+        translationAbsolute = translations[ i ];
+        rotationAbsolute = rotations[ i ];
+
+        if ( parent != -1 )
+        {
+            translationAbsolute *= rotationsAbsolute[ parent ];
+            translationAbsolute += translationsAbsolute[ parent ];
+            rotationAbsolute *= rotationsAbsolute[ parent ];
+        }
+
+        translationsBoneSpace[ i ] = coreTranslationsBoneSpace[ i ];
+        translationsBoneSpace[ i ] *= rotationAbsolute;
+        translationsBoneSpace[ i ] += translationAbsolute;
+
+        rotationsBoneSpace[ i ] = coreRotationsBoneSpace[ i ];
+        rotationsBoneSpace[ i ] *= rotationAbsolute;
+
+        transformMatrices[ i ] = rotationsBoneSpace[ i ];
+    }
+
+    allDirty = false;
+}
+
+void
+FlatSkeleton::setTranslation( int              index,
+                              const CalVector& translation )
+{
+    translations[ index ] = translation;
+    accumulatedWeightsAbsolute[ index ] = 1.0f;
+    accumulatedWeights[ index ] = 1.0f;
+}
+
+void
+FlatSkeleton::setRotation( int                  index,
+                           const CalQuaternion& rotation )
+{
+    rotations[ index ] = rotation;
+    accumulatedWeightsAbsolute[ index ] = 1.0f;
+    accumulatedWeights[ index ] = 1.0f;
+}
@@ -23,15 +23,67 @@
 //#include <osg/GL2Extensions>
 #include <osg/CullFace>
 
+#include <algorithm>
+
+#include <OpenThreads/Atomic>
+#include <OpenThreads/Mutex>
+#include <OpenThreads/ScopedLock>
+
 #include <osgCal/HardwareMesh>
+#include <osgCal/Skinning>
+#include <osgCal/TaskPool>
 
 using namespace osgCal;
 
+/**
+ * Vertices count in chunk with its own bounding box (see
+ * HardwareMesh::chunkBoundingBoxes).
+ */
+static const size_t BOUNDING_BOX_CHUNK = 256;
+
+/**
+ * Bounding box chunks deformed by one TaskPool task. Meshes with
+ * less chunks are deformed in the calling thread.
+ */
+static const size_t SKINNING_TASK_CHUNKS = 8;
+
+/**
+ * Skeleton LOD is switched by Model::update() which can run in
+ * TaskPool threads (see ModelUpdateScheduler). Switching changes
+ * parents of state sets shared between models and can create
+ * CoreMesh (with state sets from shared StateSetCache, only at
+ * the first switch to level, see HardwareMesh::skeletonLodMeshes),
+ * so switches of all meshes are serialized.
+ */
+static OpenThreads::Mutex skeletonLodMutex;
+
+/**
+ * Source of HardwareMesh::UniformPalette ids. Zero is reserved for
+ * identity palette.
+ */
+static OpenThreads::Atomic uniformPaletteIds;
+
+#ifdef OSG_CAL_BYTE_BUFFERS
+    #define NORMAL_TYPE         GL_BYTE
+#else
+    #define NORMAL_TYPE         GL_FLOAT
+#endif
+
+void
+HardwareMesh::SkinningTask::run()
+{
+    mesh->skinChunks( *palette, firstChunk, endChunk );
+}
+
 
 
 HardwareMesh::HardwareMesh( ModelData*      _modelData,
                             const CoreMesh* _mesh )
     : Mesh( _modelData, _mesh )
+    , verticesValid( false )
+    , currentUniformPalette( 0 )
+    , uniformPaletteValid( false )
+    , skeletonLod( 0 )
 {   
     setUseDisplayList( false );
     setSupportsDisplayList( false );
@@ -77,6 +129,13 @@ HardwareMesh::onParametersChanged( const MeshParameters* previousDs )
     // changed to skinning (in update() method when some animation
     // starts.
 
+    if ( mesh->parameters->useBonePaletteTexture && !mesh->data->rigid )
+    {
+        modelData->getOrCreateBonePalette();
+    }
+
+    uniformPaletteValid = false; // mesh or palette mode could change
+
     // -- Add or remove depth mesh --
     if ( !(mesh->stateSets->staticStateSet.get()->getRenderingHint()
            & osg::StateSet::TRANSPARENT_BIN) ) // no depth meshes for transparent materials
@@ -100,6 +159,73 @@ HardwareMesh::onParametersChanged( const MeshParameters* previousDs )
     }    
 }
 
+void
+HardwareMesh::setSkeletonLod( int level )
+{
+    if ( level == skeletonLod || mesh->data->rigid )
+    {
+        return;
+    }
+
+    OpenThreads::ScopedLock< OpenThreads::Mutex > lock( skeletonLodMutex );
+
+    if ( skeletonLod == 0 )
+    {
+        baseMesh = mesh; // parameters could be changed since last switch
+    }
+
+    const CoreModel* cm = modelData->getCoreModel();
+    const CoreMesh*  target =
+        level == 0 ? baseMesh.get() : cm->getSkeletonLodMesh( level, baseMesh.get() );
+
+    if ( target == 0 )
+    {
+        target = baseMesh.get(); // mesh wasn't created by core model
+    }
+
+    if ( target->material != mesh->material
+         || target->parameters != mesh->parameters )
+    {
+        // display lists of LOD mesh are shared, copy is made once
+        // per level and again only when material or parameters
+        // of model's mesh change
+        if ( (int)skeletonLodMeshes.size() <= level )
+        {
+            skeletonLodMeshes.resize( level + 1 );
+        }
+
+        osg::ref_ptr< const CoreMesh >& copy = skeletonLodMeshes[ level ];
+
+        if ( !copy.valid()
+             || copy->data != target->data
+             || copy->material != mesh->material
+             || copy->parameters != mesh->parameters )
+        {
+            copy = new CoreMesh( cm, target,
+                                 mesh->material.get(),
+                                 mesh->parameters.get() );
+        }
+
+        target = copy.get();
+    }
+
+    skeletonLod = level;
+    mesh = target;
+    verticesValid = false; // different bones
+
+    if ( level == 0 )
+    {
+        baseMesh = 0;
+    }
+
+    onParametersChanged( mesh->parameters.get() ); // only updates state set
+
+    if ( depthMesh.valid() )
+    {
+        depthMesh->setStateSet( mesh->stateSets->depthOnly.get() );
+    }
+}
+
 void
 HardwareMesh::drawImplementation( osg::RenderInfo& renderInfo ) const
 {
@@ -134,88 +260,33 @@ HardwareMesh::drawImplementation( osg::RenderInfo&     renderInfo,
     const osg::Program::PerContextProgram* program = getProgram( state, stateSet );
     const osg::GLExtensions* gl2extensions = osg::GLExtensions::Get( state.getContextID(), true );
 
+    ShadersCache::ProgramUniforms* uniforms =
+        program ? &ShadersCache::getProgramUniforms( program, state ) : 0;
+
     // -- Setup rotation/translation uniforms --
-//    if ( deformed )
-    if ( mesh->data->rigid == false && program )
+    // (not needed when they are taken from model's bone palette)
+    if ( mesh->data->rigid == false && uniforms
+         && !mesh->parameters->useBonePaletteTexture )
     {
-        // -- Calculate and bind rotation/translation uniforms --
-        GLint rotationMatricesAttrib = program->getUniformLocation( "rotationMatrices" );
-        if ( rotationMatricesAttrib < 0 )
-        {
-            rotationMatricesAttrib = program->getUniformLocation( "rotationMatrices[0]" );
-            // Why the hell on ATI it has uniforms for each
-            // elements? (nVidia has only one uniform for the whole array)
-        }
-    
-        GLint translationVectorsAttrib = program->getUniformLocation( "translationVectors" );
-        if ( translationVectorsAttrib < 0 )
-        {
-            translationVectorsAttrib = program->getUniformLocation( "translationVectors[0]" );
-        }
-
-        if ( rotationMatricesAttrib < 0 || translationVectorsAttrib < 0 )
-        {
-            throw std::runtime_error( "no rotation/translation uniforms in deformed mesh?" );
-        }
-
-        static const std::vector< osg::Matrix3 > noRotation( 31 );
-        static const std::vector< osg::Vec3f >   noTranslation( 31 );
-
-        int boneCount = mesh->data->getBonesCount();
-
-        if ( deformed )
-        {
-            GLfloat rotationMatrices[31][9];
-            GLfloat translationVectors[31][3];
-
-            for( int boneIndex = 0; boneIndex < boneCount; boneIndex++ )
-            {
-                modelData->getBoneRotationTranslation( mesh->data->getBoneId( boneIndex ),
-                                                       &rotationMatrices[boneIndex][0],
-                                                       &translationVectors[boneIndex][0] );
-            }
-
-            gl2extensions->glUniformMatrix3fv( rotationMatricesAttrib,
-                                               boneCount, GL_FALSE,
-                                               &rotationMatrices[0][0] );
-            gl2extensions->glUniform3fv( translationVectorsAttrib,
-                                         boneCount,
-                                         &translationVectors[0][0] );
-        }
-        else
-        {
-            gl2extensions->glUniformMatrix3fv( rotationMatricesAttrib,
-                                               boneCount, GL_FALSE,
-                                               (const GLfloat*)&noRotation.front() );
-            gl2extensions->glUniform3fv( translationVectorsAttrib,
-                                         boneCount,
-                                         (const GLfloat*)&noTranslation.front() );
-        }
+        uploadUniformPalette( state, *uniforms );
     }
 
-    // -- Create display list if not yet exists --
-    unsigned int contextID = renderInfo.getContextID();
+    // -- Create display list or buffer objects if not yet exist --
+    const MeshBufferObjects::ContextBuffers* buffers = compileBufferObjects( state );
+    GLuint dl = 0;
 
-    mesh->displayLists->mutex.lock();
-    GLuint& dl = mesh->displayLists->lists[ contextID ];
-
-    if( dl != 0 )
+    if ( buffers )
     {
-        mesh->displayLists->mutex.unlock();
+        MeshBufferObjects::bind( state, *buffers, mesh->data.get() );
     }
     else
     {
-        dl = generateDisplayList( contextID, getGLObjectSizeHint() );
-
-        innerDrawImplementation( renderInfo, dl );
-        mesh->displayLists->mutex.unlock();
-
-        mesh->displayLists->checkAllDisplayListsCompiled( mesh->data.get() );
+        dl = compileDisplayList( renderInfo );
     }
 
-    // -- Call display list --
+    // -- Call display list (or draw elements) --
     bool transparent = stateSet->getRenderingHint() & osg::StateSet::TRANSPARENT_BIN;
-    GLint frontFacing = program ? program->getUniformLocation( "frontFacing" ) : -1;
+    GLint frontFacing = uniforms ? uniforms->frontFacing : -1;
 
     if ( transparent )
     {
@@ -224,28 +295,33 @@ HardwareMesh::drawImplementation( osg::RenderInfo&     renderInfo,
         {   // ^ there can be no "frontFacing" in user shader
             gl2extensions->glUniform1f( frontFacing, 0.0 );
         }
-        glCallList( dl );
+        drawElements( dl );
         glCullFace( GL_BACK ); // then draw only front faces
         if ( frontFacing >= 0 )
         {
             gl2extensions->glUniform1f( frontFacing, 1.0 );
         }
-        glCallList( dl );
+        drawElements( dl );
     }
     else if ( frontFacing >= 0 )
     {
         // first draw only front faces
         gl2extensions->glUniform1f( frontFacing, 1.0 );
-        glCallList( dl );
+        drawElements( dl );
         // then draw only back faces
         glCullFace( GL_FRONT ); 
         gl2extensions->glUniform1f( frontFacing, 0.0 );
-        glCallList( dl );
+        drawElements( dl );
         glCullFace( GL_BACK ); // restore backfacing mode
     }
     else
     {
-        glCallList( dl );
+        drawElements( dl );
+    }
+
+    if ( buffers )
+    {
+        MeshBufferObjects::unbind( state );
     }
 
 //     // get mesh material to restore glColor after glDrawElements call
@@ -256,6 +332,106 @@ HardwareMesh::drawImplementation( osg::RenderInfo&     renderInfo,
     // glDrawElements call is placed into display list
 }
 
+void
+HardwareMesh::uploadUniformPalette( osg::State&                    state,
+                                    ShadersCache::ProgramUniforms& uniforms ) const
+{
+    const UniformPalette& palette   = uniformPalettes[ currentUniformPalette ];
+    const int             boneCount = mesh->data->getBonesCount();
+
+    // -- Check that program already has our palette --
+    // Uniforms are program state, so they stay valid until other
+    // mesh drawn with the same program uploads its own palette.
+    if ( uniforms.paletteId == palette.id
+         && uniforms.paletteBonesCount >= boneCount )
+    {
+        // ^ identity palette of other mesh is good when it
+        // contains at least our bones count
+        return;
+    }
+
+    if ( uniforms.rotationMatrices < 0 || uniforms.translationVectors < 0 )
+    {
+        throw std::runtime_error( "no rotation/translation uniforms in deformed mesh?" );
+    }
+
+    // -- Upload palette --
+    static const std::vector< osg::Matrix3 > noRotation( 31 );
+    static const std::vector< osg::Vec3f >   noTranslation( 31 );
+
+    const osg::GLExtensions* gl2extensions = osg::GLExtensions::Get( state.getContextID(), true );
+
+    if ( palette.id != 0 )
+    {
+        gl2extensions->glUniformMatrix3fv( uniforms.rotationMatrices,
+                                           boneCount, GL_FALSE,
+                                           &palette.rotationMatrices.front() );
+        gl2extensions->glUniform3fv( uniforms.translationVectors,
+                                     boneCount,
+                                     &palette.translationVectors.front() );
+    }
+    else
+    {
+        gl2extensions->glUniformMatrix3fv( uniforms.rotationMatrices,
+                                           boneCount, GL_FALSE,
+                                           (const GLfloat*)&noRotation.front() );
+        gl2extensions->glUniform3fv( uniforms.translationVectors,
+                                     boneCount,
+                                     (const GLfloat*)&noTranslation.front() );
+    }
+
+    uniforms.paletteId         = palette.id;
+    uniforms.paletteBonesCount = boneCount;
+}
+
+void
+HardwareMesh::updateUniformPalette( bool deformed )
+{
+    uniformPaletteValid = true;
+
+    if ( mesh->data->rigid || mesh->parameters->useBonePaletteTexture )
+    {
+        return; // no rotation/translation uniforms
+    }
+
+    if ( !deformed && uniformPalettes[ currentUniformPalette ].id == 0 )
+    {
+        return; // already identity
+    }
+
+    // fill palette which is not drawn now
+    const int       next    = 1 - currentUniformPalette;
+    UniformPalette& palette = uniformPalettes[ next ];
+
+    const int boneCount = mesh->data->getBonesCount();
+
+    if ( deformed && boneCount > 0 )
+    {
+        palette.rotationMatrices.resize( boneCount * 9 );
+        palette.translationVectors.resize( boneCount * 3 );
+
+        for( int boneIndex = 0; boneIndex < boneCount; boneIndex++ )
+        {
+            modelData->getBoneRotationTranslation( mesh->data->getBoneId( boneIndex ),
+                                                   &palette.rotationMatrices[ boneIndex * 9 ],
+                                                   &palette.translationVectors[ boneIndex * 3 ] );
+        }
+
+        palette.id = ++uniformPaletteIds;
+
+        if ( palette.id == 0 )
+        {
+            palette.id = ++uniformPaletteIds; // wrapped around
+        }
+    }
+    else
+    {
+        palette.id = 0;
+    }
+
+    currentUniformPalette = next;
+}
+
 void
 HardwareMesh::compileGLObjects(osg::RenderInfo& renderInfo) const
 {
@@ -264,24 +440,69 @@ HardwareMesh::compileGLObjects(osg::RenderInfo& renderInfo) const
 //         << "HardwareMesh::compileGLObjects for " << mesh->data->name << std::endl;
     Geometry::compileGLObjects( renderInfo );
 
+    if ( compileBufferObjects( *renderInfo.getState() ) == 0 )
+    {
+        compileDisplayList( renderInfo );
+    }
+}
+
+GLuint
+HardwareMesh::compileDisplayList( osg::RenderInfo& renderInfo ) const
+{
     unsigned int contextID = renderInfo.getContextID();
 
     mesh->displayLists->mutex.lock();
     
     GLuint& dl = mesh->displayLists->lists[ contextID ];
 
-    if( dl == 0 )
+    if( dl != 0 )
     {
-        dl = generateDisplayList( contextID, getGLObjectSizeHint() );
-
-        innerDrawImplementation( renderInfo, dl );
+        GLuint result = dl;
         mesh->displayLists->mutex.unlock();
+        return result;
+    }
+
+    dl = generateDisplayList( contextID, getGLObjectSizeHint() );
+
+    innerDrawImplementation( renderInfo, dl );
+    GLuint result = dl;
+    mesh->displayLists->mutex.unlock();
 
-        mesh->displayLists->checkAllDisplayListsCompiled( mesh->data.get() );
+    mesh->displayLists->checkAllDisplayListsCompiled( mesh->data.get() );
+
+    return result;
+}
+
+const MeshBufferObjects::ContextBuffers*
+HardwareMesh::compileBufferObjects( osg::State& state ) const
+{
+    if ( !mesh->parameters->useVertexBufferObjects )
+    {
+        return 0;
+    }
+
+    // OSG caches bound buffers, unbind them through the state, so
+    // it knows that 0 is bound after upload
+    state.unbindVertexBufferObject();
+    state.unbindElementBufferObject();
+
+    return mesh->bufferObjects->compile( state, mesh->data.get(),
+                                         mesh->parameters->useBonePaletteTexture );
+}
+
+void
+HardwareMesh::drawElements( GLuint displayList ) const
+{
+    if ( displayList != 0 )
+    {
+        glCallList( displayList );
     }
     else
-    {        
-        mesh->displayLists->mutex.unlock();
+    {
+        const IndexBuffer* ib = mesh->data->indexBuffer.get();
+
+        glDrawElements( ib->getMode(), ib->getNumIndices(),
+                        MeshBufferObjects::getIndexType( ib ), 0 );
     }
 }
 
@@ -333,12 +554,6 @@ HardwareMesh::innerDrawImplementation( osg::RenderInfo&     renderInfo,
     state.disableAllVertexArrays();
 
     // -- Setup vertex arrays --
-#ifdef OSG_CAL_BYTE_BUFFERS
-    #define NORMAL_TYPE         GL_BYTE
-#else
-    #define NORMAL_TYPE         GL_FLOAT
-#endif
-
     if ( !mesh->data->normalBuffer.valid() )
     {
         throw std::runtime_error( "HardwareMesh::innerDrawImplementation(): normalBuffer is not valid. "
@@ -387,22 +602,17 @@ HardwareMesh::innerDrawImplementation( osg::RenderInfo&     renderInfo,
                                   mesh->data->weightBuffer->getDataPointer() );
     }
 
-    GLshort* matrixIndexBuffer = NULL;
+    std::vector< GLshort > matrixIndexBuffer;
 
     if ( mesh->data->matrixIndexBuffer.valid() )
     {
-        matrixIndexBuffer = new GLshort[ mesh->data->matrixIndexBuffer->size() * 4 ];
-
-        GLshort* mi = matrixIndexBuffer;
-        const GLbyte* m   = (const GLbyte*)mesh->data->matrixIndexBuffer->getDataPointer();
-        const GLbyte* end = m + mesh->data->matrixIndexBuffer->size() * 4;
-        while ( m < end )
-        {
-            *mi++ = *m++;
-        }
+        mesh->data->getShortMatrixIndices( matrixIndexBuffer,
+                                           mesh->parameters->useBonePaletteTexture
+                                           && !mesh->data->rigid );
+        // ^ bone palette is indexed by bone ids
         
         state.setTexCoordPointer( 3, mesh->data->maxBonesInfluence, GL_SHORT, 4*2,
-                                  matrixIndexBuffer );
+                                  &matrixIndexBuffer.front() );
 //         state.setColorPointer( 4, GL_UNSIGNED_BYTE, 0,
 //                                mesh->data->matrixIndexBuffer->getDataPointer() );
         // GL_UNSIGNED_BYTE only supported in ColorPointer not the TexCoord
@@ -438,31 +648,12 @@ HardwareMesh::innerDrawImplementation( osg::RenderInfo&     renderInfo,
     //glError();
     state.disableAllVertexArrays();
 
-    delete[] matrixIndexBuffer;
     delete[] weightBuffer;
 }
 
-static
-inline
-osg::Vec3f
-mul3( const osg::Matrix3& m,
-      const osg::Vec3f& v )
-{
-    return osg::Vec3f( m(0,0)*v.x() + m(1,0)*v.y() + m(2,0)*v.z(),
-                       m(0,1)*v.x() + m(1,1)*v.y() + m(2,1)*v.z(),
-                       m(0,2)*v.x() + m(1,2)*v.y() + m(2,2)*v.z() );
-}
-
 void
-HardwareMesh::update()
+HardwareMesh::update( TaskPool* pool )
 {   
-    // -- Setup rotation matrices & translation vertices --
-    typedef std::pair< osg::Matrix3, osg::Vec3f > RTPair;
-    float rotationTranslationMatricesData[ 31 * sizeof (RTPair) / sizeof ( float ) ];
-    // we make data to not init matrices & vertex since we always set
-    // them to correct data
-    RTPair* rotationTranslationMatrices = (RTPair*)(void*)&rotationTranslationMatricesData;
-
     deformed = false;
     bool changed = false;
 
@@ -473,11 +664,6 @@ HardwareMesh::update()
 
         deformed |= bp.deformed;
         changed  |= bp.changed;
-
-        RTPair& rt = rotationTranslationMatrices[ boneIndex ];
-
-        rt.first  = bp.rotation;
-        rt.second = bp.translation;
     }
 
     // -- Check for deformation state and select state set type --
@@ -493,6 +679,12 @@ HardwareMesh::update()
 //         // in vertex shader
 //     }
 
+    // -- Build uniform palette for draws --
+    if ( changed || !uniformPaletteValid )
+    {
+        updateUniformPalette( deformed );
+    }
+
     // -- Update depthMesh --
     if ( depthMesh.valid() )
     {
@@ -500,144 +692,247 @@ HardwareMesh::update()
     }
 
     // -- Check changes --
-    if ( !changed || mesh->parameters->noSoftwareVertexUpdate )
+    if ( !changed )
     {
 //        std::cout << "didn't changed" << std::endl;
         return; // no changes
     }
 
-    rotationTranslationMatrices[ 30 ] = // last always identity (see #68)
-        std::make_pair( osg::Matrix3( 1, 0, 0,
-                                      0, 1, 0,
-                                      0, 0, 1 ),
-                        osg::Vec3( 0, 0, 0 ) );
-
-    // -- Scan indexes --
-    boundingBox = osg::BoundingBox();
-    
-    VertexBuffer&               vb  = *(VertexBuffer*)getVertexArray();
-    const VertexBuffer&         svb = *mesh->data->vertexBuffer.get();
-    const WeightBuffer&         wb  = *mesh->data->weightBuffer.get();
-    const MatrixIndexBuffer&    mib = *mesh->data->matrixIndexBuffer.get();
-   
-    osg::Vec3f*        v  = &vb.front();      /* dest vector */   
-    const osg::Vec3f*  sv = &svb.front();     /* source vector */   
-    const osg::Vec4f*  w  = &wb.front();      /* weights */         
-    const MatrixIndexBuffer::value_type*
-                       mi = &mib.front();     /* bone indexes */
-    osg::Vec3f*        vEnd = v + vb.size();  /* dest vector end */   
-    
-#define ITERATE( _f )                           \
-    while ( v < vEnd )                          \
-    {                                           \
-        _f;                                     \
-                                                \
-        boundingBox.expandBy( *v );             \
-        ++v;                                    \
-        ++sv;                                   \
-        ++w;                                    \
-        ++mi;                                   \
-    }
-
-    #define x() r()
-    #define y() g()
-    #define z() b()
-    #define w() a()
-
-#define PROCESS_X( _process_y )                                         \
-    if ( mi->x() != 30 )                                                \
-        /* we have no zero weight vertices they all bound to 30th bone */ \
-    {                                                                   \
-        const osg::Matrix3& rm = rotationTranslationMatrices[mi->x()].first; \
-        const osg::Vec3f&   tv = rotationTranslationMatrices[mi->x()].second; \
-        *v = (mul3(rm, *sv) + tv) * w->x();                             \
-                                                                        \
-        _process_y;                                                     \
-    }                                                                   \
-    else                                                                \
-    {                                                                   \
-        *v = *sv;                                                       \
-    }                                                                   
-
-    // Strange, but multiplying each matrix on source vector works
-    // faster than accumulating matrix and multiply at the end (as in
-    // shader)
-    //
-    // Not strange:
-    // mul3            9*  6+
-    // mul3 + tv       9*  9+
-    // (mul3 + tv)*w  12*  9+
-    // v += ..        12* 12+ (-3 for first)
-    // x4 48* 45+
-    //
-    // +=rm,+=tv      12* 12+ (-12 for first)
-    // (mul3 + tv)*w  12*  9+
-    // x4 60* 45+
-    // accumulation of matrix is more expensive than multiplicating
-    //
-    //
-    // And it seems that memory access (even for accumulating matix)
-    // is really expensive (commenting of branches in accumulating code
-    // doesn't change speed at all)
-
-#define PROCESS_Y( _process_z )                                         \
-    if ( w->y() )                                                   \
-    {                                                                   \
-        const osg::Matrix3& rm = rotationTranslationMatrices[mi->y()].first; \
-        const osg::Vec3f&   tv = rotationTranslationMatrices[mi->y()].second; \
-        *v += (mul3(rm, *sv) + tv) * w->y();                            \
-                                                                        \
-        _process_z;                                                     \
-    }                                                                   
-
-#define PROCESS_Z( _process_w )                                         \
-    if ( w->z() )                                                       \
-    {                                                                   \
-        const osg::Matrix3& rm = rotationTranslationMatrices[mi->z()].first; \
-        const osg::Vec3f&   tv = rotationTranslationMatrices[mi->z()].second; \
-        *v += (mul3(rm, *sv) + tv) * w->z();                            \
-                                                                        \
-        _process_w;                                                     \
+    if ( mesh->parameters->noSoftwareVertexUpdate )
+    {
+        verticesValid = false;
+        return;
     }
 
-#define PROCESS_W()                                                     \
-    if ( w->w() )                                                       \
-    {                                                                   \
-        const osg::Matrix3& rm = rotationTranslationMatrices[mi->w()].first; \
-        const osg::Vec3f&   tv = rotationTranslationMatrices[mi->w()].second; \
-        *v += (mul3(rm, *sv) + tv) * w->w();                            \
+    // -- Setup rotation matrices & translation vertices --
+    SkinningPalette& palette = skinningPalette;
+    palette.resize( mesh->data->getBonesCount() );
+    // ^ identity at IDENTITY_INDEX for small meshes (see #68)
+
+    for( int boneIndex = 0; boneIndex < mesh->data->getBonesCount(); boneIndex++ )
+    {
+        const ModelData::BoneParams& bp =
+            modelData->getBoneParams( mesh->data->getBoneId( boneIndex ) );
+
+        palette.set( boneIndex, bp.rotation, bp.translation );
     }
 
-#define STOP
+    // -- Bound transformed bone boxes --
+    if ( mesh->parameters->useBoneBoundingBoxes
+         && !mesh->data->boneBoundingBoxes.empty() )
+    {
+        boundingBox = osg::BoundingBox();
+        expandBoundingBoxByBones( palette,
+                                  &mesh->data->boneBoundingBoxes.front(),
+                                  mesh->data->boneBoundingBoxes.size(),
+                                  boundingBox );
+        verticesValid = false;
+        dirtyBound();
+        return;
+    }
 
-    switch ( mesh->data->maxBonesInfluence )
+    // -- Deform vertices --
+    if ( !sparseUpdate( palette ) )
     {
-        case 1:
-	  //#pragma omp parallel for -
-	  // w/o      - 1.5s
-	  // 1thread  - 1.7s
-	  // 2threads - 2.1s => no win here
-            ITERATE( PROCESS_X( STOP ) );
-            break;
+        const size_t vertexCount = getVertexArray()->getNumElements();
+        const size_t chunksCount = ( vertexCount + BOUNDING_BOX_CHUNK - 1 ) / BOUNDING_BOX_CHUNK;
 
-        case 2:
-	  //#pragma omp parallel for						
-            ITERATE( PROCESS_X( PROCESS_Y ( STOP ) ) );
-            break;
+        chunkBoundingBoxes.resize( chunksCount );
 
-        case 3:
-	  //#pragma omp parallel for					       
-            ITERATE( PROCESS_X( PROCESS_Y ( PROCESS_Z( STOP ) ) ) );
-            break;
+        if ( chunksCount <= SKINNING_TASK_CHUNKS )
+        {
+            skinChunks( palette, 0, chunksCount );
+        }
+        else
+        {
+            // big mesh, split it so it is deformed by all cores
+            const size_t tasksCount =
+                ( chunksCount + SKINNING_TASK_CHUNKS - 1 ) / SKINNING_TASK_CHUNKS;
 
-        case 4:
-	  //#pragma omp parallel for						
-            ITERATE( PROCESS_X( PROCESS_Y ( PROCESS_Z( PROCESS_W() ) ) ) );
-            break;
+            skinningTasks.resize( tasksCount );
+            skinningTaskPointers.resize( tasksCount );
 
-        default:
-            throw std::runtime_error( "maxBonesInfluence > 4 ???" );            
+            for ( size_t i = 0; i < tasksCount; i++ )
+            {
+                SkinningTask& t = skinningTasks[i];
+
+                t.mesh       = this;
+                t.palette    = &palette;
+                t.firstChunk = i * SKINNING_TASK_CHUNKS;
+                t.endChunk   = std::min( chunksCount,
+                                         t.firstChunk + SKINNING_TASK_CHUNKS );
+                skinningTaskPointers[i] = &t;
+            }
+
+            pool->run( skinningTaskPointers );
+        }
+
+        // -- Reduce chunk boxes --
+        boundingBox = osg::BoundingBox();
+
+        for ( size_t c = 0; c < chunksCount; c++ )
+        {
+            boundingBox.expandBy( chunkBoundingBoxes[ c ] );
+        }
+
+        verticesValid = true;
     }
 
     dirtyBound();
 }
+
+void
+HardwareMesh::skinVertexRange( const SkinningPalette& palette,
+                               size_t                 first,
+                               size_t                 count,
+                               osg::BoundingBox&      bb )
+{
+    VertexBuffer& vb = *(VertexBuffer*)getVertexArray();
+
+    if ( mesh->parameters->useSkinningStreams
+         && mesh->data->skinningStreams.valid() )
+    {
+        skinVertices( palette, mesh->data->maxBonesInfluence,
+                      *mesh->data->skinningStreams, first,
+                      &vb[ first ], count,
+                      bb );
+    }
+    else
+    {
+        const VertexBuffer&         svb = *mesh->data->vertexBuffer.get();
+        const WeightBuffer&         wb  = *mesh->data->weightBuffer.get();
+        const MatrixIndexBuffer&    mib = *mesh->data->matrixIndexBuffer.get();
+
+        skinVertices( palette, mesh->data->maxBonesInfluence,
+                      &svb[ first ], &wb[ first ], &mib[ first ],
+                      &vb[ first ], count,
+                      bb );
+    }
+}
+
+void
+HardwareMesh::skinChunks( const SkinningPalette& palette,
+                          size_t                 firstChunk,
+                          size_t                 endChunk )
+{
+    const size_t vertexCount = getVertexArray()->getNumElements();
+
+    for ( size_t c = firstChunk; c < endChunk; c++ )
+    {
+        const size_t first = c * BOUNDING_BOX_CHUNK;
+
+        chunkBoundingBoxes[ c ] = osg::BoundingBox();
+        skinVertexRange( palette,
+                         first, std::min( BOUNDING_BOX_CHUNK, vertexCount - first ),
+                         chunkBoundingBoxes[ c ] );
+    }
+}
+
+static
+bool
+rangeBeginLess( const VertexRange& a,
+                const VertexRange& b )
+{
+    return a.begin < b.begin;
+}
+
+bool
+HardwareMesh::sparseUpdate( const SkinningPalette& palette )
+{
+    const MeshData* data = mesh->data.get();
+
+    if ( !verticesValid || data->boneVertexRangesOffsets.empty() )
+    {
+        return false;
+    }
+
+    // -- Collect vertex ranges of changed bones --
+    changedRanges.clear();
+
+    for( int boneIndex = 0; boneIndex < data->getBonesCount(); boneIndex++ )
+    {
+        if ( modelData->getBoneParams( data->getBoneId( boneIndex ) ).changed )
+        {
+            changedRanges.insert(
+                changedRanges.end(),
+                data->boneVertexRanges.begin() + data->boneVertexRangesOffsets[ boneIndex ],
+                data->boneVertexRanges.begin() + data->boneVertexRangesOffsets[ boneIndex + 1 ] );
+        }
+    }
+
+    // -- Merge overlapping ranges --
+    std::sort( changedRanges.begin(), changedRanges.end(), rangeBeginLess );
+
+    size_t merged = 0;
+    size_t changedVertices = 0;
+
+    for ( size_t i = 0; i < changedRanges.size(); i++ )
+    {
+        const VertexRange& r = changedRanges[ i ];
+
+        if ( merged > 0 && r.begin <= changedRanges[ merged - 1 ].end )
+        {
+            VertexRange& m = changedRanges[ merged - 1 ];
+            changedVertices += std::max( m.end, r.end ) - m.end;
+            m.end = std::max( m.end, r.end );
+        }
+        else
+        {
+            changedRanges[ merged++ ] = r;
+            changedVertices += r.end - r.begin;
+        }
+    }
+
+    changedRanges.resize( merged );
+
+    const size_t vertexCount = getVertexArray()->getNumElements();
+
+    if ( changedVertices * 2 > vertexCount )
+    {
+        return false; // deforming all vertices in one pass is faster
+    }
+
+    // -- Deform changed vertices --
+    for ( size_t i = 0; i < changedRanges.size(); i++ )
+    {
+        osg::BoundingBox unused; // chunk boxes are calculated below
+        skinVertexRange( palette,
+                         changedRanges[ i ].begin,
+                         changedRanges[ i ].end - changedRanges[ i ].begin,
+                         unused );
+    }
+
+    // -- Recalculate boxes of changed chunks --
+    const VertexBuffer& vb = *(const VertexBuffer*)getVertexArray();
+    size_t lastChunk = chunkBoundingBoxes.size(); // none
+
+    for ( size_t i = 0; i < changedRanges.size(); i++ )
+    {
+        for ( size_t c = changedRanges[ i ].begin / BOUNDING_BOX_CHUNK;
+              c <= ( changedRanges[ i ].end - 1 ) / BOUNDING_BOX_CHUNK;
+              c++ )
+        {
+            if ( c == lastChunk )
+            {
+                continue; // ranges are sorted, so chunks too
+            }
+
+            const size_t first = c * BOUNDING_BOX_CHUNK;
+
+            chunkBoundingBoxes[ c ] = osg::BoundingBox();
+            expandBoundingBox( &vb[ first ],
+                               std::min( BOUNDING_BOX_CHUNK, vertexCount - first ),
+                               chunkBoundingBoxes[ c ] );
+            lastChunk = c;
+        }
+    }
+
+    boundingBox = osg::BoundingBox();
+
+    for ( size_t c = 0; c < chunkBoundingBoxes.size(); c++ )
+    {
+        boundingBox.expandBy( chunkBoundingBoxes[ c ] );
+    }
+
+    return true;
+}
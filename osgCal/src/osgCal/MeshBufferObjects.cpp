@@ -0,0 +1,263 @@
+/* -*- c++ -*-
+    Copyright (C) 2008 Vladimir Shabanov <vshabanoff@gmail.com>
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include <map>
+#include <vector>
+#include <stdexcept>
+
+#include <osg/GLExtensions>
+#include <OpenThreads/ScopedLock>
+
+#include <osgCal/MeshBufferObjects>
+
+using namespace osgCal;
+
+#ifdef OSG_CAL_BYTE_BUFFERS
+    #define NORMAL_TYPE         GL_BYTE
+#else
+    #define NORMAL_TYPE         GL_FLOAT
+#endif
+
+typedef std::vector< GLuint >                               BufferList;
+typedef std::map< unsigned int, BufferList >                DeletedBuffersMap;
+
+static OpenThreads::Mutex   deletedBuffersMutex;
+static DeletedBuffersMap    deletedBuffers;
+
+static
+GLuint
+createBuffer( const osg::GLExtensions* ext,
+              GLenum                   target,
+              GLsizeiptr               size,
+              const GLvoid*            data )
+{
+    GLuint buffer = 0;
+
+    ext->glGenBuffers( 1, &buffer );
+    ext->glBindBuffer( target, buffer );
+    ext->glBufferData( target, size, data, GL_STATIC_DRAW_ARB );
+
+    return buffer;
+}
+
+static
+GLuint
+createArrayBuffer( const osg::GLExtensions* ext,
+                   const osg::Array*        array )
+{
+    if ( array == 0 )
+    {
+        return 0;
+    }
+
+    return createBuffer( ext, GL_ARRAY_BUFFER_ARB,
+                         array->getTotalDataSize(), array->getDataPointer() );
+}
+
+MeshBufferObjects::ContextBuffers::ContextBuffers()
+{
+    for ( int i = 0; i < BUFFERS_COUNT; i++ )
+    {
+        buffers[ i ] = 0;
+    }
+}
+
+MeshBufferObjects::~MeshBufferObjects()
+{
+    releaseGLObjects( 0 );
+}
+
+const MeshBufferObjects::ContextBuffers*
+MeshBufferObjects::compile( osg::State&     state,
+                            const MeshData* data,
+                            bool            boneIds ) const
+{
+    unsigned int             contextID = state.getContextID();
+    const osg::GLExtensions* ext = osg::GLExtensions::Get( contextID, true );
+
+    if ( !ext->isBufferObjectSupported )
+    {
+        return 0;
+    }
+
+    OpenThreads::ScopedLock< OpenThreads::Mutex > lock( mutex );
+
+    flushDeletedBufferObjects( contextID );
+
+    ContextBuffers& cb = lists[ contextID ];
+
+    if ( cb.buffers[ VERTICES ] != 0 )
+    {
+        return &cb;
+    }
+
+    if ( !data->normalBuffer.valid() )
+    {
+        throw std::runtime_error( "MeshBufferObjects::compile(): normalBuffer is not valid. "
+                                  "It was freed after display lists were compiled for all "
+                                  "possible contexts, so buffer objects can't be created "
+                                  "for the new one. Reload your model." );
+    }
+
+    // -- Upload attributes --
+    cb.buffers[ VERTICES ]   = createArrayBuffer( ext, data->vertexBuffer.get() );
+    cb.buffers[ NORMALS ]    = createArrayBuffer( ext, data->normalBuffer.get() );
+    cb.buffers[ TEX_COORDS ] = createArrayBuffer( ext, data->texCoordBuffer.get() );
+    cb.buffers[ TANGENTS ]   = createArrayBuffer( ext, data->tangentAndHandednessBuffer.get() );
+    cb.buffers[ WEIGHTS ]    = createArrayBuffer( ext, data->weightBuffer.get() );
+
+    if ( data->matrixIndexBuffer.valid() )
+    {
+        // see HardwareMesh::innerDrawImplementation on why GLshort
+        std::vector< GLshort > matrixIndices;
+
+        data->getShortMatrixIndices( matrixIndices, boneIds && !data->rigid );
+
+        cb.buffers[ MATRIX_INDICES ] =
+            createBuffer( ext, GL_ARRAY_BUFFER_ARB,
+                          matrixIndices.size() * sizeof ( GLshort ),
+                          &matrixIndices.front() );
+    }
+
+    // -- Upload indices --
+    cb.buffers[ INDICES ] =
+        createBuffer( ext, GL_ELEMENT_ARRAY_BUFFER_ARB,
+                      data->indexBuffer->getTotalDataSize(),
+                      data->indexBuffer->getDataPointer() );
+
+    ext->glBindBuffer( GL_ARRAY_BUFFER_ARB, 0 );
+    ext->glBindBuffer( GL_ELEMENT_ARRAY_BUFFER_ARB, 0 );
+
+    return &cb;
+}
+
+void
+MeshBufferObjects::bind( osg::State&           state,
+                         const ContextBuffers& cb,
+                         const MeshData*       data )
+{
+    const osg::GLExtensions* ext = osg::GLExtensions::Get( state.getContextID(), true );
+    const GLuint*            b   = cb.buffers;
+
+    state.disableAllVertexArrays();
+    // all pointers are zero offsets, so state must not skip
+    // them as unchanged
+    state.dirtyAllVertexArrays();
+
+    ext->glBindBuffer( GL_ARRAY_BUFFER_ARB, b[ NORMALS ] );
+    state.setNormalPointer( NORMAL_TYPE, 0, 0 );
+
+    if ( b[ TEX_COORDS ] )
+    {
+        ext->glBindBuffer( GL_ARRAY_BUFFER_ARB, b[ TEX_COORDS ] );
+        state.setTexCoordPointer( 0, 2, GL_FLOAT, 0, 0 );
+    }
+
+    if ( b[ TANGENTS ] )
+    {
+        ext->glBindBuffer( GL_ARRAY_BUFFER_ARB, b[ TANGENTS ] );
+        state.setTexCoordPointer( 1, 4, NORMAL_TYPE, 0, 0 );
+    }
+
+    if ( b[ WEIGHTS ] )
+    {
+        ext->glBindBuffer( GL_ARRAY_BUFFER_ARB, b[ WEIGHTS ] );
+        state.setTexCoordPointer( 2, data->maxBonesInfluence, GL_FLOAT, 4*4, 0 );
+    }
+
+    if ( b[ MATRIX_INDICES ] )
+    {
+        ext->glBindBuffer( GL_ARRAY_BUFFER_ARB, b[ MATRIX_INDICES ] );
+        state.setTexCoordPointer( 3, data->maxBonesInfluence, GL_SHORT, 4*2, 0 );
+    }
+
+    ext->glBindBuffer( GL_ARRAY_BUFFER_ARB, b[ VERTICES ] );
+    state.setVertexPointer( 3, GL_FLOAT, 0, 0 );
+
+    ext->glBindBuffer( GL_ARRAY_BUFFER_ARB, 0 );
+    ext->glBindBuffer( GL_ELEMENT_ARRAY_BUFFER_ARB, b[ INDICES ] );
+}
+
+void
+MeshBufferObjects::unbind( osg::State& state )
+{
+    const osg::GLExtensions* ext = osg::GLExtensions::Get( state.getContextID(), true );
+
+    ext->glBindBuffer( GL_ELEMENT_ARRAY_BUFFER_ARB, 0 );
+
+    state.disableAllVertexArrays();
+    state.dirtyAllVertexArrays();
+}
+
+GLenum
+MeshBufferObjects::getIndexType( const IndexBuffer* ib )
+{
+    switch ( ib->getType() )
+    {
+        case osg::PrimitiveSet::DrawElementsUBytePrimitiveType:
+            return GL_UNSIGNED_BYTE;
+        case osg::PrimitiveSet::DrawElementsUShortPrimitiveType:
+            return GL_UNSIGNED_SHORT;
+        default:
+            return GL_UNSIGNED_INT;
+    }
+}
+
+void
+MeshBufferObjects::releaseGLObjects( osg::State* state ) const
+{
+    OpenThreads::ScopedLock< OpenThreads::Mutex > lock( mutex ); 
+    OpenThreads::ScopedLock< OpenThreads::Mutex > deletedLock( deletedBuffersMutex ); 
+
+    for( size_t id = 0; id < lists.size(); id++ )
+    {
+        if ( state && state->getContextID() != id )
+        {
+            continue;
+        }
+
+        ContextBuffers& cb = lists[ id ];
+
+        for ( int i = 0; i < BUFFERS_COUNT; i++ )
+        {
+            if ( cb.buffers[ i ] != 0 )
+            {
+                deletedBuffers[ id ].push_back( cb.buffers[ i ] );
+                cb.buffers[ i ] = 0;
+            }
+        }
+    }
+}
+
+void
+MeshBufferObjects::flushDeletedBufferObjects( unsigned int contextID )
+{
+    OpenThreads::ScopedLock< OpenThreads::Mutex > lock( deletedBuffersMutex ); 
+
+    DeletedBuffersMap::iterator it = deletedBuffers.find( contextID );
+
+    if ( it == deletedBuffers.end() || it->second.empty() )
+    {
+        return;
+    }
+
+    const osg::GLExtensions* ext = osg::GLExtensions::Get( contextID, true );
+
+    ext->glDeleteBuffers( it->second.size(), &it->second.front() );
+    it->second.clear();
+}
@@ -17,3 +17,19 @@
 */
 
 #include <osgCal/MeshData>
+
+using namespace osgCal;
+
+void
+MeshData::getShortMatrixIndices( std::vector< GLshort >& indices,
+                                 bool                    boneIds ) const
+{
+    indices.resize( matrixIndexBuffer->size() * 4 );
+
+    const GLubyte* m = (const GLubyte*)matrixIndexBuffer->getDataPointer();
+
+    for ( size_t i = 0; i < indices.size(); i++ )
+    {
+        indices[ i ] = boneIds ? getBoneId( m[ i ] ) : m[ i ];
+    }
+}
@@ -16,10 +16,15 @@
     Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 */
 #include <memory>
+#include <math.h>
+#include <algorithm>
 #include <osg/io_utils>
+#include <osg/Notify>
 
 #include <osgCal/MeshLoader>
 
+#include "FileIO.h"
+
 
 namespace osgCal
 {
@@ -129,6 +134,118 @@ checkRigidness( osgCal::MeshData* m,
     }
 }
 
+/**
+ * Skinned vertex is a convex combination of its bones' transforms
+ * when weights sum to 1, so it lies inside the union of bone boxes
+ * transformed by bone matrices. We don't calculate boxes when some
+ * weights are not normalized, since this isn't true for them.
+ */
+static
+void
+calculateBoneBoundingBoxes( osgCal::MeshData* m )
+{
+    m->boneBoundingBoxes.clear();
+
+    if ( m->rigid )
+    {
+        return;
+    }
+
+    std::vector< osg::BoundingBox > boxes( m->getBonesCount() );
+
+    const VertexBuffer&      vb  = *m->vertexBuffer.get();
+    const WeightBuffer&      wb  = *m->weightBuffer.get();
+    const MatrixIndexBuffer& mib = *m->matrixIndexBuffer.get();
+
+    for ( size_t i = 0; i < vb.size(); i++ )
+    {
+        float weightsSum = 0;
+
+        for ( int k = 0; k < 4; k++ )
+        {
+            if ( wb[i][k] > 0.0f )
+            {
+                if ( mib[i][k] >= boxes.size() )
+                {
+                    osg::notify( osg::WARN )
+                        << "mesh " << m->name << " has matrix index out of its bones, "
+                        << "no bone bounding boxes calculated" << std::endl;
+                    return;
+                }
+
+                boxes[ mib[i][k] ].expandBy( vb[i] );
+                weightsSum += wb[i][k];
+            }
+        }
+
+        if ( fabs( weightsSum - 1.0f ) > 1e-3f )
+        {
+            osg::notify( osg::INFO )
+                << "mesh " << m->name << " has non-normalized weights, "
+                << "no bone bounding boxes calculated" << std::endl;
+            return;
+        }
+    }
+
+    m->boneBoundingBoxes.swap( boxes );
+}
+
+/**
+ * Build bone to vertices index. Vertices of the same bone are
+ * usually placed together, so we keep ranges, not vertex indices.
+ */
+static
+void
+calculateBoneVertexRanges( osgCal::MeshData* m )
+{
+    m->boneVertexRangesOffsets.clear();
+    m->boneVertexRanges.clear();
+
+    if ( m->rigid )
+    {
+        return;
+    }
+
+    std::vector< VertexRanges > ranges( m->getBonesCount() );
+
+    const WeightBuffer&      wb  = *m->weightBuffer.get();
+    const MatrixIndexBuffer& mib = *m->matrixIndexBuffer.get();
+
+    for ( size_t i = 0; i < wb.size(); i++ )
+    {
+        for ( int k = 0; k < 4; k++ )
+        {
+            if ( wb[i][k] <= 0.0f || mib[i][k] >= ranges.size() )
+            {
+                continue;
+            }
+
+            VertexRanges& r = ranges[ mib[i][k] ];
+
+            if ( !r.empty() && r.back().end == i )
+            {
+                r.back().end++;
+            }
+            else if ( r.empty() || r.back().end < i )
+            {
+                VertexRange vr = { (GLuint)i, (GLuint)( i + 1 ) };
+                r.push_back( vr );
+            }
+            // else vertex is already in range (bone is duplicated
+            // in vertex influences)
+        }
+    }
+
+    for ( size_t b = 0; b < ranges.size(); b++ )
+    {
+        m->boneVertexRangesOffsets.push_back( m->boneVertexRanges.size() );
+        m->boneVertexRanges.insert( m->boneVertexRanges.end(),
+                                    ranges[b].begin(), ranges[b].end() );
+    }
+
+    m->boneVertexRangesOffsets.push_back( m->boneVertexRanges.size() );
+}
+
 static
 void
 checkForEmptyTexCoord( osgCal::MeshData* m )
@@ -324,8 +441,14 @@ generateTangentAndHandednessBuffer( osgCal::MeshData* m,
 
 void
 loadMeshes( CalCoreModel* calCoreModel,
-            MeshesVector& meshes )
+            MeshesVector& meshes,
+            int           maxBonesPerMesh )
 {
+    if ( maxBonesPerMesh < 1 || maxBonesPerMesh > Constants::MAX_BONES_PER_PALETTE_MESH )
+    {
+        throw std::runtime_error( "loadMeshes: maxBonesPerMesh is out of range" );
+    }
+
     const int maxVertices = Constants::MAX_VERTEX_PER_MODEL;
     const int maxFaces    = Constants::MAX_VERTEX_PER_MODEL * 3;
 
@@ -365,7 +488,7 @@ loadMeshes( CalCoreModel* calCoreModel,
     // if ids not set all meshes will be used at load() time
 
     //std::cout << "calHardwareModel->load" << std::endl;
-    calHardwareModel->load( 0, 0, Constants::MAX_BONES_PER_MESH );
+    calHardwareModel->load( 0, 0, maxBonesPerMesh );
     //std::cout << "calHardwareModel->load ok" << std::endl;
 
     int vertexCount = calHardwareModel->getTotalVertexCount();
@@ -495,6 +618,8 @@ loadMeshes( CalCoreModel* calCoreModel,
         m->bonesIndices = hardwareMesh->m_vectorBonesIndices;
 
         checkRigidness( m.get(), unriggedBoneIndex );
+        calculateBoneBoundingBoxes( m.get() );
+        calculateBoneVertexRanges( m.get() );
         checkForEmptyTexCoord( m.get() );
         generateTangentAndHandednessBuffer( m.get(), &indexBuffer[ startIndex ] );
 
@@ -502,63 +627,216 @@ loadMeshes( CalCoreModel* calCoreModel,
     }
 }
 
-// -- Meshes I/O --
+// -- Skinning streams --
 
-std::string
-meshesCacheFileName( const std::string& cfgFileName )
+static
+inline
+osg::Vec3f
+toVec3f( const osg::Vec3f& v )
 {
-    return cfgFileName + ".meshes.cache";
+    return v;
 }
 
-#if defined(_MSC_VER)
-    typedef int int32_t;
-#endif
-    
-#define READ_( _name, _buf, _size )                                                  \
-    if ( fread( _buf, _size, 1, f ) != 1 )                                           \
-    {                                                                                \
-        throw std::runtime_error( "Can't read "#_name + std::string(" from ") + fn );\
+static
+inline
+osg::Vec3f
+toVec3f( const osg::Vec3b& v )
+{
+    return osg::Vec3f( v.x() / 127.0, v.y() / 127.0, v.z() / 127.0 );
+}
+
+void
+buildSkinningStreams( MeshData* m,
+                      bool      normals )
+{
+    if ( m->rigid )
+    {
+        return;
     }
 
-#define READ( _buf )                                                    \
-    if ( fread( (void*)_buf->getDataPointer(), _buf->getTotalDataSize(), 1, f ) != 1 ) \
-    {                                                                   \
-        throw std::runtime_error( "Can't read "#_buf + std::string(" from ") + fn ); \
+    if ( normals && !m->normalBuffer.valid() )
+    {
+        throw std::runtime_error( "buildSkinningStreams: no normal buffer "
+                                  "(it is freed after display lists are compiled)" );
     }
 
-#define READ_I32( _i )   { int32_t _i32_tmp = 0; READ_( _i, &_i32_tmp, 4 ); _i = _i32_tmp; }
-#define READ_STRUCT( _s ) READ_( _s, &_s, sizeof ( _s ) )
+    osg::ref_ptr< SkinningStreams > s = new SkinningStreams;
+
+    const VertexBuffer&      vb  = *m->vertexBuffer.get();
+    const WeightBuffer&      wb  = *m->weightBuffer.get();
+    const MatrixIndexBuffer& mib = *m->matrixIndexBuffer.get();
+
+    s->count = vb.size();
+    s->paddedCount = ( s->count + SkinningStreams::PADDING - 1 )
+        / SkinningStreams::PADDING * SkinningStreams::PADDING;
 
-#define WRITE_( _name, _buf, _size )                                                 \
-    if ( fwrite( _buf, _size, 1, f ) != 1 )                                          \
-    {                                                                                \
-        throw std::runtime_error( "Can't write "#_name + std::string(" to ") + fn ); \
+    // padding vertices are zero and bound to 0th bone with zero
+    // weight, so they deform to zero and never read outside palette
+    s->x.resize( s->paddedCount, 0.0f );
+    s->y.resize( s->paddedCount, 0.0f );
+    s->z.resize( s->paddedCount, 0.0f );
+
+    for ( int k = 0; k < 4; k++ )
+    {
+        s->weights[ k ].resize( s->paddedCount, 0.0f );
+        s->matrixIndices[ k ].resize( s->paddedCount, 0 );
     }
 
-#define WRITE( _buf )                                                   \
-    if ( fwrite( _buf->getDataPointer(), _buf->getTotalDataSize(), 1, f ) != 1 ) \
-    {                                                                   \
-        throw std::runtime_error( "Can't write "#_buf + std::string(" to ") + fn ); \
+    for ( size_t i = 0; i < s->count; i++ )
+    {
+        s->x[ i ] = vb[ i ].x();
+        s->y[ i ] = vb[ i ].y();
+        s->z[ i ] = vb[ i ].z();
+
+        for ( int k = 0; k < 4; k++ )
+        {
+            s->weights[ k ][ i ] = wb[ i ][ k ];
+            s->matrixIndices[ k ][ i ] = mib[ i ][ k ];
+        }
     }
 
-#define WRITE_I32( _i ) { int32_t _i32_tmp = _i; WRITE_( _i, &_i32_tmp, 4 ); }
-#define WRITE_STRUCT( _s ) WRITE_( _s, &_s, sizeof ( _s ) )
+    if ( normals )
+    {
+        const NormalBuffer& nb = *m->normalBuffer.get();
 
-/**
- * Simpe FILE wrapper, needed to call fclose() on exception.
- */
-struct FileCloser
-{       
-        FILE*  f;
+        s->nx.resize( s->paddedCount, 0.0f );
+        s->ny.resize( s->paddedCount, 0.0f );
+        s->nz.resize( s->paddedCount, 0.0f );
 
-        FileCloser( FILE* f )
-            : f( f )
-        {}
-        ~FileCloser()
+        for ( size_t i = 0; i < s->count; i++ )
         {
-            fclose( f );
+            osg::Vec3f n = toVec3f( nb[ i ] );
+
+            s->nx[ i ] = n.x();
+            s->ny[ i ] = n.y();
+            s->nz[ i ] = n.z();
         }
-};
+    }
+
+    m->skinningStreams = s;
+}
+
+// -- Skeleton LOD --
+
+MeshData*
+remapMeshBones( const MeshData*           m,
+                const std::vector< int >& boneMap )
+{
+    if ( m->rigid )
+    {
+        throw std::runtime_error( "remapMeshBones: mesh " + m->name + " is rigid" );
+    }
+
+    MeshData* r = new MeshData;
+
+    r->name         = m->name;
+    r->coreMaterial = m->coreMaterial;
+    r->boundingBox  = m->boundingBox;
+
+    r->indexBuffer                = m->indexBuffer;
+    r->vertexBuffer               = m->vertexBuffer;
+    r->normalBuffer               = m->normalBuffer;
+    r->texCoordBuffer             = m->texCoordBuffer;
+    r->tangentAndHandednessBuffer = m->tangentAndHandednessBuffer;
+
+    // -- Map old bone indices to new ones --
+    std::vector< int > indexMap( m->getBonesCount() );
+
+    for ( int i = 0; i < m->getBonesCount(); i++ )
+    {
+        int boneId = m->getBoneId( i );
+
+        if ( boneId >= 0 && boneId < (int)boneMap.size() )
+        {
+            boneId = boneMap[ boneId ];
+        }
+        // else unrigged (identity) bone, keep it
+
+        std::vector< int >::iterator b =
+            std::find( r->bonesIndices.begin(), r->bonesIndices.end(), boneId );
+
+        indexMap[ i ] = b - r->bonesIndices.begin();
+
+        if ( b == r->bonesIndices.end() )
+        {
+            r->bonesIndices.push_back( boneId );
+        }
+    }
+
+    // -- Merge influences of collapsed bones --
+    const WeightBuffer&      wb  = *m->weightBuffer.get();
+    const MatrixIndexBuffer& mib = *m->matrixIndexBuffer.get();
+
+    r->weightBuffer      = new WeightBuffer( wb.size() );
+    r->matrixIndexBuffer = new MatrixIndexBuffer( mib.size() );
+
+    WeightBuffer&      rwb  = *r->weightBuffer.get();
+    MatrixIndexBuffer& rmib = *r->matrixIndexBuffer.get();
+
+    for ( size_t i = 0; i < wb.size(); i++ )
+    {
+        float weights[ 4 ];
+        int   indices[ 4 ];
+        int   count = 0;
+
+        for ( int k = 0; k < 4; k++ )
+        {
+            if ( wb[i][k] <= 0.0f || mib[i][k] >= indexMap.size() )
+            {
+                continue;
+            }
+
+            int index = indexMap[ mib[i][k] ];
+            int n = 0;
+
+            while ( n < count && indices[ n ] != index )
+            {
+                n++;
+            }
+
+            if ( n == count )
+            {
+                indices[ count ] = index;
+                weights[ count ] = 0.0f;
+                count++;
+            }
+
+            weights[ n ] += wb[i][k];
+        }
+
+        // shaders use first maxBonesInfluence weights, keep the
+        // heaviest ones first
+        for ( int k = 1; k < count; k++ )
+        {
+            for ( int n = k; n > 0 && weights[ n ] > weights[ n - 1 ]; n-- )
+            {
+                std::swap( weights[ n ], weights[ n - 1 ] );
+                std::swap( indices[ n ], indices[ n - 1 ] );
+            }
+        }
+
+        for ( int k = 0; k < 4; k++ )
+        {
+            rwb[i][k]  = k < count ? weights[ k ] : 0.0f;
+            rmib[i][k] = k < count ? indices[ k ] : 0;
+        }
+
+        r->maxBonesInfluence = std::max( r->maxBonesInfluence, count );
+    }
+
+    calculateBoneBoundingBoxes( r );
+    calculateBoneVertexRanges( r );
+
+    return r;
+}
+
+// -- Meshes I/O --
+
+std::string
+meshesCacheFileName( const std::string& cfgFileName )
+{
+    return cfgFileName + ".meshes.cache";
+}
 
 /**
  * Set file I/O buffer to the specified size and free buffer on exit
@@ -715,7 +993,60 @@ readBuffer( MeshesVector& meshes,
 #undef CASE
 }
 
-static const int HW_MODEL_FILE_VERSION = 0xCA3D0003;
+static const int HW_MODEL_FILE_VERSION = 0xCA3D0005;
+
+/**
+ * Check that bone vertex ranges read from cache can be used by
+ * HardwareMesh without bounds checks: offsets don't decrease and
+ * stay within ranges, ranges of each bone are non empty, sorted,
+ * don't overlap and lie within vertex buffer.
+ */
+static
+bool
+checkBoneVertexRanges( const MeshData* m )
+{
+    const std::vector< GLuint >& offsets = m->boneVertexRangesOffsets;
+    const VertexRanges&          ranges  = m->boneVertexRanges;
+
+    if ( offsets.empty() )
+    {
+        return ranges.empty();
+    }
+
+    if ( offsets.size() != m->bonesIndices.size() + 1
+         || offsets.front() != 0
+         || offsets.back() != ranges.size() )
+    {
+        return false;
+    }
+
+    const GLuint vertexCount =
+        m->vertexBuffer.valid() ? m->vertexBuffer->size() : 0;
+
+    for ( size_t b = 0; b + 1 < offsets.size(); b++ )
+    {
+        if ( offsets[ b ] > offsets[ b + 1 ] )
+        {
+            return false;
+        }
+
+        GLuint prevEnd = 0;
+
+        for ( GLuint r = offsets[ b ]; r < offsets[ b + 1 ]; r++ )
+        {
+            if ( ranges[ r ].begin < prevEnd
+                 || ranges[ r ].begin >= ranges[ r ].end
+                 || ranges[ r ].end > vertexCount )
+            {
+                return false;
+            }
+
+            prevEnd = ranges[ r ].end;
+        }
+    }
+
+    return true;
+}
 
 void
 loadMeshes( const std::string&  fn,
@@ -788,6 +1119,46 @@ loadMeshes( const std::string&  fn,
         // -- Read boundingBox --
         assert( sizeof ( m->boundingBox ) == 6 * 4 ); // must be 6 floats
         READ_STRUCT( m->boundingBox );
+
+        // -- Read boneBoundingBoxes --
+        int bbbSize = 0;
+        READ_I32( bbbSize );
+        if ( bbbSize > biSize )
+        {
+            throw std::runtime_error( "Too many bone bounding boxes (incorrect meshes.cache file?)." );
+        }
+        m->boneBoundingBoxes.resize( bbbSize );
+        for ( int bi = 0; bi < bbbSize; bi++ )
+        {
+            READ_STRUCT( m->boneBoundingBoxes[ bi ] );
+        }
+
+        // -- Read boneVertexRanges --
+        int bvroSize = 0;
+        READ_I32( bvroSize );
+        if ( bvroSize < 0 || bvroSize > biSize + 1 )
+        {
+            throw std::runtime_error( "Incorrect bone vertex ranges offsets count (incorrect meshes.cache file?)." );
+        }
+        m->boneVertexRangesOffsets.resize( bvroSize );
+        for ( int bi = 0; bi < bvroSize; bi++ )
+        {
+            READ_I32( m->boneVertexRangesOffsets[ bi ] );
+        }
+
+        int bvrSize = 0;
+        READ_I32( bvrSize );
+        if ( bvrSize < 0
+             || bvrSize / std::max( biSize, 1 ) > Constants::MAX_VERTEX_PER_MODEL )
+        {
+            throw std::runtime_error( "Incorrect bone vertex ranges count (incorrect meshes.cache file?)." );
+        }
+        m->boneVertexRanges.resize( bvrSize );
+        for ( int ri = 0; ri < bvrSize; ri++ )
+        {
+            READ_I32( m->boneVertexRanges[ ri ].begin );
+            READ_I32( m->boneVertexRanges[ ri ].end );
+        }
     }
 
     // -- Read meshes buffers --
@@ -795,6 +1166,16 @@ loadMeshes( const std::string&  fn,
     {
         readBuffer( meshes, f, fn );
     }
+
+    // -- Check bone vertex ranges --
+    for ( int i = 0; i < meshesCount; i++ )
+    {
+        if ( !checkBoneVertexRanges( meshes[i].get() ) )
+        {
+            throw std::runtime_error( "Incorrect bone vertex ranges of mesh " + meshes[i]->name
+                                      + " (incorrect meshes.cache file?)." );
+        }
+    }
 }
 
 
@@ -866,6 +1247,27 @@ void saveMeshes( const CalCoreModel* calCoreModel,
         // -- Write boundingBox --
         assert( sizeof ( m->boundingBox ) == 6 * 4 ); // must be 6 floats
         WRITE_STRUCT( m->boundingBox );
+
+        // -- Write boneBoundingBoxes --
+        WRITE_I32( m->boneBoundingBoxes.size() );
+        for ( size_t bi = 0; bi < m->boneBoundingBoxes.size(); bi++ )
+        {
+            WRITE_STRUCT( m->boneBoundingBoxes[ bi ] );
+        }
+
+        // -- Write boneVertexRanges --
+        WRITE_I32( m->boneVertexRangesOffsets.size() );
+        for ( size_t bi = 0; bi < m->boneVertexRangesOffsets.size(); bi++ )
+        {
+            WRITE_I32( m->boneVertexRangesOffsets[ bi ] );
+        }
+
+        WRITE_I32( m->boneVertexRanges.size() );
+        for ( size_t ri = 0; ri < m->boneVertexRanges.size(); ri++ )
+        {
+            WRITE_I32( m->boneVertexRanges[ ri ].begin );
+            WRITE_I32( m->boneVertexRanges[ ri ].end );
+        }
     }
 
 #define WRITE_BUFFER( _bufferType, _buffer )    \
@@ -25,6 +25,10 @@ MeshParameters::MeshParameters()
     , fogMode( (osg::Fog::Mode)0 )
     , useDepthFirstMesh( false )
     , noSoftwareVertexUpdate( false )
+    , useBoneBoundingBoxes( false )
+    , useSkinningStreams( false )
+    , useVertexBufferObjects( false )
+    , useBonePaletteTexture( false )
 {
 }
 
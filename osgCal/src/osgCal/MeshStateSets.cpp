@@ -45,7 +45,8 @@ MeshStateSets::MeshStateSets( StateSetCache*  c,
 
             if ( d->rigid == false )
             {
-                depthOnly = c->depthMeshStateSetCache->get( ncm, d->maxBonesInfluence );
+                depthOnly = c->depthMeshStateSetCache->get( ncm, d->maxBonesInfluence,
+                                                            p->useBonePaletteTexture );
             }
         }
     }
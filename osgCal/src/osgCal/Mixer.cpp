@@ -0,0 +1,384 @@
+/* -*- c++ -*-
+    Copyright (C) 2008 Vladimir Shabanov <vshabanoff@gmail.com>
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+#include <math.h>
+#include <new>
+
+#include <osgCal/CoreModel>
+#include <osgCal/Mixer>
+
+using namespace osgCal;
+
+Mixer::Mixer( CalModel*  m,
+              int        _capacity,
+              CoreModel* cm )
+    : model( m )
+    , coreModel( cm )
+    , capacity( _capacity > 0 ? _capacity : 1 )
+    , cyclesById( m->getCoreModel()->getCoreAnimationCount(), (CalAnimationCycle*)0 )
+    , animationTime( 0.0f )
+    , animationDuration( 0.0f )
+    , timeFactor( 1.0f )
+    , allocationsCount( 0 )
+    , totalAllocationsCount( 0 )
+    , evaluator( cm )
+{
+    actions.reserve( capacity );
+    cycles.reserve( capacity );
+    freeSlots.reserve( capacity );
+}
+
+Mixer::~Mixer()
+{
+    for ( Actions::iterator a = actions.begin(); a != actions.end(); ++a )
+    {
+        (*a)->~CalAnimationAction();
+    }
+
+    for ( Cycles::iterator c = cycles.begin(); c != cycles.end(); ++c )
+    {
+        (*c)->~CalAnimationCycle();
+    }
+
+    for ( size_t i = 0; i < chunks.size(); i++ )
+    {
+        delete [] chunks[i];
+    }
+}
+
+// -- Pool --
+
+void
+Mixer::countAllocation()
+{
+    allocationsCount++;
+    totalAllocationsCount++;
+}
+
+template < typename T >
+void
+Mixer::pushFront( std::vector< T* >& v,
+                  T*                 p )
+{
+    if ( v.size() == v.capacity() )
+    {
+        countAllocation();
+    }
+
+    v.insert( v.begin(), p );
+}
+
+Mixer::Slot*
+Mixer::allocateSlot( CalCoreAnimation* coreAnimation )
+{
+    if ( freeSlots.empty() )
+    {
+        // all slots are used, add one more chunk
+        Slot* chunk = new Slot[ capacity ];
+        countAllocation();
+
+        if ( chunks.size() == chunks.capacity() )
+        {
+            countAllocation();
+        }
+        chunks.push_back( chunk );
+
+        if ( freeSlots.capacity() < chunks.size() * (size_t)capacity )
+        {
+            countAllocation();
+            freeSlots.reserve( chunks.size() * capacity );
+        }
+
+        for ( int i = capacity - 1; i >= 0; i-- )
+        {
+            freeSlots.push_back( &chunk[i] );
+        }
+    }
+
+    if ( !coreAnimation->getCallbackList().empty() )
+    {
+        countAllocation(); // CalAnimation allocates callback times
+    }
+
+    Slot* s = freeSlots.back();
+    freeSlots.pop_back();
+
+    return s;
+}
+
+void
+Mixer::freeSlot( CalAnimation* animation )
+{
+    animation->~CalAnimation(); // (virtual)
+    freeSlots.push_back( reinterpret_cast< Slot* >( animation ) );
+    // ^ never reallocates, capacity is kept not less than slots count
+}
+
+// -- Animations --
+
+void
+Mixer::closeLoop( CalCoreAnimation* coreAnimation,
+                  CoreModel*        coreModel )
+{
+    // (CalMixer adds first keyframe at the end of animation when
+    // there is no keyframe there, done once per core animation,
+    // animations without tracks are still played as cycles)
+    std::list< CalCoreTrack* >& tracks = coreAnimation->getListCoreTrack();
+
+    CompressedAnimation* compressedAnimation =
+        coreModel ? coreModel->getCompressedAnimation( coreAnimation ) : 0;
+
+    if ( compressedAnimation )
+    {
+        // core animation has no tracks, keys are in compressed
+        // one (CalMixer refuses to play such animations)
+        compressedAnimation->loopClosed = true;
+        return;
+    }
+
+    BakedAnimation* bakedAnimation =
+        coreModel ? coreModel->getBakedAnimation( coreAnimation ) : 0;
+
+    if ( bakedAnimation )
+    {
+        // baked copy doesn't get the keys added below
+        bakedAnimation->loopClosed = true;
+    }
+
+    if ( !tracks.empty()
+         && tracks.front()->getCoreKeyframeCount() != 0
+         && tracks.front()->getCoreKeyframe(
+                tracks.front()->getCoreKeyframeCount() - 1 )->getTime()
+            < coreAnimation->getDuration() )
+    {
+        for ( std::list< CalCoreTrack* >::iterator t = tracks.begin(); t != tracks.end(); ++t )
+        {
+            CalCoreKeyframe* first = (*t)->getCoreKeyframe( 0 );
+            CalCoreKeyframe* k = new CalCoreKeyframe();
+
+            k->setTranslation( first->getTranslation() );
+            k->setRotation( first->getRotation() );
+            k->setTime( coreAnimation->getDuration() );
+            (*t)->addCoreKeyframe( k );
+        }
+    }
+}
+
+bool
+Mixer::blendCycle( int   id,
+                   float weight,
+                   float delay )
+{
+    if ( id < 0 || id >= (int)cyclesById.size() )
+    {
+        CalError::setLastError( CalError::INVALID_HANDLE, __FILE__, __LINE__ );
+        return false;
+    }
+
+    CalAnimationCycle* cycle = cyclesById[ id ];
+
+    if ( cycle == 0 )
+    {
+        if ( weight == 0.0f )
+        {
+            return true;
+        }
+
+        CalCoreAnimation* coreAnimation = model->getCoreModel()->getCoreAnimation( id );
+
+        if ( coreAnimation == 0 )
+        {
+            return false;
+        }
+
+        closeLoop( coreAnimation, coreModel );
+
+        cycle = new ( allocateSlot( coreAnimation ) ) CalAnimationCycle( coreAnimation );
+
+        cyclesById[ id ] = cycle;
+        pushFront( cycles, cycle );
+
+        return cycle->blend( weight, delay );
+    }
+
+    if ( weight == 0.0f )
+    {
+        cyclesById[ id ] = 0;
+    }
+
+    cycle->blend( weight, delay );
+    cycle->checkCallbacks( 0, model );
+
+    return true;
+}
+
+bool
+Mixer::clearCycle( int   id,
+                   float delay )
+{
+    if ( id < 0 || id >= (int)cyclesById.size() )
+    {
+        CalError::setLastError( CalError::INVALID_HANDLE, __FILE__, __LINE__ );
+        return false;
+    }
+
+    CalAnimationCycle* cycle = cyclesById[ id ];
+
+    if ( cycle == 0 )
+    {
+        return true;
+    }
+
+    cyclesById[ id ] = 0;
+
+    cycle->setAsync( animationTime, animationDuration );
+    cycle->blend( 0.0f, delay );
+    cycle->checkCallbacks( 0, model );
+
+    return true;
+}
+
+CalAnimationAction*
+Mixer::executeAction( int   id,
+                      float delayIn,
+                      float delayOut,
+                      float weightTarget,
+                      bool  autoLock )
+{
+    CalCoreAnimation* coreAnimation = model->getCoreModel()->getCoreAnimation( id );
+
+    if ( coreAnimation == 0 )
+    {
+        return 0;
+    }
+
+    CalAnimationAction* action =
+        new ( allocateSlot( coreAnimation ) ) CalAnimationAction( coreAnimation );
+
+    pushFront( actions, action );
+
+    action->execute( delayIn, delayOut, weightTarget, autoLock );
+    action->checkCallbacks( 0, model );
+
+    return action;
+}
+
+bool
+Mixer::removeAction( int id )
+{
+    CalCoreAnimation* coreAnimation = model->getCoreModel()->getCoreAnimation( id );
+
+    if ( coreAnimation == 0 )
+    {
+        return false;
+    }
+
+    for ( Actions::iterator a = actions.begin(); a != actions.end(); ++a )
+    {
+        if ( (*a)->getCoreAnimation() == coreAnimation )
+        {
+            (*a)->completeCallbacks( model );
+            freeSlot( *a );
+            actions.erase( a );
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void
+Mixer::updateAnimation( float deltaTime )
+{
+    allocationsCount = 0;
+
+    // -- Synchronization time --
+    if ( animationDuration == 0.0f )
+    {
+        animationTime = 0.0f;
+    }
+    else
+    {
+        animationTime += deltaTime * timeFactor;
+
+        if ( animationTime >= animationDuration )
+        {
+            animationTime = (float)fmod( animationTime, animationDuration );
+        }
+
+        if ( animationTime < 0 )
+        {
+            animationTime += animationDuration;
+        }
+    }
+
+    // -- Actions --
+    // (finished ones are removed keeping order of the rest)
+    Actions::iterator kept = actions.begin();
+
+    for ( Actions::iterator a = actions.begin(); a != actions.end(); ++a )
+    {
+        if ( (*a)->update( deltaTime ) )
+        {
+            (*a)->checkCallbacks( animationTime, model );
+            *kept++ = *a;
+        }
+        else
+        {
+            (*a)->completeCallbacks( model );
+            freeSlot( *a );
+        }
+    }
+
+    actions.erase( kept, actions.end() );
+
+    // -- Cycles --
+    float accumulatedWeight = 0.0f;
+    float accumulatedDuration = 0.0f;
+
+    Cycles::iterator keptCycle = cycles.begin();
+
+    for ( Cycles::iterator c = cycles.begin(); c != cycles.end(); ++c )
+    {
+        if ( (*c)->update( deltaTime ) )
+        {
+            if ( (*c)->getState() == CalAnimation::STATE_SYNC )
+            {
+                accumulatedWeight += (*c)->getWeight();
+                accumulatedDuration += (*c)->getWeight() * (*c)->getCoreAnimation()->getDuration();
+            }
+
+            (*c)->checkCallbacks( animationTime, model );
+            *keptCycle++ = *c;
+        }
+        else
+        {
+            (*c)->completeCallbacks( model );
+            freeSlot( *c );
+        }
+    }
+
+    cycles.erase( keptCycle, cycles.end() );
+
+    animationDuration = accumulatedWeight > 0.0f ? accumulatedDuration / accumulatedWeight : 0.0f;
+}
+
+void
+Mixer::updateSkeleton()
+{
+    evaluator.updateSkeleton( this, model->getSkeleton() );
+}
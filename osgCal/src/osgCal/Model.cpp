@@ -17,6 +17,7 @@
     Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 */
 #include <algorithm>
+#include <math.h>
 
 #include <cal3d/model.h>
 
@@ -26,10 +27,15 @@
 #include <osg/Geode>
 #include <osg/MatrixTransform>
 #include <osg/io_utils>
+#include <osgUtil/CullVisitor>
+#include <OpenThreads/Atomic>
+#include <OpenThreads/ScopedLock>
 
 #include <osgCal/Model>
 #include <osgCal/HardwareMesh>
 #include <osgCal/SoftwareMesh>
+#include <osgCal/Skinning>
+#include <osgCal/TaskPool>
 
 using namespace osgCal;
 
@@ -86,10 +92,77 @@ class CalUpdateCallback: public osg::NodeCallback
 
 };
 
+// -- Animation LOD --
+
+AnimationLod::AnimationLod()
+{
+    addLevel( 150, 1 );
+    addLevel( 80, 2 );
+    addLevel( 40, 4 );
+    addLevel( 0, 8 );
+}
+
+void
+AnimationLod::clearLevels()
+{
+    levels.clear();
+}
+
+void
+AnimationLod::addLevel( float minPixelSize,
+                        int   updateInterval )
+{
+    Level l = { minPixelSize, std::max( updateInterval, 1 ) };
+
+    std::vector< Level >::iterator i = levels.begin();
+
+    while ( i != levels.end() && i->minPixelSize > minPixelSize )
+    {
+        ++i;
+    }
+
+    levels.insert( i, l );
+}
+
+int
+AnimationLod::getUpdateInterval( float pixelSize ) const
+{
+    for ( std::vector< Level >::const_iterator
+              l    = levels.begin(),
+              lEnd = levels.end();
+          l != lEnd; ++l )
+    {
+        if ( pixelSize >= l->minPixelSize )
+        {
+            return l->updateInterval;
+        }
+    }
+
+    return levels.empty() ? 1 : levels.back().updateInterval;
+}
+
+// -- Model --
+
+/**
+ * Count of created models, staggers their skipped frames. Models
+ * are created by loader threads too (e.g. osgDB::DatabasePager).
+ */
+static OpenThreads::Atomic modelsCount;
+
 Model::Model()
     : timeFactor( 1.0 )
+    , skippedTime( 0 )
+    , skeletonLod( 0 )
+    , visibleUpdatesOnly( false )
+    , guardBand( 0.5f )
+    , measurePixelSize( false )
+    , pixelSize( 0 )
+    , visible( false )
 {
     setDataVariance( DYNAMIC ); // we can add or remove objects dynamically
+
+    // spread updates of models with the same LOD over frames
+    skippedFrames = ( ++modelsCount - 1 ) % 8;
 }
 
 Model::Model( const Model&, const osg::CopyOp& )
@@ -198,7 +271,8 @@ Model::addMesh( const CoreMesh* mesh )
     // -- Remember Updatable (and update) --
     if ( mesh->data->rigid == false )
     {
-        g->update();
+        g->setSkeletonLod( skeletonLod );
+        g->update( getTaskPool() );
         updatableMeshes.push_back( g );
     }
     else
@@ -420,6 +494,35 @@ Model::setAutoUpdate( bool enabled )
 void
 Model::update( double deltaTime ) 
 {
+    skippedTime += deltaTime;
+
+    // -- Visibility --
+    if ( visibleUpdatesOnly && !takeVisibility() )
+    {
+        modelData->updateAnimationTime( skippedTime * timeFactor );
+        skippedTime = 0;
+        return;
+    }
+
+    if ( isPixelSizeNeeded() )
+    {
+        const float ps = takePixelSize();
+
+        // -- Animation LOD --
+        if ( animationLod.valid()
+             && ++skippedFrames < animationLod->getUpdateInterval( ps ) )
+        {
+            return;
+        }
+
+        // -- Skeleton LOD --
+        setSkeletonLod( getCoreModel()->selectSkeletonLod( ps ) );
+    }
+
+    deltaTime = skippedTime;
+    skippedTime = 0;
+    skippedFrames = 0;
+
     if ( modelData->update( deltaTime * timeFactor ) == true )
     {
         updateMeshes();
@@ -435,18 +538,94 @@ Model::update()
     }
 }
 
+TaskPool*
+Model::getTaskPool() const
+{
+    return taskPool.valid() ? taskPool.get() : TaskPool::instance();
+}
+
+/**
+ * Estimated cost of meshes grouped in one update task, in deformed
+ * vertices (about the size of HardwareMesh skinning task).
+ */
+static const size_t MESH_UPDATE_TASK_COST = 2048;
+
+/**
+ * Estimated cost of mesh update in deformed vertices. Meshes
+ * skinned only in shader or bounded by bone boxes just build
+ * their palettes.
+ */
+static
+size_t
+meshUpdateCost( const Mesh* mesh )
+{
+    const MeshParameters* p = mesh->getCoreMesh()->parameters.get();
+
+    if ( p->software
+         || ( !p->noSoftwareVertexUpdate && !p->useBoneBoundingBoxes ) )
+    {
+        return mesh->getVertexArray() ? mesh->getVertexArray()->getNumElements() : 0;
+    }
+    else
+    {
+        return mesh->getCoreMesh()->data->getBonesCount();
+    }
+}
+
+void
+Model::MeshUpdateTask::run()
+{
+    for ( size_t i = first; i < end; i++ )
+    {
+        model->updatableMeshes[i]->update( pool );
+    }
+}
+
 void
 Model::updateMeshes() 
 {
-#ifdef _OPENMP
-#pragma omp parallel for
-#endif // _OPENMP
-    for ( std::vector< Mesh* >::iterator
-              u    = updatableMeshes.begin(),
-              uEnd = updatableMeshes.end();
-          u < uEnd; ++u )
+    modelData->updateBonePalette();
+
+    // Meshes are grouped into tasks of about MESH_UPDATE_TASK_COST
+    // vertices, so tiny meshes don't cost a task each, big meshes
+    // also split their skinning into tasks (see
+    // HardwareMesh::update), so both many small and one big mesh
+    // are spread over all cores.
+    TaskPool* pool = getTaskPool();
+    size_t    cost = 0;
+
+    meshUpdateTasks.clear();
+
+    for ( size_t i = 0; i < updatableMeshes.size(); i++ )
     {
-        (*u)->update();
+        if ( meshUpdateTasks.empty() || cost >= MESH_UPDATE_TASK_COST )
+        {
+            MeshUpdateTask t;
+            t.model = this;
+            t.pool  = pool;
+            t.first = i;
+            meshUpdateTasks.push_back( t );
+            cost = 0;
+        }
+
+        meshUpdateTasks.back().end = i + 1;
+        cost += meshUpdateCost( updatableMeshes[i] );
+    }
+
+    if ( meshUpdateTasks.size() == 1 )
+    {
+        meshUpdateTasks.front().run();
+    }
+    else if ( !meshUpdateTasks.empty() )
+    {
+        meshUpdateTaskPointers.resize( meshUpdateTasks.size() );
+
+        for ( size_t i = 0; i < meshUpdateTasks.size(); i++ )
+        {
+            meshUpdateTaskPointers[i] = &meshUpdateTasks[i];
+        }
+
+        pool->run( meshUpdateTaskPointers );
     }
 
     for ( RigidTransformsMap::iterator
@@ -467,24 +646,32 @@ Model::blendCycle( int id,
                    float delay,
                    float timeFactor )
 {
-    modelData->getCalMixer()->blendCycle( id, weight, delay );
+    Mixer* mixer = modelData->getMixer();
 
-    if ( timeFactor != 1.0f )
-    {
-        std::vector<CalAnimation *>& av = modelData->getCalMixer()->getAnimationVector();
+    mixer->blendCycle( id, weight, delay );
 
-        if ( av[id] != 0 )
-        {
-            av[id]->setTimeFactor( timeFactor );
-        }
+    if ( timeFactor != 1.0f && mixer->getCycle( id ) != 0 )
+    {
+        mixer->getCycle( id )->setTimeFactor( timeFactor );
     }
 }
 
+void
+Model::blendCycle( int id,
+                   float weight,
+                   float delay,
+                   float timeFactor,
+                   const BoneMask* mask )
+{
+    setBoneMask( id, mask );
+    blendCycle( id, weight, delay, timeFactor );
+}
+
 void
 Model::clearCycle( int id,
                    float delay )
 {
-    modelData->getCalMixer()->clearCycle( id, delay );
+    modelData->getMixer()->clearCycle( id, delay );
 }
 
 void
@@ -495,28 +682,69 @@ Model::executeAction( int id,
                       bool autoLock,
                       float timeFactor )
 {
-    modelData->getCalMixer()->executeAction( id, delayIn, delayOut, weightTarget, autoLock );
+    CalAnimationAction* action =
+        modelData->getMixer()->executeAction( id, delayIn, delayOut, weightTarget, autoLock );
 
-    if ( timeFactor != 1.0f )
+    if ( timeFactor != 1.0f && action != 0 )
     {
-        std::list<CalAnimationAction *>& aal =
-            modelData->getCalMixer()->getAnimationActionList();
-
-        if ( !aal.empty() )
-        {
-            aal.front()->setTimeFactor( timeFactor );
-            // last added action live in first element of list
-        }
+        action->setTimeFactor( timeFactor );
     }
 }
 
+void
+Model::executeAction( int id,
+                      float delayIn,
+                      float delayOut,
+                      float weightTarget,
+                      bool autoLock,
+                      float timeFactor,
+                      const BoneMask* mask )
+{
+    setBoneMask( id, mask );
+    executeAction( id, delayIn, delayOut, weightTarget, autoLock, timeFactor );
+}
+
+void
+Model::setBoneMask( int id,
+                    const BoneMask* mask )
+{
+    modelData->setBoneMask( id, mask );
+}
+
+const BoneMask*
+Model::getBoneMask( int id ) const
+{
+    return modelData->getBoneMask( id );
+}
+
 void
 Model::removeAction( int id )
 {
-    modelData->getCalMixer()->removeAction( id );
+    modelData->getMixer()->removeAction( id );
     modelData->setUpdateForced();
 }
 
+void
+Model::playPaletteAnimation( int id,
+                             float time,
+                             bool loop )
+{
+    const PaletteAnimation* a = getCoreModel()->getPaletteAnimation( id );
+
+    if ( a == 0 )
+    {
+        throw std::runtime_error( "Model::playPaletteAnimation - animation has no palettes" );
+    }
+
+    modelData->setPaletteAnimation( a, time, loop );
+}
+
+void
+Model::stopPaletteAnimation()
+{
+    modelData->setPaletteAnimation( 0, 0.0f, false );
+}
+
 void
 Model::setTimeFactor( double tf )
 {
@@ -529,6 +757,91 @@ Model::getTimeFactor() const
     return timeFactor;
 }
 
+void
+Model::setAnimationLod( AnimationLod* lod )
+{
+    animationLod = lod;
+}
+
+void
+Model::setSkeletonLod( int level )
+{
+    if ( level == skeletonLod )
+    {
+        return;
+    }
+
+    skeletonLod = level;
+    modelData->setSkeletonLod( getCoreModel()->getSkeletonLod( level ) );
+
+    for ( std::vector< Mesh* >::iterator
+              m    = updatableMeshes.begin(),
+              mEnd = updatableMeshes.end();
+          m != mEnd; ++m )
+    {
+        (*m)->setSkeletonLod( level );
+    }
+}
+
+bool
+Model::isPixelSizeNeeded() const
+{
+    return animationLod.valid()
+        || getCoreModel()->getSkeletonLodsCount() > 0
+        || measurePixelSize;
+}
+
+float
+Model::takePixelSize()
+{
+    OpenThreads::ScopedLock< OpenThreads::Mutex > lock( cullResultsMutex );
+
+    float ps = pixelSize;
+    pixelSize = 0;
+
+    return ps;
+}
+
+void
+Model::setPoseCache( PoseCache* cache )
+{
+    modelData->setPoseCache( cache );
+}
+
+PoseCache*
+Model::getPoseCache() const
+{
+    return modelData->getPoseCache();
+}
+
+float
+Model::getPixelSize()
+{
+    OpenThreads::ScopedLock< OpenThreads::Mutex > lock( cullResultsMutex );
+
+    return pixelSize;
+}
+
+void
+Model::setVisibleUpdatesOnly( bool  enabled,
+                              float _guardBand )
+{
+    visibleUpdatesOnly = enabled;
+    guardBand = _guardBand;
+    dirtyBound(); // guard band is included in bound
+}
+
+bool
+Model::takeVisibility()
+{
+    OpenThreads::ScopedLock< OpenThreads::Mutex > lock( cullResultsMutex );
+
+    bool v = visible;
+    visible = false;
+
+    return v;
+}
+
 const CoreModel*
 Model::getCoreModel() const
 {
@@ -550,9 +863,50 @@ Model::getMeshes( const std::string& name ) const
     }
 }
 
+osg::BoundingSphere
+Model::computeBound() const
+{
+    osg::BoundingSphere bs = osg::Group::computeBound();
+
+    if ( visibleUpdatesOnly && bs.valid() )
+    {
+        bs.radius() *= 1.0f + guardBand;
+    }
+
+    return bs;
+}
+
 void
 Model::accept( osg::NodeVisitor& nv )
 {
+    if ( ( isPixelSizeNeeded() || visibleUpdatesOnly )
+         && nv.getVisitorType() == osg::NodeVisitor::CULL_VISITOR
+         && nv.validNodeMask( *this ) )
+    {
+        osgUtil::CullVisitor* cv = dynamic_cast< osgUtil::CullVisitor* >( &nv );
+
+        if ( cv )
+        {
+            osg::BoundingSphere bs = getBound();
+
+            if ( visibleUpdatesOnly )
+            {
+                bs.radius() /= 1.0f + guardBand; // see computeBound()
+            }
+
+            const bool inView = !cv->isCulled( bs );
+            const bool inGuardBand =
+                inView || !cv->isCulled( osg::BoundingSphere( bs.center(),
+                                                              bs.radius() * ( 1.0f + guardBand ) ) );
+            const float ps =
+                inView ? cv->clampedPixelSize( bs ) / cv->getLODScale() : 0.0f;
+
+            OpenThreads::ScopedLock< OpenThreads::Mutex > lock( cullResultsMutex );
+            pixelSize = std::max( pixelSize, ps );
+            visible = visible || inGuardBand;
+        }
+    }
+
     osgUtil::GLObjectsVisitor* glv = dynamic_cast< osgUtil::GLObjectsVisitor* >( &nv );
 
     if ( glv )
@@ -604,11 +958,22 @@ ModelData::ModelData( CoreModel* cm,
                       Model*     m )
     : coreModel( cm )
     , model( m )
+    , animationEvaluator( cm )
+    , flatSkeleton( cm->getCalCoreModel()->getCoreSkeleton() )
     , updateForced( false )
+    , allBonesDirty( true )
+    , calSkeletonValid( true )
+    , skeletonLodChanged( false )
+    , paletteTime( 0 )
+    , paletteLoop( false )
+    , paletteFrame( -1 )
 {
     calModel = new CalModel( coreModel->getCalCoreModel() );
     calModel->update( 0 );
-    calMixer = (CalMixer*)calModel->getAbstractMixer();
+
+    // -- Pooled mixer beside CalMixer (see getCalMixer()) --
+    calMixer = calModel->getMixer();
+    mixer = new Mixer( calModel, 8, coreModel.get() );
 
     const std::vector< CalBone* >& vectorBone = calModel->getSkeleton()->getVectorBone();
 
@@ -628,6 +993,7 @@ ModelData::ModelData( CoreModel* cm,
 
 ModelData::~ModelData()
 {
+    delete mixer;
     delete calModel;
 }
 
@@ -644,45 +1010,293 @@ ModelData::getModel()
     }
 }
 
+/**
+ * Set bone rotation & translation when they differ from current
+ * ones, return true (and mark bone changed) in this case.
+ */
+static
 inline
-float
-square( float x )
+bool
+setBoneTransform( ModelData::BoneParams& b,
+                  const osg::Matrix3&    r,
+                  const osg::Vec3f&      t )
 {
-    return x*x;
+    const float s = transformDistance2( r, t, b.rotation, b.translation );
+
+    if ( s < 1e-7 ) // usually 1e-11..1e-12
+    {
+        b.changed = false;
+    }
+    else
+    {
+        b.changed = true;
+        b.rotation = r;
+        b.translation = t;
+    }
+
+    return b.changed;
 }
 
 bool
 ModelData::update( float deltaTime )
 {
-    // -- Update calMixer & skeleton --
+    if ( paletteAnimation.valid() )
+    {
+        return updateFromPalette( deltaTime );
+    }
+
+    // -- Update mixer & skeleton --
     if ( !updateForced &&
-         //calMixer->getAnimationVector().size() == <total animations count>
-         calMixer->getAnimationActionList().size() == 0 &&
-         calMixer->getAnimationCycle().size() == 0 )
+         mixer->getActions().empty() &&
+         mixer->getCycles().empty() &&
+         calMixer->getAnimationActionList().empty() &&
+         calMixer->getAnimationCycle().empty() )
     {
         return false; // no animations, nothing to update
     }
 
     updateForced = false;
+    calSkeletonValid = false;
+    mixer->updateAnimation( deltaTime ); 
     calMixer->updateAnimation( deltaTime ); 
-    calMixer->updateSkeleton();
 
-    return update();
+    if ( poseCache.valid() )
+    {
+        return updateFromPoseCache();
+    }
+
+    animationEvaluator.getPose( mixer, calMixer, pose );
+    animationEvaluator.updateSkeleton( pose, flatSkeleton );
+    // ^ the same as calMixer->updateSkeleton(), but faster (uses
+    // cursors, baked animations and flat skeleton)
+
+    return updateBoneParams();
+}
+
+CalModel*
+ModelData::getCalModel()
+{
+    if ( !calSkeletonValid && !paletteAnimation.valid() )
+    {
+        animationEvaluator.getPose( mixer, calMixer, pose );
+        animationEvaluator.updateSkeleton( pose, calModel->getSkeleton() );
+        calSkeletonValid = true;
+    }
+
+    return calModel;
+}
+
+void
+ModelData::setSkeletonLod( const SkeletonLod* lod )
+{
+    if ( lod == skeletonLod.get() )
+    {
+        return;
+    }
+
+    skeletonLod = lod;
+    skeletonLodChanged = true;
+    updateForced = true;
+    animationEvaluator.setSkeletonLod( lod );
+}
+
+void
+ModelData::setBoneMask( int id,
+                        const BoneMask* mask )
+{
+    CalCoreModel*     calCoreModel = coreModel->getCalCoreModel();
+    CalCoreAnimation* animation = calCoreModel->getCoreAnimation( id );
+
+    if ( animation == 0 )
+    {
+        throw std::runtime_error( "ModelData::setBoneMask() -- no such animation" );
+    }
+
+    if ( mask && mask->getBonesCount() != (int)calCoreModel->getCoreSkeleton()->getVectorCoreBone().size() )
+    {
+        throw std::runtime_error( "ModelData::setBoneMask() -- mask is for another skeleton" );
+    }
+
+    animationEvaluator.setBoneMask( animation, mask );
+    updateForced = true;
+    calSkeletonValid = false;
+}
+
+const BoneMask*
+ModelData::getBoneMask( int id ) const
+{
+    return animationEvaluator.getBoneMask( coreModel->getCalCoreModel()->getCoreAnimation( id ) );
+}
+
+void
+ModelData::updateAnimationTime( float deltaTime )
+{
+    if ( paletteAnimation.valid() )
+    {
+        advancePaletteTime( deltaTime );
+        return;
+    }
+
+    mixer->updateAnimation( deltaTime );
+    calMixer->updateAnimation( deltaTime );
+    updateForced = true; // evaluate skeleton at the next update
+    calSkeletonValid = false;
+}
+
+void
+ModelData::setPaletteAnimation( const PaletteAnimation* animation,
+                                float time,
+                                bool loop )
+{
+    paletteAnimation = animation;
+    paletteTime = 0;
+    paletteLoop = loop;
+    paletteFrame = -1;
+    updateForced = true; // skeleton is evaluated when we return to mixer
+
+    if ( animation )
+    {
+        advancePaletteTime( time );
+    }
+}
+
+void
+ModelData::advancePaletteTime( float deltaTime )
+{
+    const float duration = paletteAnimation->duration;
+
+    paletteTime += deltaTime;
+
+    if ( paletteLoop && duration > 0 )
+    {
+        paletteTime = fmodf( paletteTime, duration );
+
+        if ( paletteTime < 0 )
+        {
+            paletteTime += duration;
+        }
+    }
+}
+
+bool
+ModelData::updateFromPalette( float deltaTime )
+{
+    advancePaletteTime( deltaTime );
+
+    const PaletteAnimation& a = *paletteAnimation;
+    const int frame = a.getFrame( paletteTime );
+
+    if ( frame == paletteFrame && !skeletonLodChanged )
+    {
+        return false;
+    }
+
+    paletteFrame = frame;
+    skeletonLodChanged = false;
+    allBonesDirty = true;
+
+    // bones count is checked when palettes are loaded or baked
+    for ( size_t i = 0; i < bones.size(); i++ )
+    {
+        BoneParams& b = bones[i];
+
+        memcpy( b.rotation.ptr(), a.getRotation( frame, i ), 9 * sizeof ( float ) );
+        memcpy( b.translation.ptr(), a.getTranslation( frame, i ), 3 * sizeof ( float ) );
+        b.deformed = i + 1 < bones.size(); // last is fake identity bone
+        b.changed = true;
+    }
+
+    return true;
+}
+
+bool
+ModelData::updateFromPoseCache()
+{
+    animationEvaluator.getPose( mixer, calMixer, pose );
+    poseCache->quantize( coreModel.get(), skeletonLod.get(), pose, poseKey );
+
+    osg::ref_ptr< const PoseCache::Palette > palette = poseCache->find( poseKey );
+
+    // -- Take cached pose --
+    if ( palette.valid() )
+    {
+        bool anythingChanged = skeletonLodChanged;
+
+        for ( size_t i = 0; i < bones.size(); i++ )
+        {
+            const PoseCache::Bone& c = palette->bones[i];
+
+            bones[i].deformed = c.deformed;
+
+            if ( setBoneTransform( bones[i], c.rotation, c.translation ) )
+            {
+                anythingChanged = true;
+            }
+        }
+
+        skeletonLodChanged = false;
+        allBonesDirty = true;
+
+        return anythingChanged;
+    }
+
+    // -- Evaluate pose at quantized times and share it --
+    animationEvaluator.updateSkeleton( pose, flatSkeleton );
+
+    bool anythingChanged = updateBoneParams();
+
+    PoseCache::Palette* p = new PoseCache::Palette;
+    p->bones.resize( bones.size() );
+
+    for ( size_t i = 0; i < bones.size(); i++ )
+    {
+        p->bones[i].rotation    = bones[i].rotation;
+        p->bones[i].translation = bones[i].translation;
+        p->bones[i].deformed    = bones[i].deformed;
+    }
+
+    poseCache->insert( poseKey, p );
+
+    return anythingChanged;
 }
 
 bool
 ModelData::update()
+{
+    flatSkeleton.calculateState();
+
+    return updateBoneParams();
+}
+
+bool
+ModelData::updateBoneParams()
 {
     // -- Update bone parameters --
-    bool anythingChanged = false;
+    // (only of bones changed by flat skeleton, unless parameters
+    // were set from elsewhere)
+    const bool allBones = allBonesDirty || skeletonLodChanged;
+    bool anythingChanged = skeletonLodChanged;
     for ( BoneParamsVector::iterator
               b    = bones.begin(),
               bEnd = bones.end() - 1;
           b < bEnd; ++b )
     {
-        const CalQuaternion& rotation = b->bone->getRotationBoneSpace();
-        const CalVector&     translation = b->bone->getTranslationBoneSpace();
-        const CalMatrix&     rm = b->bone->getTransformMatrix();
+        if ( skeletonLod.valid() && skeletonLod->isCollapsed( b - bones.begin() ) )
+        {
+            continue; // see below
+        }
+
+        const int            index = flatSkeleton.getIndex( b - bones.begin() );
+
+        if ( !allBones && !flatSkeleton.isDirty( index ) )
+        {
+            b->changed = false;
+            continue;
+        }
+
+        const CalQuaternion& rotation = flatSkeleton.getRotationBoneSpace( index );
+        const CalVector&     translation = flatSkeleton.getTranslationBoneSpace( index );
+        const CalMatrix&     rm = flatSkeleton.getTransformMatrix( index );
 
         const osg::Matrix3   r( rm.dxdx, rm.dydx, rm.dzdx,
                                 rm.dxdy, rm.dydy, rm.dzdy,
@@ -698,31 +1312,19 @@ ModelData::update()
             //   * It is cal3d that must return correct values, no epsilons
             // But nevertheless we use this to reduce CPU load.
 
-            t.length() > /*boundingBox.radius() **/ 1e-5 // usually 1e-6 .. 1e-7
+            // (squared lengths are compared to not take roots)
+
+            t.length2() > /*boundingBox.radius() **/ 1e-10 // usually 1e-6 .. 1e-7 (not squared)
             ||
             osg::Vec3d( rotation.x,
                         rotation.y,
-                        rotation.z ).length() > 1e-6 // usually 1e-7 .. 1e-8
+                        rotation.z ).length2() > 1e-12 // usually 1e-7 .. 1e-8 (not squared)
             ;
 
         // -- Check for changes --
-        float s = 0;
-        for ( int j = 0; j < 9; j++ )
+        if ( setBoneTransform( *b, r, t ) )
         {
-            s += square( r[j] - b->rotation[j] );
-        }
-        s += ( t - b->translation ).length2();
-
-        if ( s < 1e-7 ) // usually 1e-11..1e-12
-        {
-            b->changed = false;
-        }
-        else
-        {
-            b->changed = true;
             anythingChanged = true;
-            b->rotation = r;
-            b->translation = t;
         }
         
 //         std::cout << "bone: " << b->bone->getCoreBone()->getName() << std::endl
@@ -741,5 +1343,113 @@ ModelData::update()
 //                   << std::endl;
     }
 
+    // -- Collapsed bones follow their surviving ancestors --
+    if ( skeletonLod.valid() )
+    {
+        const std::vector< int >& boneMap = skeletonLod->boneMap;
+
+        for ( size_t i = 0; i < boneMap.size(); i++ )
+        {
+            if ( boneMap[ i ] == (int)i )
+            {
+                continue;
+            }
+
+            BoneParams&       b = bones[ i ];
+            const BoneParams& s = bones[ boneMap[ i ] ];
+
+            b.changed = s.changed || skeletonLodChanged;
+
+            if ( b.changed )
+            {
+                b.rotation = s.rotation;
+                b.translation = s.translation;
+                b.deformed = s.deformed;
+                anythingChanged = true;
+            }
+        }
+    }
+
+    skeletonLodChanged = false;
+    allBonesDirty = false;
+
     return anythingChanged;
 }
+
+// -- Bone palette --
+
+osg::TextureBuffer*
+ModelData::getOrCreateBonePalette()
+{
+    if ( bonePalette.valid() )
+    {
+        return bonePalette.get();
+    }
+
+    // 3 texels per bone: rotation matrix rows (mat3 columns in
+    // shader) with translation components in alpha
+    osg::Image* image = new osg::Image;
+    image->allocateImage( bones.size() * 3, 1, 1, GL_RGBA, GL_FLOAT );
+    image->setInternalTextureFormat( GL_RGBA32F_ARB );
+
+    bonePalette = new osg::TextureBuffer( image );
+    bonePalette->setInternalFormat( GL_RGBA32F_ARB );
+    bonePalette->setDataVariance( osg::Object::DYNAMIC );
+
+    packBonePalette( true );
+
+    osg::StateSet* stateSet = getModel()->getOrCreateStateSet();
+    osg::Uniform*  sampler = new osg::Uniform( osg::Uniform::SAMPLER_BUFFER, "bonePalette" );
+
+    sampler->set( (int)Constants::BONE_PALETTE_TEXTURE_UNIT );
+    stateSet->setTextureAttribute( Constants::BONE_PALETTE_TEXTURE_UNIT, bonePalette.get() );
+    stateSet->addUniform( sampler );
+
+    return bonePalette.get();
+}
+
+void
+ModelData::updateBonePalette()
+{
+    if ( bonePalette.valid() )
+    {
+        packBonePalette( false );
+    }
+}
+
+void
+ModelData::packBonePalette( bool allBones )
+{
+    osg::Image* image = bonePalette->getImage();
+    GLfloat*    p = (GLfloat*)image->data();
+    bool        changed = false;
+
+    for ( BoneParamsVector::const_iterator
+              b    = bones.begin(),
+              bEnd = bones.end();
+          b < bEnd; ++b, p += 12 )
+    {
+        if ( !allBones && !b->changed )
+        {
+            continue;
+        }
+
+        const osg::Matrix3& r = b->rotation;
+        const osg::Vec3f&   t = b->translation;
+
+        for ( int row = 0; row < 3; row++ )
+        {
+            p[ row*4 + 0 ] = r[ row*3 + 0 ];
+            p[ row*4 + 1 ] = r[ row*3 + 1 ];
+            p[ row*4 + 2 ] = r[ row*3 + 2 ];
+            p[ row*4 + 3 ] = t[ row ];
+        }
+
+        changed = true;
+    }
+
+    if ( changed )
+    {
+        image->dirty(); // upload once per context at next apply
+    }
+}
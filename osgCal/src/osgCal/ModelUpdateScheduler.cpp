@@ -0,0 +1,219 @@
+/* -*- c++ -*-
+    Copyright (C) 2008 Vladimir Shabanov <vshabanoff@gmail.com>
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+#include <stdexcept>
+#include <algorithm>
+
+#include <osg/NodeVisitor>
+#include <osg/FrameStamp>
+
+#include <osgCal/ModelUpdateScheduler>
+
+using namespace osgCal;
+
+void
+ModelUpdateScheduler::UpdateTask::run()
+{
+    osg::Timer_t start = timer->tick();
+    model->update( deltaTime );
+
+    // tasks of other models executed by this thread while it waited
+    // for mesh tasks are not cost of this model
+    time = timer->delta_u( start, timer->tick() ) - getStolenTime() * 1e6;
+}
+
+ModelUpdateScheduler::ModelUpdateScheduler( TaskPool* _pool )
+    : pool( _pool ? _pool : TaskPool::instance() )
+    , timeBudget( 0 )
+    , maxDeferredFrames( 30 )
+    , previous( 0 )
+    , prevTime( 0 )
+{}
+
+ModelUpdateScheduler::~ModelUpdateScheduler()
+{}
+
+void
+ModelUpdateScheduler::addModel( Model* model )
+{
+    model->setAutoUpdate( false );
+    model->setMeasurePixelSize( true ); // for priorities
+    model->setTaskPool( pool.get() );
+    models.push_back( ModelEntry( model ) );
+}
+
+void
+ModelUpdateScheduler::removeModel( Model* model )
+{
+    for ( size_t i = 0; i < models.size(); i++ )
+    {
+        if ( models[i].model.get() == model )
+        {
+            models.erase( models.begin() + i );
+            return;
+        }
+    }
+
+    throw std::runtime_error( "ModelUpdateScheduler::removeModel: model not found" );
+}
+
+struct HigherPriority
+{
+        template < typename T >
+        bool operator () ( const T* a,
+                           const T* b ) const
+        {
+            return a->priority > b->priority;
+        }
+};
+
+void
+ModelUpdateScheduler::update( double deltaTime )
+{
+    stats = Stats();
+
+    // -- Collect alive models --
+    size_t alive = 0;
+
+    for ( size_t i = 0; i < models.size(); i++ )
+    {
+        ModelEntry& e = models[i];
+
+        if ( e.model.valid() )
+        {
+            e.pendingTime += deltaTime;
+            e.deferredFrames++;
+
+            if ( timeBudget > 0 )
+            {
+                e.priority = ( 1.0 + e.model->getPixelSize() ) * e.deferredFrames;
+            }
+
+            models[ alive++ ] = e;
+        }
+    }
+
+    models.erase( models.begin() + alive, models.end() ); // forget deleted models
+
+    // -- Select models to update --
+    order.resize( models.size() );
+
+    for ( size_t i = 0; i < models.size(); i++ )
+    {
+        order[i] = &models[i];
+    }
+
+    selected.clear();
+
+    if ( timeBudget <= 0 )
+    {
+        selected = order;
+    }
+    else
+    {
+        std::sort( order.begin(), order.end(), HigherPriority() );
+
+        for ( size_t i = 0; i < order.size(); i++ )
+        {
+            ModelEntry* e = order[i];
+
+            if ( selected.empty()
+                 || stats.estimatedTime + e->cost <= timeBudget )
+            {
+                selected.push_back( e );
+            }
+            else if ( e->deferredFrames > maxDeferredFrames )
+            {
+                selected.push_back( e );
+                stats.forcedModels++;
+            }
+            else
+            {
+                stats.deferredModels++;
+                stats.deferredTime += e->cost;
+                stats.maxDeferredFrames = std::max( stats.maxDeferredFrames,
+                                                    e->deferredFrames );
+                continue;
+            }
+
+            stats.estimatedTime += e->cost;
+        }
+    }
+
+    // -- Update --
+    tasks.resize( selected.size() );
+    taskPointers.resize( tasks.size() );
+
+    for ( size_t i = 0; i < tasks.size(); i++ )
+    {
+        tasks[i].model = selected[i]->model.get();
+        tasks[i].deltaTime = selected[i]->pendingTime;
+        tasks[i].timer = &timer;
+        tasks[i].time = 0;
+        taskPointers[i] = &tasks[i];
+    }
+
+    pool->run( taskPointers );
+
+    // -- Remember costs --
+    for ( size_t i = 0; i < tasks.size(); i++ )
+    {
+        ModelEntry* e = selected[i];
+
+        e->cost = ( e->cost == 0 ? tasks[i].time
+                                 : 0.8 * e->cost + 0.2 * tasks[i].time );
+        e->pendingTime = 0;
+        e->deferredFrames = 0;
+
+        stats.updateTime += tasks[i].time;
+    }
+
+    stats.updatedModels = tasks.size();
+}
+
+void
+ModelUpdateScheduler::operator()( osg::Node*        node,
+                                  osg::NodeVisitor* nv )
+{
+    // -- Calculate time step (as model's own update callback does) --
+    if ( previous == 0 )
+    {
+        previous = timer.tick();
+    }
+
+    double deltaTime = 0;
+
+    if ( !nv->getFrameStamp() )
+    {
+        osg::Timer_t current = timer.tick();
+        deltaTime = timer.delta_s( previous, current );
+        previous = current;
+    }
+    else
+    {
+        double time = nv->getFrameStamp()->getSimulationTime();
+        deltaTime = time - prevTime;
+        prevTime = time;
+    }
+
+    if ( deltaTime > 0.0 )
+    {
+        update( deltaTime );
+    }
+
+    traverse( node, nv );
+}
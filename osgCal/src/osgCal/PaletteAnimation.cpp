@@ -0,0 +1,225 @@
+/* -*- c++ -*-
+    Copyright (C) 2008 Vladimir Shabanov <vshabanoff@gmail.com>
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+#include <stdio.h>
+#include <math.h>
+#include <stdexcept>
+#include <algorithm>
+
+#include <osgCal/PaletteAnimation>
+#include <osgCal/AnimationEvaluator>
+#include <osgCal/FlatSkeleton>
+#include <osgCal/Mixer>
+
+#include "FileIO.h"
+
+using namespace osgCal;
+
+// -- Baking --
+
+PaletteAnimation::PaletteAnimation( CalCoreModel*    calCoreModel,
+                                    int              animationId,
+                                    float            _frameRate,
+                                    CoreModel*       coreModel )
+    : frameRate( _frameRate )
+{
+    CalCoreAnimation* coreAnimation = calCoreModel->getCoreAnimation( animationId );
+
+    if ( coreAnimation == 0 )
+    {
+        throw std::runtime_error( "PaletteAnimation: no such animation" );
+    }
+
+    if ( frameRate <= 0 )
+    {
+        throw std::runtime_error( "PaletteAnimation: frame rate must be positive" );
+    }
+
+    name = coreAnimation->getName();
+    duration = coreAnimation->getDuration();
+    framesCount = (int)ceilf( duration * frameRate ) + 1;
+
+    FlatSkeleton skeleton( calCoreModel->getCoreSkeleton() );
+
+    bonesCount = skeleton.getBonesCount() + 1;
+
+    rotations.resize( framesCount * bonesCount * 9 );
+    translations.resize( framesCount * bonesCount * 3 );
+
+    // -- Evaluate animation alone with full weight --
+    // (with the loop closed as in cycles, so looped palette blends
+    // from the last keyframe to the first one and its last frame is
+    // the same as the first)
+    Mixer::closeLoop( coreAnimation, coreModel );
+
+    CalAnimationAction action( coreAnimation );
+    AnimationEvaluator evaluator( coreModel );
+    AnimationEvaluator::Pose pose( 1 );
+
+    pose[0].animation = &action;
+    pose[0].weight = 1.0f;
+    pose[0].action = true;
+    pose[0].mask = 0;
+
+    for ( int f = 0; f < framesCount; f++ )
+    {
+        pose[0].time = std::min( f / frameRate, duration );
+
+        evaluator.updateSkeleton( pose, skeleton );
+
+        for ( int b = 0; b < bonesCount; b++ )
+        {
+            float* r = &rotations[ ( f * bonesCount + b ) * 9 ];
+            float* t = &translations[ ( f * bonesCount + b ) * 3 ];
+
+            if ( b == bonesCount - 1 ) // fake bone
+            {
+                std::fill( r, r + 9, 0.0f );
+                r[0] = r[4] = r[8] = 1.0f;
+                std::fill( t, t + 3, 0.0f );
+                continue;
+            }
+
+            // the same as in ModelData::updateBoneParams()
+            const int        index = skeleton.getIndex( b );
+            const CalMatrix& rm = skeleton.getTransformMatrix( index );
+            const CalVector& tr = skeleton.getTranslationBoneSpace( index );
+
+            r[0] = rm.dxdx; r[1] = rm.dydx; r[2] = rm.dzdx;
+            r[3] = rm.dxdy; r[4] = rm.dydy; r[5] = rm.dzdy;
+            r[6] = rm.dxdz; r[7] = rm.dydz; r[8] = rm.dzdz;
+
+            t[0] = tr.x; t[1] = tr.y; t[2] = tr.z;
+        }
+    }
+}
+
+// -- Palette animations I/O --
+
+std::string
+osgCal::paletteAnimationsCacheFileName( const std::string& cfgFileName )
+{
+    return cfgFileName + ".palettes.cache";
+}
+
+static const int PALETTES_FILE_VERSION = 0xCA3DB001;
+
+void
+osgCal::loadPaletteAnimations( const std::string& fn,
+                               PaletteAnimations& animations )
+{
+    FILE* f = fopen( fn.c_str(), "rb" );
+
+    if ( f == NULL )
+    {
+        throw std::runtime_error( "Can't open " + fn );
+    }
+
+    FileCloser closeOnExit( f );
+
+    // -- Check version --
+    int version;
+
+    READ_I32( version );
+    if ( version != PALETTES_FILE_VERSION )
+    {
+        throw std::runtime_error( "Incorrect file version " + fn + ". Try rerun osgCalPreparer." );
+    }
+
+    // -- Read animations --
+    int animationsCount = 0;
+
+    READ_I32( animationsCount );
+    if ( animationsCount < 0 )
+    {
+        throw std::runtime_error( "Incorrect animations count in " + fn );
+    }
+    animations.resize( animationsCount );
+
+    for ( int i = 0; i < animationsCount; i++ )
+    {
+        PaletteAnimation* a = new PaletteAnimation;
+        animations[i] = a;
+
+        int nameBufSize = 0;
+        READ_I32( nameBufSize );
+        if ( nameBufSize < 0 || nameBufSize > 1024 )
+        {
+            throw std::runtime_error( "Incorrect animation name size in " + fn );
+        }
+
+        char name[ 1024 ];
+        if ( nameBufSize > 0 )
+        {
+            READ_( a->name, name, nameBufSize );
+        }
+        a->name = std::string( name, nameBufSize );
+
+        READ_STRUCT( a->duration );
+        READ_STRUCT( a->frameRate );
+        READ_I32( a->framesCount );
+        READ_I32( a->bonesCount );
+
+        READ_VECTOR( a->rotations );
+        READ_VECTOR( a->translations );
+
+        if ( a->framesCount < 1 || a->bonesCount < 1
+             || a->rotations.size() != (size_t)a->framesCount * a->bonesCount * 9
+             || a->translations.size() != (size_t)a->framesCount * a->bonesCount * 3 )
+        {
+            throw std::runtime_error( "Incorrect palettes size of animation " + a->name
+                                      + " in " + fn );
+        }
+    }
+}
+
+void
+osgCal::savePaletteAnimations( const PaletteAnimations& animations,
+                               const std::string&       fn )
+{
+    FILE* f = fopen( fn.c_str(), "wb" );
+
+    if ( f == NULL )
+    {
+        throw std::runtime_error( "Can't create " + fn );
+    }
+
+    FileCloser closeOnExit( f );
+
+    WRITE_I32( PALETTES_FILE_VERSION );
+
+    WRITE_I32( animations.size() );
+
+    for ( size_t i = 0; i < animations.size(); i++ )
+    {
+        const PaletteAnimation* a = animations[i].get();
+
+        WRITE_I32( a->name.size() );
+        if ( !a->name.empty() )
+        {
+            WRITE_( a->name, a->name.data(), a->name.size() );
+        }
+
+        WRITE_STRUCT( a->duration );
+        WRITE_STRUCT( a->frameRate );
+        WRITE_I32( a->framesCount );
+        WRITE_I32( a->bonesCount );
+
+        WRITE_VECTOR( a->rotations );
+        WRITE_VECTOR( a->translations );
+    }
+}
@@ -0,0 +1,182 @@
+/* -*- c++ -*-
+    Copyright (C) 2008 Vladimir Shabanov <vshabanoff@gmail.com>
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+#include <math.h>
+#include <algorithm>
+
+#include <OpenThreads/ScopedLock>
+
+#include <osgCal/PoseCache>
+
+using namespace osgCal;
+
+// -- Keys --
+
+bool
+PoseCache::Layer::operator < ( const Layer& l ) const
+{
+    if ( animation != l.animation ) return animation < l.animation;
+    if ( time != l.time )           return time < l.time;
+    if ( weight != l.weight )       return weight < l.weight;
+    if ( action != l.action )       return action < l.action;
+    return mask < l.mask;
+}
+
+bool
+PoseCache::Layer::operator == ( const Layer& l ) const
+{
+    return animation == l.animation
+        && time == l.time
+        && weight == l.weight
+        && action == l.action
+        && mask == l.mask;
+}
+
+bool
+PoseCache::Key::operator < ( const Key& k ) const
+{
+    if ( coreModel != k.coreModel )     return coreModel < k.coreModel;
+    if ( skeletonLod != k.skeletonLod ) return skeletonLod < k.skeletonLod;
+    return layers < k.layers;
+}
+
+// -- Cache --
+
+PoseCache::PoseCache( float  _timeQuantum,
+                      float  _weightQuantum,
+                      size_t _maxPoses )
+    : timeQuantum( _timeQuantum )
+    , weightQuantum( _weightQuantum )
+    , maxPoses( _maxPoses )
+    , uses( 0 )
+    , hits( 0 )
+    , misses( 0 )
+{}
+
+PoseCache::~PoseCache()
+{}
+
+void
+PoseCache::quantize( const CoreModel*          coreModel,
+                     const SkeletonLod*        skeletonLod,
+                     AnimationEvaluator::Pose& pose,
+                     Key&                      key ) const
+{
+    key.coreModel = coreModel;
+    key.skeletonLod = skeletonLod;
+    key.layers.clear();
+
+    size_t n = 0;
+
+    for ( size_t i = 0; i < pose.size(); i++ )
+    {
+        AnimationEvaluator::Layer& p = pose[i];
+
+        Layer l;
+        l.animation = p.animation->getCoreAnimation();
+        l.time      = (int)floorf( p.time / timeQuantum + 0.5f );
+        l.weight    = (int)floorf( p.weight / weightQuantum + 0.5f );
+        l.action    = p.action;
+        l.mask      = p.mask;
+
+        if ( l.weight == 0 )
+        {
+            continue; // invisible in pose
+        }
+
+        key.layers.push_back( l );
+
+        p.time   = l.time * timeQuantum;
+        p.weight = l.weight * weightQuantum;
+        pose[ n++ ] = p;
+    }
+
+    pose.resize( n );
+}
+
+osg::ref_ptr< const PoseCache::Palette >
+PoseCache::find( const Key& key )
+{
+    OpenThreads::ScopedLock< OpenThreads::Mutex > lock( mutex );
+
+    PosesMap::iterator i = poses.find( key );
+
+    if ( i == poses.end() )
+    {
+        misses++;
+        return 0;
+    }
+
+    hits++;
+    i->second.lastUse = ++uses;
+
+    return i->second.palette;
+}
+
+void
+PoseCache::insert( const Key& key,
+                   const Palette* palette )
+{
+    OpenThreads::ScopedLock< OpenThreads::Mutex > lock( mutex );
+
+    // pose can be already inserted by model evaluated in parallel
+    Entry& e = poses[ key ];
+    e.palette = palette;
+    e.lastUse = ++uses;
+
+    if ( poses.size() > maxPoses )
+    {
+        removeLeastRecentlyUsed();
+    }
+}
+
+void
+PoseCache::clear()
+{
+    OpenThreads::ScopedLock< OpenThreads::Mutex > lock( mutex );
+
+    poses.clear();
+}
+
+void
+PoseCache::removeLeastRecentlyUsed()
+{
+    // remove older half of poses, so removal is done once per
+    // maxPoses / 2 insertions
+    std::vector< size_t > lastUses;
+    lastUses.reserve( poses.size() );
+
+    for ( PosesMap::const_iterator i = poses.begin(); i != poses.end(); ++i )
+    {
+        lastUses.push_back( i->second.lastUse );
+    }
+
+    std::vector< size_t >::iterator median = lastUses.begin() + lastUses.size() / 2;
+    std::nth_element( lastUses.begin(), median, lastUses.end() );
+
+    for ( PosesMap::iterator i = poses.begin(); i != poses.end(); )
+    {
+        if ( i->second.lastUse < *median )
+        {
+            poses.erase( i++ );
+        }
+        else
+        {
+            ++i;
+        }
+    }
+}
@@ -16,7 +16,9 @@
    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 */
 #include <osg/Notify>
+#include <osg/State>
 #include <osg/observer_ptr>
+#include <osg/buffered_value>
 
 #include <osgCal/ShadersCache>
 
@@ -111,6 +113,8 @@ ShadersCache::get( int flags )
         int BUMP_MAPPING = ( SHADER_FLAG_BUMP_MAPPING & flags ) ? 1 : 0; \
         int SHINING = ( SHADER_FLAG_SHINING & flags ) ? 1 : 0;          \
         int DEPTH_ONLY = ( SHADER_FLAG_DEPTH_ONLY & flags ) ? 1 : 0;    \
+        int BONE_PALETTE = ( SHADER_FLAG_BONE_PALETTE & flags ) ? 1 : 0; \
+        int INSTANCED = ( SHADER_FLAG_INSTANCED & flags ) ? 1 : 0;      \
         int TWO_SIDED = ( SHADER_FLAG_TWO_SIDED & flags ) ? 1 : 0
         
         PARSE_FLAGS;
@@ -119,8 +123,10 @@ ShadersCache::get( int flags )
         osg::Program* p = new osg::Program;
 
         char name[ 256 ];
-        sprintf( name, "skeletal shader (%d bones%s%s%s%s%s%s%s%s%s)",
+        sprintf( name, "skeletal shader (%d bones%s%s%s%s%s%s%s%s%s%s%s)",
                  BONES_COUNT,
+                 BONE_PALETTE ? ", bone palette" : "",
+                 INSTANCED ? ", instanced" : "",
                  DEPTH_ONLY ? ", depth_only" : "",
                  (FOG_MODE == SHADER_FLAG_FOG_MODE_EXP ? ", fog_exp"
                   : (FOG_MODE == SHADER_FLAG_FOG_MODE_EXP2 ? ", fog_exp2"
@@ -205,7 +211,9 @@ ShadersCache::getFragmentShader( int flags )
 {
     flags &= ~SHADER_FLAG_BONES(0)
         & ~SHADER_FLAG_BONES(1) & ~SHADER_FLAG_BONES(2)
-        & ~SHADER_FLAG_BONES(3) & ~SHADER_FLAG_BONES(4);
+        & ~SHADER_FLAG_BONES(3) & ~SHADER_FLAG_BONES(4)
+        & ~SHADER_FLAG_BONE_PALETTE
+        & ~SHADER_FLAG_INSTANCED;
     // remove irrelevant flags that can lead to
     // duplicate shaders in map  
 
@@ -218,7 +226,7 @@ ShadersCache::getFragmentShader( int flags )
     else
     {                
         PARSE_FLAGS;
-        (void)BONES_COUNT; // remove unused variable warning
+        (void)BONES_COUNT, (void)BONE_PALETTE, (void)INSTANCED; // remove unused variable warning
 
         std::string shaderText;
 
@@ -261,6 +269,111 @@ ShadersCache::releaseGLObjects( osg::State* state ) const
     releaseGLObjectsInMap( programs, state );
 }
 
+/**
+ * Program uniforms with program observer, so entries of deleted
+ * programs are not trusted when their address is reused.
+ */
+struct ProgramUniformsEntry
+{
+        ProgramUniformsEntry()
+            : frameNumber( 0 )
+        {}
+
+        osg::observer_ptr< const osg::Program::PerContextProgram > program;
+        unsigned int                                               frameNumber; ///< of last resolve
+        ShadersCache::ProgramUniforms                              uniforms;
+};
+
+/**
+ * Program uniforms of one context.
+ */
+struct ProgramUniformsMap
+{
+        ProgramUniformsMap()
+            : frameNumber( 0 )
+            , swept( false )
+        {}
+
+        typedef std::map< const osg::Program::PerContextProgram*,
+                          ProgramUniformsEntry > Entries;
+
+        Entries         entries;
+        unsigned int    frameNumber; ///< of last sweep of deleted programs
+        bool            swept;
+};
+
+static
+GLint
+getArrayUniformLocation( const osg::Program::PerContextProgram* program,
+                         const std::string&                     name )
+{
+    GLint location = program->getUniformLocation( name );
+
+    if ( location < 0 )
+    {
+        location = program->getUniformLocation( name + "[0]" );
+        // Why the hell on ATI it has uniforms for each
+        // elements? (nVidia has only one uniform for the whole array)
+    }
+
+    return location;
+}
+
+ShadersCache::ProgramUniforms&
+ShadersCache::getProgramUniforms( const osg::Program::PerContextProgram* program,
+                                  const osg::State&                      state )
+{
+    static osg::buffered_object< ProgramUniformsMap > programUniforms;
+
+    ProgramUniformsMap& m = programUniforms[ state.getContextID() ];
+
+    // OSG doesn't tell about relinks: Program::dirtyProgram only
+    // requests relink of the same PerContextProgram at its next
+    // apply, which happens before draws using it. So we trust
+    // entries only in the frame they were resolved in (and
+    // don't trust them at all without frame stamp).
+    const osg::FrameStamp* frameStamp  = state.getFrameStamp();
+    const unsigned int     frameNumber = frameStamp ? frameStamp->getFrameNumber() : 0;
+
+    // -- Erase entries of deleted programs once per frame --
+    if ( !m.swept || m.frameNumber != frameNumber || !frameStamp )
+    {
+        for ( ProgramUniformsMap::Entries::iterator i = m.entries.begin();
+              i != m.entries.end(); )
+        {
+            if ( i->second.program.valid() )
+            {
+                ++i;
+            }
+            else
+            {
+                m.entries.erase( i++ );
+            }
+        }
+
+        m.frameNumber = frameNumber;
+        m.swept       = true;
+    }
+
+    ProgramUniformsEntry& e = m.entries[ program ];
+
+    if ( e.program.get() != program
+         || e.frameNumber != frameNumber
+         || !frameStamp )
+    {
+        // -- New (or maybe relinked) program, resolve its uniforms --
+        e.program     = program;
+        e.frameNumber = frameNumber;
+        e.uniforms    = ProgramUniforms();
+
+        e.uniforms.rotationMatrices   = getArrayUniformLocation( program, "rotationMatrices" );
+        e.uniforms.translationVectors = getArrayUniformLocation( program, "translationVectors" );
+        e.uniforms.frontFacing        = program->getUniformLocation( "frontFacing" );
+    }
+
+    return e.uniforms;
+}
+
 /**
  * Global instance of ShadersCache.
  * There is only one shader instance which is created with first CoreModel
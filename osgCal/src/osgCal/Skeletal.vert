@@ -1,5 +1,12 @@
 // -*-c++-*-
 
+#if BONE_PALETTE
+# extension GL_EXT_gpu_shader4 : enable
+#if INSTANCED
+# extension GL_ARB_draw_instanced : enable
+#endif
+#endif
+
 # ifndef __GLSL_CG_DATA_TYPES // the space after '#' is necessary to
                               // differentiate `sed' defines from GLSL one's
   // remove half float types on non-nVidia videocards
@@ -15,8 +22,41 @@
 # define weight gl_MultiTexCoord2
 # define index  gl_MultiTexCoord3
 
+#if BONE_PALETTE
+// model's bone palette, 3 texels per bone: rotation matrix columns
+// with translation components in w
+uniform samplerBuffer bonePalette;
+
+#if INSTANCED
+// crowd palette: palettes of all instances one after another, with
+// instance transform premultiplied into bones
+uniform int instanceStride;
+# define paletteTexel( i ) (gl_InstanceIDARB * instanceStride + int(i) * 3)
+#else
+# define paletteTexel( i ) (int(i) * 3)
+#endif
+
+mat3 rotationMatrix( float i )
+{
+    int t = paletteTexel( i );
+    return mat3( texelFetchBuffer( bonePalette, t ).xyz,
+                 texelFetchBuffer( bonePalette, t + 1 ).xyz,
+                 texelFetchBuffer( bonePalette, t + 2 ).xyz );
+}
+
+vec3 translationVector( float i )
+{
+    int t = paletteTexel( i );
+    return vec3( texelFetchBuffer( bonePalette, t ).w,
+                 texelFetchBuffer( bonePalette, t + 1 ).w,
+                 texelFetchBuffer( bonePalette, t + 2 ).w );
+}
+#else
 uniform mat3 rotationMatrices[31];
 uniform vec3 translationVectors[31];
+# define rotationMatrix( i )    rotationMatrices[int(i)]
+# define translationVector( i ) translationVectors[int(i)]
+#endif
 #endif
 
 varying vec3 vNormal;
@@ -41,20 +81,20 @@ void main()
 #endif
 
 #if BONES_COUNT >= 1
-    mat3 totalRotation = weight.x * rotationMatrices[int(index.x)];
-    vec3 transformedPosition = weight.x * translationVectors[int(index.x)];
+    mat3 totalRotation = weight.x * rotationMatrix(index.x);
+    vec3 transformedPosition = weight.x * translationVector(index.x);
 
 #if BONES_COUNT >= 2
-    totalRotation += weight.y * rotationMatrices[int(index.y)];
-    transformedPosition += weight.y * translationVectors[int(index.y)];
+    totalRotation += weight.y * rotationMatrix(index.y);
+    transformedPosition += weight.y * translationVector(index.y);
 
 #if BONES_COUNT >= 3
-    totalRotation += weight.z * rotationMatrices[int(index.z)];
-    transformedPosition += weight.z * translationVectors[int(index.z)];
+    totalRotation += weight.z * rotationMatrix(index.z);
+    transformedPosition += weight.z * translationVector(index.z);
 
 #if BONES_COUNT >= 4
-    totalRotation += weight.w * rotationMatrices[int(index.w)];
-    transformedPosition += weight.w * translationVectors[int(index.w)];
+    totalRotation += weight.w * rotationMatrix(index.w);
+    transformedPosition += weight.w * translationVector(index.w);
 #endif // BONES_COUNT >= 4
 #endif // BONES_COUNT >= 3
 #endif // BONES_COUNT >= 2
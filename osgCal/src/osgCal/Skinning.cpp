@@ -0,0 +1,1425 @@
+/* -*- c++ -*-
+    Copyright (C) 2008 Vladimir Shabanov <vshabanoff@gmail.com>
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+#include <string.h>
+#include <float.h>
+#include <math.h>
+#include <stdexcept>
+
+#include <osgCal/Skinning>
+
+// -- SIMD support detection --
+//
+// SSE kernels are compiled when compiler generates SSE2 code by
+// default (any x86_64 compiler, or 32-bit with -msse2 / /arch:SSE2).
+// AVX kernels are compiled using per-function target attribute
+// (gcc >= 4.9, clang) or directly (MSVC) and selected at runtime.
+// Byte normals (OSG_CAL_BYTE_BUFFERS) are handled by scalar code only.
+
+#if !defined(OSG_CAL_BYTE_BUFFERS)                                      \
+    && ( defined(__SSE2__) || defined(_M_X64)                           \
+         || (defined(_M_IX86_FP) && _M_IX86_FP >= 2) )
+#  define OSGCAL_SKINNING_SSE 1
+#  include <emmintrin.h>
+
+#  if defined(_MSC_VER) && _MSC_VER >= 1600
+#    define OSGCAL_SKINNING_AVX 1
+#    define OSGCAL_TARGET_AVX
+#    include <immintrin.h>
+#    include <intrin.h>
+#  elif defined(__clang__)                                              \
+    || ( defined(__GNUC__) && ( __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9) ) )
+#    define OSGCAL_SKINNING_AVX 1
+#    define OSGCAL_TARGET_AVX __attribute__(( target( "avx" ) ))
+#    include <immintrin.h>
+#  endif
+
+// four and eight vertices kernels are called twice (for the main
+// loop and for the tail) and are not inlined without a hint
+#  if defined(_MSC_VER)
+#    define OSGCAL_FORCE_INLINE __forceinline
+#  else
+#    define OSGCAL_FORCE_INLINE inline __attribute__(( always_inline ))
+#  endif
+#endif
+
+using namespace osgCal;
+
+// -- Palette --
+
+SkinningPalette::SkinningPalette( int bonesCount )
+    : bonesCount( -1 )
+    , mask( 0 )
+    , identityIndex( -1 )
+{
+    resize( bonesCount );
+}
+
+void
+SkinningPalette::resize( int n )
+{
+    if ( n == bonesCount )
+    {
+        return;
+    }
+
+    if ( n < 0 || n > MAX_SIZE )
+    {
+        throw std::runtime_error( "SkinningPalette: too many bones for byte matrix indices" );
+    }
+
+    int size = MIN_SIZE;
+
+    while ( size < n )
+    {
+        size *= 2;
+    }
+
+    bonesCount = n;
+    mask = size - 1;
+    identityIndex = n <= IDENTITY_INDEX ? IDENTITY_INDEX : -1;
+    bones.resize( size * 16 );
+
+    clear();
+}
+
+void
+SkinningPalette::clear()
+{
+    memset( &bones.front(), 0, bones.size() * sizeof ( float ) );
+
+    if ( identityIndex >= 0 )
+    {
+        setIdentity( identityIndex ); // last always identity (see #68)
+    }
+}
+
+void
+SkinningPalette::set( int                 index,
+                      const osg::Matrix3& r,
+                      const osg::Vec3f&   t )
+{
+    float (*b)[4] = (float (*)[4])&bones[ index * 16 ];
+
+    // rows of matrix, so v' = v.x*b[0] + v.y*b[1] + v.z*b[2] + b[3]
+    // (the same multiplication order as in former mul3())
+    for ( int i = 0; i < 3; i++ )
+    {
+        b[i][0] = r( i, 0 );
+        b[i][1] = r( i, 1 );
+        b[i][2] = r( i, 2 );
+        b[i][3] = 0;
+    }
+
+    b[3][0] = t.x();
+    b[3][1] = t.y();
+    b[3][2] = t.z();
+    b[3][3] = 0;
+}
+
+void
+SkinningPalette::setIdentity( int index )
+{
+    set( index,
+         osg::Matrix3( 1, 0, 0,
+                       0, 1, 0,
+                       0, 0, 1 ),
+         osg::Vec3f( 0, 0, 0 ) );
+}
+
+// -- Scalar kernels --
+
+static
+inline
+osg::Vec3f
+convert( const osg::Vec3f& v )
+{
+    return v;
+}
+
+static
+inline
+osg::Vec3f
+convert( const osg::Vec3b& v )
+{
+    return osg::Vec3f( v.x() / 127.0, v.y() / 127.0, v.z() / 127.0 );
+}
+
+static
+inline
+osg::Vec3f
+rotate( const float*       b,
+        const osg::Vec3f&  v )
+{
+    return osg::Vec3f( b[0]*v.x() + b[4]*v.y() + b[ 8]*v.z(),
+                       b[1]*v.x() + b[5]*v.y() + b[ 9]*v.z(),
+                       b[2]*v.x() + b[6]*v.y() + b[10]*v.z() );
+}
+
+static
+inline
+osg::Vec3f
+translation( const float* b )
+{
+    return osg::Vec3f( b[12], b[13], b[14] );
+}
+
+// Strange, but multiplying each matrix on source vector works
+// faster than accumulating matrix and multiply at the end (as in
+// shader)
+//
+// Not strange:
+// mul3            9*  6+
+// mul3 + tv       9*  9+
+// (mul3 + tv)*w  12*  9+
+// v += ..        12* 12+ (-3 for first)
+// x4 48* 45+
+//
+// +=rm,+=tv      12* 12+ (-12 for first)
+// (mul3 + tv)*w  12*  9+
+// x4 60* 45+
+// accumulation of matrix is more expensive than multiplicating
+
+/**
+ * Reference implementation, the same algorithm that was used in
+ * HardwareMesh/SoftwareMesh::update before SIMD kernels. Weights
+ * are sorted in descending order, so we stop at first zero weight
+ * ('if's get ~15% speedup here).
+ */
+template < bool NORMALS, typename NormalType >
+static
+void
+skinScalar( const SkinningPalette&               palette,
+            int                                  maxBonesInfluence,
+            const osg::Vec3f*                    sv,
+            const NormalType*                    sn,
+            const osg::Vec4f*                    w,
+            const MatrixIndexBuffer::value_type* mi,
+            osg::Vec3f*                          v,
+            osg::Vec3f*                          n,
+            size_t                               count,
+            osg::BoundingBox&                    bb )
+{
+    for ( size_t i = 0; i < count; i++ )
+    {
+        if ( !palette.isIdentity( mi[i][0] ) )
+            // we have no zero weight vertices, unrigged ones are bound to identity
+        {
+            const float* b = palette.bone( mi[i][0] );
+
+            v[i] = (rotate( b, sv[i] ) + translation( b )) * w[i][0];
+            if ( NORMALS )
+            {
+                n[i] = rotate( b, convert( sn[i] ) ) * w[i][0];
+            }
+
+            for ( int k = 1; k < maxBonesInfluence && w[i][k] != 0.0f; k++ )
+            {
+                b = palette.bone( mi[i][k] );
+
+                v[i] += (rotate( b, sv[i] ) + translation( b )) * w[i][k];
+                if ( NORMALS )
+                {
+                    n[i] += rotate( b, convert( sn[i] ) ) * w[i][k];
+                }
+            }
+        }
+        else
+        {
+            v[i] = sv[i];
+            if ( NORMALS )
+            {
+                n[i] = convert( sn[i] );
+            }
+        }
+
+        bb.expandBy( v[i] );
+    }
+}
+
+static
+void
+expandBoundingBoxScalar( const osg::Vec3f* v,
+                         size_t            count,
+                         osg::BoundingBox& bb )
+{
+    for ( const osg::Vec3f* vEnd = v + count; v < vEnd; ++v )
+    {
+        bb.expandBy( *v );
+    }
+}
+
+/**
+ * Raw pointers to streams data. Kernels copy them to locals, since
+ * compiler can't prove that output vertices don't alias vectors
+ * internals and reloads them after each store otherwise.
+ */
+struct StreamPointers
+{
+    StreamPointers( const SkinningStreams& s,
+                    size_t                 first )
+    {
+        x = &s.x[ first ];
+        y = &s.y[ first ];
+        z = &s.z[ first ];
+
+        nx = s.hasNormals() ? &s.nx[ first ] : 0;
+        ny = s.hasNormals() ? &s.ny[ first ] : 0;
+        nz = s.hasNormals() ? &s.nz[ first ] : 0;
+
+        for ( int k = 0; k < 4; k++ )
+        {
+            w[ k ] = &s.weights[ k ][ first ];
+            mi[ k ] = &s.matrixIndices[ k ][ first ];
+        }
+    }
+
+    const float*    x;
+    const float*    y;
+    const float*    z;
+    const float*    nx;
+    const float*    ny;
+    const float*    nz;
+    const float*    w[ 4 ];
+    const GLubyte*  mi[ 4 ];
+};
+
+/**
+ * The same as skinScalar, but reads inputs from SoA streams.
+ */
+template < bool NORMALS >
+static
+void
+skinStreamsScalar( const SkinningPalette&  palette,
+                   int                     maxBonesInfluence,
+                   const StreamPointers&   s,
+                   osg::Vec3f*             v,
+                   osg::Vec3f*             n,
+                   size_t                  count,
+                   osg::BoundingBox&       bb )
+{
+    for ( size_t i = 0; i < count; i++ )
+    {
+        const osg::Vec3f sv( s.x[i], s.y[i], s.z[i] );
+        osg::Vec3f       sn;
+
+        if ( NORMALS )
+        {
+            sn.set( s.nx[i], s.ny[i], s.nz[i] );
+        }
+
+        if ( !palette.isIdentity( s.mi[0][i] ) )
+        {
+            const float* b = palette.bone( s.mi[0][i] );
+            float        w = s.w[0][i];
+
+            v[i] = (rotate( b, sv ) + translation( b )) * w;
+            if ( NORMALS )
+            {
+                n[i] = rotate( b, sn ) * w;
+            }
+
+            for ( int k = 1; k < maxBonesInfluence && s.w[k][i] != 0.0f; k++ )
+            {
+                b = palette.bone( s.mi[k][i] );
+                w = s.w[k][i];
+
+                v[i] += (rotate( b, sv ) + translation( b )) * w;
+                if ( NORMALS )
+                {
+                    n[i] += rotate( b, sn ) * w;
+                }
+            }
+        }
+        else
+        {
+            v[i] = sv;
+            if ( NORMALS )
+            {
+                n[i] = sn;
+            }
+        }
+
+        bb.expandBy( v[i] );
+    }
+}
+
+// -- SSE kernels --
+
+#ifdef OSGCAL_SKINNING_SSE
+
+// Kernels are branch free: all influences are processed, zero
+// weights simply add zero. Indices are masked (see
+// SkinningPalette::maskedBone) so the garbage index of unused
+// influence can't read outside of the palette (unused palette
+// entries are zero, so 0*0 is added).
+//
+// Operations order is the same as in scalar code, so without
+// FMA contraction results are bit exact (except the sign of zero).
+
+static
+inline
+void
+storeVec3( osg::Vec3f& v,
+           __m128      r )
+{
+    float f[4];
+    _mm_storeu_ps( f, r );
+    v.set( f[0], f[1], f[2] );
+}
+
+static
+inline
+void
+mergeBoundingBox( osg::BoundingBox& bb,
+                  __m128            bbMin,
+                  __m128            bbMax )
+{
+    float mn[4];
+    float mx[4];
+    _mm_storeu_ps( mn, bbMin );
+    _mm_storeu_ps( mx, bbMax );
+    bb.expandBy( osg::Vec3f( mn[0], mn[1], mn[2] ) );
+    bb.expandBy( osg::Vec3f( mx[0], mx[1], mx[2] ) );
+}
+
+/**
+ * Deform one vertex (and normal), return vertex in SSE register.
+ */
+template < int INFLUENCES, bool NORMALS >
+static
+inline
+__m128
+skinOneSSE( const SkinningPalette&               palette,
+            const osg::Vec3f&                    sv,
+            const osg::Vec3f*                    sn,
+            const osg::Vec4f&                    w,
+            const MatrixIndexBuffer::value_type& mi,
+            osg::Vec3f*                          n )
+{
+    const __m128 x = _mm_set1_ps( sv.x() );
+    const __m128 y = _mm_set1_ps( sv.y() );
+    const __m128 z = _mm_set1_ps( sv.z() );
+
+    __m128 nx, ny, nz;
+    __m128 nacc = _mm_setzero_ps();
+    if ( NORMALS )
+    {
+        nx = _mm_set1_ps( sn->x() );
+        ny = _mm_set1_ps( sn->y() );
+        nz = _mm_set1_ps( sn->z() );
+    }
+
+    __m128 acc = _mm_setzero_ps();
+
+    for ( int k = 0; k < INFLUENCES; k++ )
+    {
+        const float* b  = palette.maskedBone( mi[k] );
+        const __m128 r0 = _mm_loadu_ps( b + 0 );
+        const __m128 r1 = _mm_loadu_ps( b + 4 );
+        const __m128 r2 = _mm_loadu_ps( b + 8 );
+        const __m128 t  = _mm_loadu_ps( b + 12 );
+        const __m128 wk = _mm_set1_ps( w[k] );
+
+        __m128 r = _mm_add_ps( _mm_add_ps( _mm_mul_ps( r0, x ),
+                                           _mm_mul_ps( r1, y ) ),
+                               _mm_mul_ps( r2, z ) );
+        acc = _mm_add_ps( acc, _mm_mul_ps( _mm_add_ps( r, t ), wk ) );
+
+        if ( NORMALS )
+        {
+            __m128 rn = _mm_add_ps( _mm_add_ps( _mm_mul_ps( r0, nx ),
+                                                _mm_mul_ps( r1, ny ) ),
+                                    _mm_mul_ps( r2, nz ) );
+            nacc = _mm_add_ps( nacc, _mm_mul_ps( rn, wk ) );
+        }
+    }
+
+    if ( NORMALS )
+    {
+        storeVec3( *n, nacc );
+    }
+
+    return acc;
+}
+
+template < int INFLUENCES, bool NORMALS >
+static
+void
+skinSSE( const SkinningPalette&               palette,
+         const osg::Vec3f*                    sv,
+         const osg::Vec3f*                    sn,
+         const osg::Vec4f*                    w,
+         const MatrixIndexBuffer::value_type* mi,
+         osg::Vec3f*                          v,
+         osg::Vec3f*                          n,
+         size_t                               count,
+         osg::BoundingBox&                    bb )
+{
+    if ( count == 0 )
+    {
+        return;
+    }
+
+    __m128 bbMin = _mm_set1_ps(  FLT_MAX );
+    __m128 bbMax = _mm_set1_ps( -FLT_MAX );
+
+    for ( size_t i = 0; i < count; i++ )
+    {
+        __m128 r = skinOneSSE< INFLUENCES, NORMALS >( palette, sv[i],
+                                                      NORMALS ? &sn[i] : 0,
+                                                      w[i], mi[i],
+                                                      NORMALS ? &n[i] : 0 );
+        storeVec3( v[i], r );
+        bbMin = _mm_min_ps( bbMin, r );
+        bbMax = _mm_max_ps( bbMax, r );
+    }
+
+    mergeBoundingBox( bb, bbMin, bbMax );
+}
+
+/**
+ * Four vertices in SoA form (or four normals).
+ */
+struct Vec3x4
+{
+    __m128 x, y, z;
+};
+
+/**
+ * Load \c row of four bones and transpose it, so c0 gets first
+ * elements of all bones, c1 second, etc.
+ */
+static
+inline
+void
+loadRowSSE( const float* const b[4],
+            int                row,
+            __m128&            c0,
+            __m128&            c1,
+            __m128&            c2 )
+{
+    const __m128 a0 = _mm_loadu_ps( b[0] + row*4 );
+    const __m128 a1 = _mm_loadu_ps( b[1] + row*4 );
+    const __m128 a2 = _mm_loadu_ps( b[2] + row*4 );
+    const __m128 a3 = _mm_loadu_ps( b[3] + row*4 );
+
+    const __m128 t0 = _mm_unpacklo_ps( a0, a1 ); // x0 x1 y0 y1
+    const __m128 t1 = _mm_unpackhi_ps( a0, a1 ); // z0 z1 w0 w1
+    const __m128 t2 = _mm_unpacklo_ps( a2, a3 ); // x2 x3 y2 y3
+    const __m128 t3 = _mm_unpackhi_ps( a2, a3 ); // z2 z3 w2 w3
+
+    c0 = _mm_movelh_ps( t0, t2 );
+    c1 = _mm_movehl_ps( t2, t0 );
+    c2 = _mm_movelh_ps( t1, t3 );
+}
+
+/**
+ * Deform four vertices (and normals) from SoA streams starting at
+ * \c i. Each matrix element of four bones is in one register, so
+ * there are no horizontal operations at all.
+ */
+template < int INFLUENCES, bool NORMALS >
+static
+OSGCAL_FORCE_INLINE
+void
+skinFourSSE( const SkinningPalette& palette,
+             const StreamPointers&  s,
+             size_t                 i,
+             Vec3x4&                r,
+             Vec3x4&                rn )
+{
+    const __m128 x = _mm_loadu_ps( s.x + i );
+    const __m128 y = _mm_loadu_ps( s.y + i );
+    const __m128 z = _mm_loadu_ps( s.z + i );
+
+    __m128 nx, ny, nz;
+    if ( NORMALS )
+    {
+        nx = _mm_loadu_ps( s.nx + i );
+        ny = _mm_loadu_ps( s.ny + i );
+        nz = _mm_loadu_ps( s.nz + i );
+        rn.x = rn.y = rn.z = _mm_setzero_ps();
+    }
+
+    r.x = r.y = r.z = _mm_setzero_ps();
+
+    for ( int k = 0; k < INFLUENCES; k++ )
+    {
+        const GLubyte* mi = s.mi[k] + i;
+        const float*   b[4] = { palette.maskedBone( mi[0] ),
+                                palette.maskedBone( mi[1] ),
+                                palette.maskedBone( mi[2] ),
+                                palette.maskedBone( mi[3] ) };
+        const __m128   wk = _mm_loadu_ps( s.w[k] + i );
+
+        __m128 m00, m01, m02;
+        __m128 m10, m11, m12;
+        __m128 m20, m21, m22;
+        __m128 tx,  ty,  tz;
+
+        loadRowSSE( b, 0, m00, m01, m02 );
+        loadRowSSE( b, 1, m10, m11, m12 );
+        loadRowSSE( b, 2, m20, m21, m22 );
+        loadRowSSE( b, 3, tx,  ty,  tz  );
+
+#define ROTATE( _c, _x, _y, _z )                                        \
+        _mm_add_ps( _mm_add_ps( _mm_mul_ps( m0##_c, _x ),               \
+                                _mm_mul_ps( m1##_c, _y ) ),             \
+                    _mm_mul_ps( m2##_c, _z ) )
+
+        r.x = _mm_add_ps( r.x, _mm_mul_ps( _mm_add_ps( ROTATE( 0, x, y, z ), tx ), wk ) );
+        r.y = _mm_add_ps( r.y, _mm_mul_ps( _mm_add_ps( ROTATE( 1, x, y, z ), ty ), wk ) );
+        r.z = _mm_add_ps( r.z, _mm_mul_ps( _mm_add_ps( ROTATE( 2, x, y, z ), tz ), wk ) );
+
+        if ( NORMALS )
+        {
+            rn.x = _mm_add_ps( rn.x, _mm_mul_ps( ROTATE( 0, nx, ny, nz ), wk ) );
+            rn.y = _mm_add_ps( rn.y, _mm_mul_ps( ROTATE( 1, nx, ny, nz ), wk ) );
+            rn.z = _mm_add_ps( rn.z, _mm_mul_ps( ROTATE( 2, nx, ny, nz ), wk ) );
+        }
+
+#undef ROTATE
+    }
+}
+
+/**
+ * Store four SoA vectors to Vec3 array (transposing them to
+ * x0 y0 z0 x1 | y1 z1 x2 y2 | z2 x3 y3 z3).
+ */
+static
+inline
+void
+storeVec3x4( osg::Vec3f*   v,
+             const Vec3x4& r )
+{
+    const __m128 xy01 = _mm_unpacklo_ps( r.x, r.y ); // x0 y0 x1 y1
+    const __m128 xy23 = _mm_unpackhi_ps( r.x, r.y ); // x2 y2 x3 y3
+
+    const __m128 z0x1 = _mm_shuffle_ps( r.z,  xy01, _MM_SHUFFLE( 2, 2, 0, 0 ) );
+    const __m128 y1z1 = _mm_shuffle_ps( xy01, r.z,  _MM_SHUFFLE( 1, 1, 3, 3 ) );
+    const __m128 z2x3 = _mm_shuffle_ps( r.z,  xy23, _MM_SHUFFLE( 2, 2, 2, 2 ) );
+    const __m128 y3z3 = _mm_shuffle_ps( xy23, r.z,  _MM_SHUFFLE( 3, 3, 3, 3 ) );
+
+    float* f = v->ptr();
+    _mm_storeu_ps( f + 0, _mm_shuffle_ps( xy01, z0x1, _MM_SHUFFLE( 2, 0, 1, 0 ) ) );
+    _mm_storeu_ps( f + 4, _mm_shuffle_ps( y1z1, xy23, _MM_SHUFFLE( 1, 0, 2, 0 ) ) );
+    _mm_storeu_ps( f + 8, _mm_shuffle_ps( z2x3, y3z3, _MM_SHUFFLE( 2, 0, 2, 0 ) ) );
+}
+
+/**
+ * Store first \c lanes of four SoA vectors.
+ */
+static
+inline
+void
+storeVec3s( osg::Vec3f*   v,
+            const Vec3x4& r,
+            size_t        lanes )
+{
+    float x[4], y[4], z[4];
+    _mm_storeu_ps( x, r.x );
+    _mm_storeu_ps( y, r.y );
+    _mm_storeu_ps( z, r.z );
+
+    for ( size_t l = 0; l < lanes; l++ )
+    {
+        v[l].set( x[l], y[l], z[l] );
+    }
+}
+
+static
+inline
+float
+horizontalMin( __m128 r )
+{
+    r = _mm_min_ps( r, _mm_shuffle_ps( r, r, _MM_SHUFFLE( 1, 0, 3, 2 ) ) );
+    r = _mm_min_ps( r, _mm_shuffle_ps( r, r, _MM_SHUFFLE( 2, 3, 0, 1 ) ) );
+    return _mm_cvtss_f32( r );
+}
+
+static
+inline
+float
+horizontalMax( __m128 r )
+{
+    r = _mm_max_ps( r, _mm_shuffle_ps( r, r, _MM_SHUFFLE( 1, 0, 3, 2 ) ) );
+    r = _mm_max_ps( r, _mm_shuffle_ps( r, r, _MM_SHUFFLE( 2, 3, 0, 1 ) ) );
+    return _mm_cvtss_f32( r );
+}
+
+static
+inline
+void
+mergeBoundingBox( osg::BoundingBox& bb,
+                  const Vec3x4&     bbMin,
+                  const Vec3x4&     bbMax )
+{
+    bb.expandBy( osg::Vec3f( horizontalMin( bbMin.x ),
+                             horizontalMin( bbMin.y ),
+                             horizontalMin( bbMin.z ) ) );
+    bb.expandBy( osg::Vec3f( horizontalMax( bbMax.x ),
+                             horizontalMax( bbMax.y ),
+                             horizontalMax( bbMax.z ) ) );
+}
+
+template < int INFLUENCES, bool NORMALS >
+static
+void
+skinStreamsSSE( const SkinningPalette& palette,
+                const SkinningStreams& streams,
+                size_t                 first,
+                osg::Vec3f*            v,
+                osg::Vec3f*            n,
+                size_t                 count,
+                osg::BoundingBox&      bb )
+{
+    const StreamPointers s( streams, first );
+
+    Vec3x4 bbMin;
+    Vec3x4 bbMax;
+    bbMin.x = bbMin.y = bbMin.z = _mm_set1_ps(  FLT_MAX );
+    bbMax.x = bbMax.y = bbMax.z = _mm_set1_ps( -FLT_MAX );
+
+    size_t j = 0;
+
+    for ( ; j + 4 <= count; j += 4 )
+    {
+        Vec3x4 r, rn;
+        skinFourSSE< INFLUENCES, NORMALS >( palette, s, j, r, rn );
+
+        storeVec3x4( v + j, r );
+        if ( NORMALS )
+        {
+            storeVec3x4( n + j, rn );
+        }
+
+        bbMin.x = _mm_min_ps( bbMin.x, r.x );
+        bbMin.y = _mm_min_ps( bbMin.y, r.y );
+        bbMin.z = _mm_min_ps( bbMin.z, r.z );
+        bbMax.x = _mm_max_ps( bbMax.x, r.x );
+        bbMax.y = _mm_max_ps( bbMax.y, r.y );
+        bbMax.z = _mm_max_ps( bbMax.z, r.z );
+    }
+
+    if ( j > 0 )
+    {
+        mergeBoundingBox( bb, bbMin, bbMax );
+    }
+
+    if ( j < count )
+    {
+        if ( first + j + 4 <= streams.paddedCount )
+        {
+            // tail fits in padding, padded lanes are not stored
+            Vec3x4 r, rn;
+            skinFourSSE< INFLUENCES, NORMALS >( palette, s, j, r, rn );
+
+            storeVec3s( v + j, r, count - j );
+            if ( NORMALS )
+            {
+                storeVec3s( n + j, rn, count - j );
+            }
+
+            expandBoundingBoxScalar( v + j, count - j, bb );
+        }
+        else
+        {
+            const StreamPointers tail( streams, first + j );
+            skinStreamsScalar< NORMALS >( palette, INFLUENCES, tail,
+                                          v + j, NORMALS ? n + j : 0,
+                                          count - j, bb );
+        }
+    }
+}
+
+static
+void
+expandBoundingBoxSSE( const osg::Vec3f* v,
+                      size_t            count,
+                      osg::BoundingBox& bb )
+{
+    if ( count == 0 )
+    {
+        return;
+    }
+
+    __m128 bbMin = _mm_set1_ps(  FLT_MAX );
+    __m128 bbMax = _mm_set1_ps( -FLT_MAX );
+
+    for ( const osg::Vec3f* vEnd = v + count; v < vEnd; ++v )
+    {
+        const __m128 r = _mm_setr_ps( v->x(), v->y(), v->z(), 0 );
+        bbMin = _mm_min_ps( bbMin, r );
+        bbMax = _mm_max_ps( bbMax, r );
+    }
+
+    mergeBoundingBox( bb, bbMin, bbMax );
+}
+
+static
+float
+transformDistance2SSE( const osg::Matrix3& r1,
+                       const osg::Vec3f&   t1,
+                       const osg::Matrix3& r2,
+                       const osg::Vec3f&   t2 )
+{
+    const float* a = r1.ptr();
+    const float* b = r2.ptr();
+
+    // 9 rotation elements + 3 translation ones in three registers
+    const __m128 d0 = _mm_sub_ps( _mm_loadu_ps( a ), _mm_loadu_ps( b ) );
+    const __m128 d1 = _mm_sub_ps( _mm_loadu_ps( a + 4 ), _mm_loadu_ps( b + 4 ) );
+    const __m128 d2 = _mm_sub_ps( _mm_setr_ps( a[8], t1.x(), t1.y(), t1.z() ),
+                                  _mm_setr_ps( b[8], t2.x(), t2.y(), t2.z() ) );
+
+    __m128 s = _mm_add_ps( _mm_add_ps( _mm_mul_ps( d0, d0 ),
+                                       _mm_mul_ps( d1, d1 ) ),
+                           _mm_mul_ps( d2, d2 ) );
+
+    s = _mm_add_ps( s, _mm_movehl_ps( s, s ) );
+    s = _mm_add_ss( s, _mm_shuffle_ps( s, s, _MM_SHUFFLE( 1, 1, 1, 1 ) ) );
+
+    return _mm_cvtss_f32( s );
+}
+
+#endif // OSGCAL_SKINNING_SSE
+
+// -- AVX kernels --
+
+#ifdef OSGCAL_SKINNING_AVX
+
+// Two vertices per iteration, first one in low and second one in
+// high 128 bit lane. Palette rows of different bones are combined
+// into one register, so we still have one multiplication per row.
+
+#define PAIR( _a, _b )                                                  \
+    _mm256_insertf128_ps( _mm256_castps128_ps256( _a ), _b, 1 )
+
+template < int INFLUENCES, bool NORMALS >
+OSGCAL_TARGET_AVX
+static
+void
+skinAVX( const SkinningPalette&               palette,
+         const osg::Vec3f*                    sv,
+         const osg::Vec3f*                    sn,
+         const osg::Vec4f*                    w,
+         const MatrixIndexBuffer::value_type* mi,
+         osg::Vec3f*                          v,
+         osg::Vec3f*                          n,
+         size_t                               count,
+         osg::BoundingBox&                    bb )
+{
+    if ( count == 0 )
+    {
+        return;
+    }
+
+    __m256 bbMin = _mm256_set1_ps(  FLT_MAX );
+    __m256 bbMax = _mm256_set1_ps( -FLT_MAX );
+
+    size_t i = 0;
+
+    for ( ; i + 2 <= count; i += 2 )
+    {
+        const __m256 x = PAIR( _mm_set1_ps( sv[i].x() ), _mm_set1_ps( sv[i+1].x() ) );
+        const __m256 y = PAIR( _mm_set1_ps( sv[i].y() ), _mm_set1_ps( sv[i+1].y() ) );
+        const __m256 z = PAIR( _mm_set1_ps( sv[i].z() ), _mm_set1_ps( sv[i+1].z() ) );
+
+        __m256 nx, ny, nz;
+        __m256 nacc = _mm256_setzero_ps();
+        if ( NORMALS )
+        {
+            nx = PAIR( _mm_set1_ps( sn[i].x() ), _mm_set1_ps( sn[i+1].x() ) );
+            ny = PAIR( _mm_set1_ps( sn[i].y() ), _mm_set1_ps( sn[i+1].y() ) );
+            nz = PAIR( _mm_set1_ps( sn[i].z() ), _mm_set1_ps( sn[i+1].z() ) );
+        }
+
+        __m256 acc = _mm256_setzero_ps();
+
+        for ( int k = 0; k < INFLUENCES; k++ )
+        {
+            const float* b0 = palette.maskedBone( mi[i  ][k] );
+            const float* b1 = palette.maskedBone( mi[i+1][k] );
+
+            const __m256 r0 = PAIR( _mm_loadu_ps( b0 + 0 ),  _mm_loadu_ps( b1 + 0 ) );
+            const __m256 r1 = PAIR( _mm_loadu_ps( b0 + 4 ),  _mm_loadu_ps( b1 + 4 ) );
+            const __m256 r2 = PAIR( _mm_loadu_ps( b0 + 8 ),  _mm_loadu_ps( b1 + 8 ) );
+            const __m256 t  = PAIR( _mm_loadu_ps( b0 + 12 ), _mm_loadu_ps( b1 + 12 ) );
+            const __m256 wk = PAIR( _mm_set1_ps( w[i][k] ),  _mm_set1_ps( w[i+1][k] ) );
+
+            __m256 r = _mm256_add_ps( _mm256_add_ps( _mm256_mul_ps( r0, x ),
+                                                     _mm256_mul_ps( r1, y ) ),
+                                      _mm256_mul_ps( r2, z ) );
+            acc = _mm256_add_ps( acc, _mm256_mul_ps( _mm256_add_ps( r, t ), wk ) );
+
+            if ( NORMALS )
+            {
+                __m256 rn = _mm256_add_ps( _mm256_add_ps( _mm256_mul_ps( r0, nx ),
+                                                          _mm256_mul_ps( r1, ny ) ),
+                                           _mm256_mul_ps( r2, nz ) );
+                nacc = _mm256_add_ps( nacc, _mm256_mul_ps( rn, wk ) );
+            }
+        }
+
+        float f[8];
+        _mm256_storeu_ps( f, acc );
+        v[i  ].set( f[0], f[1], f[2] );
+        v[i+1].set( f[4], f[5], f[6] );
+
+        if ( NORMALS )
+        {
+            _mm256_storeu_ps( f, nacc );
+            n[i  ].set( f[0], f[1], f[2] );
+            n[i+1].set( f[4], f[5], f[6] );
+        }
+
+        bbMin = _mm256_min_ps( bbMin, acc );
+        bbMax = _mm256_max_ps( bbMax, acc );
+    }
+
+    __m128 bbMin4 = _mm_min_ps( _mm256_castps256_ps128( bbMin ),
+                                _mm256_extractf128_ps( bbMin, 1 ) );
+    __m128 bbMax4 = _mm_max_ps( _mm256_castps256_ps128( bbMax ),
+                                _mm256_extractf128_ps( bbMax, 1 ) );
+
+    if ( i < count ) // odd vertex
+    {
+        __m128 r = skinOneSSE< INFLUENCES, NORMALS >( palette, sv[i],
+                                                      NORMALS ? &sn[i] : 0,
+                                                      w[i], mi[i],
+                                                      NORMALS ? &n[i] : 0 );
+        storeVec3( v[i], r );
+        bbMin4 = _mm_min_ps( bbMin4, r );
+        bbMax4 = _mm_max_ps( bbMax4, r );
+    }
+
+    _mm256_zeroupper();
+
+    mergeBoundingBox( bb, bbMin4, bbMax4 );
+}
+
+/**
+ * Eight vertices version of loadRowSSE. Rows of bones l and l+4
+ * are paired in one register, so after in-lane transposition we
+ * get elements of bones 0..7 in lanes 0..7.
+ */
+OSGCAL_TARGET_AVX
+static
+inline
+void
+loadRowAVX( const float* const b[8],
+            int                row,
+            __m256&            c0,
+            __m256&            c1,
+            __m256&            c2 )
+{
+    const __m256 a0 = PAIR( _mm_loadu_ps( b[0] + row*4 ), _mm_loadu_ps( b[4] + row*4 ) );
+    const __m256 a1 = PAIR( _mm_loadu_ps( b[1] + row*4 ), _mm_loadu_ps( b[5] + row*4 ) );
+    const __m256 a2 = PAIR( _mm_loadu_ps( b[2] + row*4 ), _mm_loadu_ps( b[6] + row*4 ) );
+    const __m256 a3 = PAIR( _mm_loadu_ps( b[3] + row*4 ), _mm_loadu_ps( b[7] + row*4 ) );
+
+    const __m256 t0 = _mm256_unpacklo_ps( a0, a1 );
+    const __m256 t1 = _mm256_unpackhi_ps( a0, a1 );
+    const __m256 t2 = _mm256_unpacklo_ps( a2, a3 );
+    const __m256 t3 = _mm256_unpackhi_ps( a2, a3 );
+
+    c0 = _mm256_shuffle_ps( t0, t2, _MM_SHUFFLE( 1, 0, 1, 0 ) );
+    c1 = _mm256_shuffle_ps( t0, t2, _MM_SHUFFLE( 3, 2, 3, 2 ) );
+    c2 = _mm256_shuffle_ps( t1, t3, _MM_SHUFFLE( 1, 0, 1, 0 ) );
+}
+
+struct Vec3x8
+{
+    __m256 x, y, z;
+};
+
+template < int INFLUENCES, bool NORMALS >
+OSGCAL_TARGET_AVX
+static
+OSGCAL_FORCE_INLINE
+void
+skinEightAVX( const SkinningPalette& palette,
+              const StreamPointers&  s,
+              size_t                 i,
+              Vec3x8&                r,
+              Vec3x8&                rn )
+{
+    const __m256 x = _mm256_loadu_ps( s.x + i );
+    const __m256 y = _mm256_loadu_ps( s.y + i );
+    const __m256 z = _mm256_loadu_ps( s.z + i );
+
+    __m256 nx, ny, nz;
+    if ( NORMALS )
+    {
+        nx = _mm256_loadu_ps( s.nx + i );
+        ny = _mm256_loadu_ps( s.ny + i );
+        nz = _mm256_loadu_ps( s.nz + i );
+        rn.x = rn.y = rn.z = _mm256_setzero_ps();
+    }
+
+    r.x = r.y = r.z = _mm256_setzero_ps();
+
+    for ( int k = 0; k < INFLUENCES; k++ )
+    {
+        const GLubyte* mi = s.mi[k] + i;
+        const float*   b[8] = { palette.maskedBone( mi[0] ),
+                                palette.maskedBone( mi[1] ),
+                                palette.maskedBone( mi[2] ),
+                                palette.maskedBone( mi[3] ),
+                                palette.maskedBone( mi[4] ),
+                                palette.maskedBone( mi[5] ),
+                                palette.maskedBone( mi[6] ),
+                                palette.maskedBone( mi[7] ) };
+        const __m256   wk = _mm256_loadu_ps( s.w[k] + i );
+
+        __m256 m00, m01, m02;
+        __m256 m10, m11, m12;
+        __m256 m20, m21, m22;
+        __m256 tx,  ty,  tz;
+
+        loadRowAVX( b, 0, m00, m01, m02 );
+        loadRowAVX( b, 1, m10, m11, m12 );
+        loadRowAVX( b, 2, m20, m21, m22 );
+        loadRowAVX( b, 3, tx,  ty,  tz  );
+
+#define ROTATE( _c, _x, _y, _z )                                        \
+        _mm256_add_ps( _mm256_add_ps( _mm256_mul_ps( m0##_c, _x ),      \
+                                      _mm256_mul_ps( m1##_c, _y ) ),    \
+                       _mm256_mul_ps( m2##_c, _z ) )
+
+        r.x = _mm256_add_ps( r.x, _mm256_mul_ps( _mm256_add_ps( ROTATE( 0, x, y, z ), tx ), wk ) );
+        r.y = _mm256_add_ps( r.y, _mm256_mul_ps( _mm256_add_ps( ROTATE( 1, x, y, z ), ty ), wk ) );
+        r.z = _mm256_add_ps( r.z, _mm256_mul_ps( _mm256_add_ps( ROTATE( 2, x, y, z ), tz ), wk ) );
+
+        if ( NORMALS )
+        {
+            rn.x = _mm256_add_ps( rn.x, _mm256_mul_ps( ROTATE( 0, nx, ny, nz ), wk ) );
+            rn.y = _mm256_add_ps( rn.y, _mm256_mul_ps( ROTATE( 1, nx, ny, nz ), wk ) );
+            rn.z = _mm256_add_ps( rn.z, _mm256_mul_ps( ROTATE( 2, nx, ny, nz ), wk ) );
+        }
+
+#undef ROTATE
+    }
+}
+
+OSGCAL_TARGET_AVX
+static
+inline
+void
+storeVec3x8( osg::Vec3f*   v,
+             const Vec3x8& r )
+{
+    Vec3x4 lo, hi;
+
+    lo.x = _mm256_castps256_ps128( r.x );
+    lo.y = _mm256_castps256_ps128( r.y );
+    lo.z = _mm256_castps256_ps128( r.z );
+    hi.x = _mm256_extractf128_ps( r.x, 1 );
+    hi.y = _mm256_extractf128_ps( r.y, 1 );
+    hi.z = _mm256_extractf128_ps( r.z, 1 );
+
+    storeVec3x4( v,     lo );
+    storeVec3x4( v + 4, hi );
+}
+
+template < int INFLUENCES, bool NORMALS >
+OSGCAL_TARGET_AVX
+static
+void
+skinStreamsAVX( const SkinningPalette& palette,
+                const SkinningStreams& streams,
+                size_t                 first,
+                osg::Vec3f*            v,
+                osg::Vec3f*            n,
+                size_t                 count,
+                osg::BoundingBox&      bb )
+{
+    const StreamPointers s( streams, first );
+
+    Vec3x8 bbMin;
+    Vec3x8 bbMax;
+    bbMin.x = bbMin.y = bbMin.z = _mm256_set1_ps(  FLT_MAX );
+    bbMax.x = bbMax.y = bbMax.z = _mm256_set1_ps( -FLT_MAX );
+
+    size_t j = 0;
+
+    for ( ; j + 8 <= count; j += 8 )
+    {
+        Vec3x8 r, rn;
+        skinEightAVX< INFLUENCES, NORMALS >( palette, s, j, r, rn );
+
+        storeVec3x8( v + j, r );
+        if ( NORMALS )
+        {
+            storeVec3x8( n + j, rn );
+        }
+
+        bbMin.x = _mm256_min_ps( bbMin.x, r.x );
+        bbMin.y = _mm256_min_ps( bbMin.y, r.y );
+        bbMin.z = _mm256_min_ps( bbMin.z, r.z );
+        bbMax.x = _mm256_max_ps( bbMax.x, r.x );
+        bbMax.y = _mm256_max_ps( bbMax.y, r.y );
+        bbMax.z = _mm256_max_ps( bbMax.z, r.z );
+    }
+
+    if ( j > 0 )
+    {
+        Vec3x4 mn, mx;
+
+#define HALVES( _op, _r )                                               \
+        _op( _mm256_castps256_ps128( _r ), _mm256_extractf128_ps( _r, 1 ) )
+
+        mn.x = HALVES( _mm_min_ps, bbMin.x );
+        mn.y = HALVES( _mm_min_ps, bbMin.y );
+        mn.z = HALVES( _mm_min_ps, bbMin.z );
+        mx.x = HALVES( _mm_max_ps, bbMax.x );
+        mx.y = HALVES( _mm_max_ps, bbMax.y );
+        mx.z = HALVES( _mm_max_ps, bbMax.z );
+
+#undef HALVES
+
+        mergeBoundingBox( bb, mn, mx );
+    }
+
+    _mm256_zeroupper();
+
+    if ( j < count )
+    {
+        skinStreamsSSE< INFLUENCES, NORMALS >( palette, streams, first + j,
+                                               v + j, NORMALS ? n + j : 0,
+                                               count - j, bb );
+    }
+}
+
+#undef PAIR
+
+static
+bool
+cpuSupportsAVX()
+{
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuid( info, 1 );
+
+    const bool osxsave = ( info[2] & (1 << 27) ) != 0;
+    const bool avx     = ( info[2] & (1 << 28) ) != 0;
+
+    // OS must save ymm registers on context switch
+    return osxsave && avx && ( _xgetbv( 0 ) & 6 ) == 6;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports( "avx" );
+#endif
+}
+
+#endif // OSGCAL_SKINNING_AVX
+
+// -- Kernel selection --
+
+static SkinningKernel skinningKernel = SKINNING_AUTO;
+
+static
+SkinningKernel
+bestSupportedKernel( SkinningKernel requested )
+{
+#ifdef OSGCAL_SKINNING_AVX
+    if ( requested == SKINNING_AUTO || requested == SKINNING_AVX )
+    {
+        static const bool avx = cpuSupportsAVX();
+
+        if ( avx )
+        {
+            return SKINNING_AVX;
+        }
+    }
+#endif
+
+#ifdef OSGCAL_SKINNING_SSE
+    if ( requested != SKINNING_SCALAR )
+    {
+        return SKINNING_SSE;
+    }
+#endif
+
+    (void)requested;
+    return SKINNING_SCALAR;
+}
+
+void
+osgCal::setSkinningKernel( SkinningKernel k )
+{
+    skinningKernel = bestSupportedKernel( k );
+}
+
+SkinningKernel
+osgCal::getSkinningKernel()
+{
+    if ( skinningKernel == SKINNING_AUTO )
+    {
+        skinningKernel = bestSupportedKernel( SKINNING_AUTO );
+        // ^ no lock, concurrent calls select the same kernel
+    }
+
+    return skinningKernel;
+}
+
+// -- Dispatch --
+
+#define DISPATCH_INFLUENCES( _kernel, _normals )                        \
+    switch ( maxBonesInfluence )                                        \
+    {                                                                   \
+        case 1: _kernel< 1, _normals >( KERNEL_ARGS ); break;           \
+        case 2: _kernel< 2, _normals >( KERNEL_ARGS ); break;           \
+        case 3: _kernel< 3, _normals >( KERNEL_ARGS ); break;           \
+        case 4: _kernel< 4, _normals >( KERNEL_ARGS ); break;           \
+        default:                                                        \
+            throw std::runtime_error( "maxBonesInfluence > 4 ???" );    \
+    }
+
+void
+osgCal::skinVertices( const SkinningPalette&               palette,
+                      int                                  maxBonesInfluence,
+                      const osg::Vec3f*                    sourceVertices,
+                      const osg::Vec4f*                    weights,
+                      const MatrixIndexBuffer::value_type* matrixIndices,
+                      osg::Vec3f*                          vertices,
+                      size_t                               count,
+                      osg::BoundingBox&                    bb )
+{
+#define KERNEL_ARGS palette, sourceVertices, (const osg::Vec3f*)0,      \
+        weights, matrixIndices, vertices, (osg::Vec3f*)0, count, bb
+
+    switch ( getSkinningKernel() )
+    {
+#ifdef OSGCAL_SKINNING_AVX
+        case SKINNING_AVX:
+            DISPATCH_INFLUENCES( skinAVX, false );
+            return;
+#endif
+#ifdef OSGCAL_SKINNING_SSE
+        case SKINNING_SSE:
+            DISPATCH_INFLUENCES( skinSSE, false );
+            return;
+#endif
+        default:
+            if ( maxBonesInfluence < 1 || maxBonesInfluence > 4 )
+            {
+                throw std::runtime_error( "maxBonesInfluence > 4 ???" );
+            }
+            skinScalar< false >( palette, maxBonesInfluence,
+                                 sourceVertices, (const osg::Vec3f*)0,
+                                 weights, matrixIndices,
+                                 vertices, (osg::Vec3f*)0, count, bb );
+    }
+
+#undef KERNEL_ARGS
+}
+
+void
+osgCal::skinVerticesAndNormals( const SkinningPalette&               palette,
+                                int                                  maxBonesInfluence,
+                                const osg::Vec3f*                    sourceVertices,
+                                const NormalBuffer::value_type*      sourceNormals,
+                                const osg::Vec4f*                    weights,
+                                const MatrixIndexBuffer::value_type* matrixIndices,
+                                osg::Vec3f*                          vertices,
+                                osg::Vec3f*                          normals,
+                                size_t                               count,
+                                osg::BoundingBox&                    bb )
+{
+#define KERNEL_ARGS palette, sourceVertices, sourceNormals,             \
+        weights, matrixIndices, vertices, normals, count, bb
+
+    switch ( getSkinningKernel() )
+    {
+#ifdef OSGCAL_SKINNING_AVX
+        case SKINNING_AVX:
+            DISPATCH_INFLUENCES( skinAVX, true );
+            return;
+#endif
+#ifdef OSGCAL_SKINNING_SSE
+        case SKINNING_SSE:
+            DISPATCH_INFLUENCES( skinSSE, true );
+            return;
+#endif
+        default:
+            if ( maxBonesInfluence < 1 || maxBonesInfluence > 4 )
+            {
+                throw std::runtime_error( "maxBonesInfluence > 4 ???" );
+            }
+            skinScalar< true >( palette, maxBonesInfluence,
+                                sourceVertices, sourceNormals,
+                                weights, matrixIndices,
+                                vertices, normals, count, bb );
+    }
+
+#undef KERNEL_ARGS
+}
+
+void
+osgCal::skinVertices( const SkinningPalette& palette,
+                      int                    maxBonesInfluence,
+                      const SkinningStreams& streams,
+                      size_t                 first,
+                      osg::Vec3f*            vertices,
+                      size_t                 count,
+                      osg::BoundingBox&      bb )
+{
+#define KERNEL_ARGS palette, streams, first, vertices, (osg::Vec3f*)0, count, bb
+
+    switch ( getSkinningKernel() )
+    {
+#ifdef OSGCAL_SKINNING_AVX
+        case SKINNING_AVX:
+            DISPATCH_INFLUENCES( skinStreamsAVX, false );
+            return;
+#endif
+#ifdef OSGCAL_SKINNING_SSE
+        case SKINNING_SSE:
+            DISPATCH_INFLUENCES( skinStreamsSSE, false );
+            return;
+#endif
+        default:
+            if ( maxBonesInfluence < 1 || maxBonesInfluence > 4 )
+            {
+                throw std::runtime_error( "maxBonesInfluence > 4 ???" );
+            }
+            skinStreamsScalar< false >( palette, maxBonesInfluence,
+                                        StreamPointers( streams, first ),
+                                        vertices, (osg::Vec3f*)0, count, bb );
+    }
+
+#undef KERNEL_ARGS
+}
+
+void
+osgCal::skinVerticesAndNormals( const SkinningPalette& palette,
+                                int                    maxBonesInfluence,
+                                const SkinningStreams& streams,
+                                size_t                 first,
+                                osg::Vec3f*            vertices,
+                                osg::Vec3f*            normals,
+                                size_t                 count,
+                                osg::BoundingBox&      bb )
+{
+    if ( !streams.hasNormals() )
+    {
+        throw std::runtime_error( "skinVerticesAndNormals: skinning streams have no normals" );
+    }
+
+#define KERNEL_ARGS palette, streams, first, vertices, normals, count, bb
+
+    switch ( getSkinningKernel() )
+    {
+#ifdef OSGCAL_SKINNING_AVX
+        case SKINNING_AVX:
+            DISPATCH_INFLUENCES( skinStreamsAVX, true );
+            return;
+#endif
+#ifdef OSGCAL_SKINNING_SSE
+        case SKINNING_SSE:
+            DISPATCH_INFLUENCES( skinStreamsSSE, true );
+            return;
+#endif
+        default:
+            if ( maxBonesInfluence < 1 || maxBonesInfluence > 4 )
+            {
+                throw std::runtime_error( "maxBonesInfluence > 4 ???" );
+            }
+            skinStreamsScalar< true >( palette, maxBonesInfluence,
+                                       StreamPointers( streams, first ),
+                                       vertices, normals, count, bb );
+    }
+
+#undef KERNEL_ARGS
+}
+
+#undef DISPATCH_INFLUENCES
+
+void
+osgCal::expandBoundingBox( const osg::Vec3f* vertices,
+                           size_t            count,
+                           osg::BoundingBox& bb )
+{
+#ifdef OSGCAL_SKINNING_SSE
+    if ( getSkinningKernel() != SKINNING_SCALAR )
+    {
+        expandBoundingBoxSSE( vertices, count, bb );
+        return;
+    }
+#endif
+
+    expandBoundingBoxScalar( vertices, count, bb );
+}
+
+float
+osgCal::transformDistance2( const osg::Matrix3& r1,
+                            const osg::Vec3f&   t1,
+                            const osg::Matrix3& r2,
+                            const osg::Vec3f&   t2 )
+{
+#ifdef OSGCAL_SKINNING_SSE
+    if ( getSkinningKernel() != SKINNING_SCALAR )
+    {
+        // (12 floats are too few for AVX)
+        return transformDistance2SSE( r1, t1, r2, t2 );
+    }
+#endif
+
+    const float* a = r1.ptr();
+    const float* b = r2.ptr();
+    float        s = 0;
+
+    for ( int j = 0; j < 9; j++ )
+    {
+        s += ( a[j] - b[j] ) * ( a[j] - b[j] );
+    }
+
+    return s + ( t1 - t2 ).length2();
+}
+
+void
+osgCal::expandBoundingBoxByBones( const SkinningPalette&  palette,
+                                  const osg::BoundingBox* boneBoxes,
+                                  size_t                  count,
+                                  osg::BoundingBox&       bb )
+{
+    for ( size_t i = 0; i < count; i++ )
+    {
+        const osg::BoundingBox& box = boneBoxes[ i ];
+
+        if ( !box.valid() )
+        {
+            continue;
+        }
+
+        // transform center and project half extents on the
+        // transformed axes (Arvo's method)
+        const float*     b = palette.bone( i );
+        const osg::Vec3f c = box.center();
+        const osg::Vec3f e = ( box._max - box._min ) * 0.5f;
+
+        osg::Vec3f tc = rotate( b, c ) + translation( b );
+        osg::Vec3f te( fabsf( b[0] )*e.x() + fabsf( b[4] )*e.y() + fabsf( b[ 8] )*e.z(),
+                       fabsf( b[1] )*e.x() + fabsf( b[5] )*e.y() + fabsf( b[ 9] )*e.z(),
+                       fabsf( b[2] )*e.x() + fabsf( b[6] )*e.y() + fabsf( b[10] )*e.z() );
+
+        bb.expandBy( tc - te );
+        bb.expandBy( tc + te );
+    }
+}
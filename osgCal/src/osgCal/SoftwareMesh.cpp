@@ -20,6 +20,7 @@
 
 #include <osg/Notify>
 #include <osgCal/SoftwareMesh>
+#include <osgCal/Skinning>
 
 #include <iostream>
 
@@ -84,192 +85,61 @@ SoftwareMesh::clone( const osg::CopyOp& ) const
     throw std::runtime_error( "clone() is not implemented" );
 }
 
-static
-inline
-osg::Vec3f
-convert( const osg::Vec3f& v )
-{
-    return v;
-}
-
-static
-inline
-osg::Vec3f
-convert( const osg::Vec3b& v )
-{
-    return osg::Vec3f( v.x() / 127.0, v.y() / 127.0, v.z() / 127.0 );
-}
-
-static
-inline
-osg::Vec3f
-mul3( const osg::Matrix3& m,
-      const osg::Vec3f& v )
-{
-    return osg::Vec3f( m(0,0)*v.x() + m(1,0)*v.y() + m(2,0)*v.z(),
-                       m(0,1)*v.x() + m(1,1)*v.y() + m(2,1)*v.z(),
-                       m(0,2)*v.x() + m(1,2)*v.y() + m(2,2)*v.z() );
-}
-
-inline
-osg::Vec3f
-mul3( const osg::Matrix3& m,
-      const osg::Vec3b& v )
-{
-    return mul3( m, convert( v ) );
-}
-
 void
-SoftwareMesh::update()
+SoftwareMesh::update( TaskPool* /*pool*/ )
 {
-    // hmm. is it good to copy/paste? its nearly the same algorithm
-    
-    // -- Setup rotation matrices & translation vertices --
-    typedef std::pair< osg::Matrix3, osg::Vec3f > RTPair;
-    float rotationTranslationMatricesData[ 31 * sizeof (RTPair) / sizeof ( float ) ];
-    // we make data to not init matrices & vertex since we always set
-    // them to correct data
-    RTPair* rotationTranslationMatrices = (RTPair*)(void*)&rotationTranslationMatricesData;
-
+    // -- Check changes --
     bool changed = false;
 
     for( int boneIndex = 0; boneIndex < mesh->data->getBonesCount(); boneIndex++ )
     {
-        int boneId = mesh->data->getBoneId( boneIndex );
-        const ModelData::BoneParams& bp = modelData->getBoneParams( boneId );
-
-        changed  |= bp.changed;
-
-        RTPair& rt = rotationTranslationMatrices[ boneIndex ];
-
-        rt.first  = bp.rotation;
-        rt.second = bp.translation;
+        changed |= modelData->getBoneParams( mesh->data->getBoneId( boneIndex ) ).changed;
     }
    
-    // -- Check changes --
     if ( !changed )
     {
         return; // no changes
     }
 
-    rotationTranslationMatrices[ 30 ] = // last always identity (see #68)
-        std::make_pair( osg::Matrix3( 1, 0, 0,
-                                      0, 1, 0,
-                                      0, 0, 1 ),
-                        osg::Vec3( 0, 0, 0 ) );
-
-    // -- Scan indexes --
-    boundingBox = osg::BoundingBox();
-    
-    VertexBuffer&               vb  = *(VertexBuffer*)getVertexArray();
-    NormalBuffer&               nb  = *(NormalBuffer*)getNormalArray();
-    const VertexBuffer&         svb = *mesh->data->vertexBuffer.get();
-    const NormalBuffer&         snb = *mesh->data->normalBuffer.get();
-    const WeightBuffer&         wb  = *mesh->data->weightBuffer.get();
-    const MatrixIndexBuffer&    mib = *mesh->data->matrixIndexBuffer.get();
+    // -- Setup rotation matrices & translation vertices --
+    SkinningPalette& palette = skinningPalette;
+    palette.resize( mesh->data->getBonesCount() );
+    // ^ identity at IDENTITY_INDEX for small meshes (see #68)
 
-    osg::Vec3f*        v  = &vb.front()  ; /* dest vector */   
-    osg::Vec3f*        n  = &nb.front()  ; /* dest normal */   
-    const osg::Vec3f*  sv = &svb.front() ; /* source vector */   
-    const NormalBuffer::value_type*
-                       sn = &snb.front() ; /* source normal */   
-    const osg::Vec4f*  w  = &wb.front()  ; /* weights */         
-    const MatrixIndexBuffer::value_type*
-                       mi = &mib.front() ; /* bone indexes */		
+    for( int boneIndex = 0; boneIndex < mesh->data->getBonesCount(); boneIndex++ )
+    {
+        const ModelData::BoneParams& bp =
+            modelData->getBoneParams( mesh->data->getBoneId( boneIndex ) );
 
-    osg::Vec3f*        vEnd = v + vb.size(); /* dest vector end */   
-    
-#define ITERATE( _f )                           \
-    while ( v < vEnd )                          \
-    {                                           \
-        _f;                                     \
-                                                \
-        boundingBox.expandBy( *v );             \
-        ++v;                                    \
-        ++n;                                    \
-        ++sv;                                   \
-        ++sn;                                   \
-        ++w;                                    \
-        ++mi;                                   \
+        palette.set( boneIndex, bp.rotation, bp.translation );
     }
 
-    #define x() r()
-    #define y() g()
-    #define z() b()
-    #define w() a()
-
-    // 'if's get ~15% speedup here
+    // -- Deform vertices & normals --
+    boundingBox = osg::BoundingBox();
     
-#define PROCESS_X( _process_y )                                         \
-    if ( mi->x() != 30 )                                                \
-        /* we have no zero weight vertices they all bound to 30th bone */ \
-    {                                                                   \
-        const osg::Matrix3& rm = rotationTranslationMatrices[mi->x()].first; \
-        const osg::Vec3f&   tv = rotationTranslationMatrices[mi->x()].second; \
-        *v = (mul3(rm, *sv) + tv) * w->x();                             \
-        *n = (mul3(rm, *sn)) * w->x();                                  \
-                                                                        \
-        _process_y;                                                     \
-    }                                                                   \
-    else                                                                \
-    {                                                                   \
-        *v = *sv;                                                       \
-        *n = convert( *sn );                                            \
-    }                                                                   
-                                                                        
-#define PROCESS_Y( _process_z )                                         \
-    if ( w->y() )                                                   \
-    {                                                                   \
-        const osg::Matrix3& rm = rotationTranslationMatrices[mi->y()].first; \
-        const osg::Vec3f&   tv = rotationTranslationMatrices[mi->y()].second; \
-        *v += (mul3(rm, *sv) + tv) * w->y();                            \
-        *n += (mul3(rm, *sn)) * w->y();                                 \
-                                                                        \
-        _process_z;                                                     \
-    }                                                                   
-
-#define PROCESS_Z( _process_w )                                         \
-    if ( w->z() )                                                       \
-    {                                                                   \
-        const osg::Matrix3& rm = rotationTranslationMatrices[mi->z()].first; \
-        const osg::Vec3f&   tv = rotationTranslationMatrices[mi->z()].second; \
-        *v += (mul3(rm, *sv) + tv) * w->z();                            \
-        *n += (mul3(rm, *sn)) * w->z();                                 \
-                                                                        \
-        _process_w;                                                     \
-    }
+    VertexBuffer&               vb  = *(VertexBuffer*)getVertexArray();
+    NormalBuffer&               nb  = *(NormalBuffer*)getNormalArray();
 
-#define PROCESS_W()                                                     \
-    if ( w->w() )                                                       \
-    {                                                                   \
-        const osg::Matrix3& rm = rotationTranslationMatrices[mi->w()].first; \
-        const osg::Vec3f&   tv = rotationTranslationMatrices[mi->w()].second; \
-        *v += (mul3(rm, *sv) + tv) * w->w();                            \
-        *n += (mul3(rm, *sn)) * w->w();                                 \
+    if ( mesh->parameters->useSkinningStreams
+         && mesh->data->skinningStreams.valid() )
+    {
+        skinVerticesAndNormals( palette, mesh->data->maxBonesInfluence,
+                                *mesh->data->skinningStreams, 0,
+                                &vb.front(), &nb.front(), vb.size(),
+                                boundingBox );
     }
-
-#define STOP
-
-    switch ( mesh->data->maxBonesInfluence )
+    else
     {
-        case 1:
-            ITERATE( PROCESS_X( STOP ) );
-            break;
-
-        case 2:
-            ITERATE( PROCESS_X( PROCESS_Y ( STOP ) ) );
-            break;
-
-        case 3:
-            ITERATE( PROCESS_X( PROCESS_Y ( PROCESS_Z( STOP ) ) ) );
-            break;
-
-        case 4:
-            ITERATE( PROCESS_X( PROCESS_Y ( PROCESS_Z( PROCESS_W() ) ) ) );
-            break;
-
-        default:
-            throw std::runtime_error( "maxBonesInfluence > 4 ???" );            
+        const VertexBuffer&         svb = *mesh->data->vertexBuffer.get();
+        const NormalBuffer&         snb = *mesh->data->normalBuffer.get();
+        const WeightBuffer&         wb  = *mesh->data->weightBuffer.get();
+        const MatrixIndexBuffer&    mib = *mesh->data->matrixIndexBuffer.get();
+
+        skinVerticesAndNormals( palette, mesh->data->maxBonesInfluence,
+                                &svb.front(), &snb.front(),
+                                &wb.front(), &mib.front(),
+                                &vb.front(), &nb.front(), vb.size(),
+                                boundingBox );
     }
 
     dirtyBound();
@@ -385,7 +385,11 @@ bool osgCal::operator < ( const HwMeshStateSetCache::HWKey& k1,
                lt( k1.fogMode,
                    k2.fogMode,
                    lt( k1.useDepthFirstMesh,
-                       k2.useDepthFirstMesh, false )));
+                       k2.useDepthFirstMesh,
+                       lt( k1.useBonePaletteTexture,
+                           k2.useBonePaletteTexture,
+                           lt( k1.instanced,
+                               k2.instanced, false )))));
     
 }
 
@@ -400,13 +404,17 @@ HwMeshStateSetCache::HwMeshStateSetCache( SwMeshStateSetCache* swssc,
 osg::StateSet*
 HwMeshStateSetCache::get( const MKey& swsd,
                           int bonesCount,
-                          MeshParameters* p )
+                          MeshParameters* p,
+                          bool instanced )
 {
     return getOrCreate< Map, HwMeshStateSetCache >( cache,
                         std::make_pair( swsd,
                                         HWKey( bonesCount,
                                                p->fogMode,
-                                               p->useDepthFirstMesh ) ),
+                                               p->useDepthFirstMesh,
+                                               ( p->useBonePaletteTexture || instanced )
+                                               && bonesCount > 0,
+                                               instanced && bonesCount > 0 ) ),
                         this,
                         &HwMeshStateSetCache::createHwMeshStateSet );
 }
@@ -437,6 +445,10 @@ HwMeshStateSetCache::createHwMeshStateSet( const Key& matAndBones )
                                         |
                                         SHADER_FLAG_BONES( params.bonesCount )
                                         |
+                                        params.useBonePaletteTexture * SHADER_FLAG_BONE_PALETTE
+                                        |
+                                        params.instanced * SHADER_FLAG_INSTANCED
+                                        |
                                         fogFlags
                                         |
                                         rgba * SHADER_FLAG_RGBA
@@ -498,24 +510,32 @@ HwMeshStateSetCache::createHwMeshStateSet( const Key& matAndBones )
 
 osg::StateSet*
 DepthMeshStateSetCache::get( const Material* m,
-                             int bonesCount )
+                             int bonesCount,
+                             bool useBonePaletteTexture )
 {
-    return getOrCreate< Map, DepthMeshStateSetCache >( cache, std::make_pair( bonesCount, m->sides ), this,
+    int flags = SHADER_FLAG_BONES( bonesCount );
+
+    if ( useBonePaletteTexture && bonesCount > 0 )
+    {
+        flags |= SHADER_FLAG_BONE_PALETTE;
+    }
+
+    return getOrCreate< Map, DepthMeshStateSetCache >( cache, std::make_pair( flags, m->sides ), this,
                         &DepthMeshStateSetCache::createDepthMeshStateSet );
 }
 
 osg::StateSet*
-DepthMeshStateSetCache::createDepthMeshStateSet( const std::pair< int, int >& boneAndSidesCount )
+DepthMeshStateSetCache::createDepthMeshStateSet( const std::pair< int, int >& flagsAndSidesCount )
 {
     osg::StateSet* stateSet = new osg::StateSet();
 
     stateSet->setAttributeAndModes( shadersCache->get(
-                                        SHADER_FLAG_BONES( boneAndSidesCount.first )
-                                        +
+                                        flagsAndSidesCount.first
+                                        |
                                         SHADER_FLAG_DEPTH_ONLY ),
                                     osg::StateAttribute::ON );
     // -- setup sidedness --
-    switch ( boneAndSidesCount.second )
+    switch ( flagsAndSidesCount.second )
     {
         case 1:
             // one sided mesh -- force backface culling
@@ -0,0 +1,433 @@
+/* -*- c++ -*-
+    Copyright (C) 2008 Vladimir Shabanov <vshabanoff@gmail.com>
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+#include <deque>
+#include <string>
+#include <stdexcept>
+
+#include <osg/ref_ptr>
+#include <osg/Timer>
+#include <OpenThreads/Thread>
+#include <OpenThreads/ScopedLock>
+
+#include <osgCal/TaskPool>
+
+using namespace osgCal;
+
+typedef OpenThreads::ScopedLock< OpenThreads::Mutex > ScopedLock;
+
+#if defined(_MSC_VER)
+#   define THREAD_LOCAL __declspec( thread )
+#else
+#   define THREAD_LOCAL __thread
+#endif
+
+// -- Internals --
+
+/**
+ * Tasks submitted by single \c run() call.
+ */
+struct TaskPool::Batch
+{
+        OpenThreads::Mutex      mutex;
+        OpenThreads::Condition  done;      // broadcast when remaining reaches 0
+        size_t                  remaining; // guarded by mutex
+        std::string             error;     // first task error, guarded by mutex
+        bool                    failed;
+        const Entry*            parent;    // entry which called run(), 0 outside of tasks
+
+        Batch( size_t       count,
+               const Entry* p )
+            : remaining( count )
+            , failed( false )
+            , parent( p )
+        {}
+
+        bool finished()
+        {
+            ScopedLock lock( mutex );
+            return remaining == 0;
+        }
+
+        void wait()
+        {
+            ScopedLock lock( mutex );
+
+            while ( remaining != 0 )
+            {
+                done.wait( &mutex );
+            }
+        }
+};
+
+/**
+ * How many times thread waiting in \c run() finds no tasks to
+ * execute (yielding between attempts) before it sleeps until its
+ * batch is finished.
+ */
+static const int SPINS_BEFORE_WAIT = 64;
+
+struct TaskPool::Entry
+{
+        Task*        task;
+        Batch*       batch;
+        const Entry* outer; // entry executed by the same thread below this one
+};
+
+struct TaskPool::Queue
+{
+        OpenThreads::Mutex  mutex;
+        std::deque< Entry > entries;
+};
+
+class TaskPool::Worker : public OpenThreads::Thread
+{
+    public:
+
+        Worker( TaskPool* p,
+                size_t    q )
+            : pool( p )
+            , queue( q )
+        {}
+
+        TaskPool* const pool;
+        const size_t    queue;
+
+        virtual void run()
+        {
+            for (;;)
+            {
+                Entry e;
+
+                if ( pool->take( queue, e ) )
+                {
+                    pool->execute( e );
+                    continue;
+                }
+
+                ScopedLock lock( pool->sleepMutex );
+
+                if ( pool->quit )
+                {
+                    return;
+                }
+
+                if ( pool->queuedCount == 0 )
+                {
+                    pool->wakeUp.wait( &pool->sleepMutex );
+                }
+            }
+        }
+};
+
+// -- TaskPool --
+
+TaskPool::TaskPool( int threadsCount )
+    : queuedCount( 0 )
+    , quit( false )
+{
+    if ( threadsCount <= 0 )
+    {
+        threadsCount = OpenThreads::GetNumberOfProcessors() - 1;
+    }
+
+    for ( int i = 0; i < threadsCount; i++ )
+    {
+        queues.push_back( new Queue );
+        workers.push_back( new Worker( this, i ) );
+    }
+
+    queues.push_back( new Queue ); // for non-worker threads
+
+    for ( size_t i = 0; i < workers.size(); i++ )
+    {
+        workers[i]->start();
+    }
+}
+
+TaskPool::~TaskPool()
+{
+    {
+        ScopedLock lock( sleepMutex );
+        quit = true;
+        wakeUp.broadcast();
+    }
+
+    for ( size_t i = 0; i < workers.size(); i++ )
+    {
+        workers[i]->join();
+        delete workers[i];
+    }
+
+    for ( size_t i = 0; i < queues.size(); i++ )
+    {
+        delete queues[i];
+    }
+}
+
+static osg::ref_ptr< TaskPool > taskPool;
+static OpenThreads::Mutex       taskPoolMutex;
+
+TaskPool*
+TaskPool::instance()
+{
+    ScopedLock lock( taskPoolMutex );
+
+    if ( !taskPool.valid() )
+    {
+        taskPool = new TaskPool;
+    }
+
+    return taskPool.get();
+}
+
+size_t
+TaskPool::currentQueue() const
+{
+    Worker* w = dynamic_cast< Worker* >( OpenThreads::Thread::CurrentThread() );
+
+    if ( w && w->pool == this )
+    {
+        return w->queue;
+    }
+    else
+    {
+        return workers.size();
+    }
+}
+
+bool
+TaskPool::take( size_t queue,
+                Entry& e )
+{
+    bool found = false;
+
+    // -- Own queue, newest first --
+    {
+        Queue& q = *queues[ queue ];
+        ScopedLock lock( q.mutex );
+
+        if ( !q.entries.empty() )
+        {
+            e = q.entries.back();
+            q.entries.pop_back();
+            found = true;
+        }
+    }
+
+    // -- Steal oldest from others --
+    for ( size_t i = 1; !found && i < queues.size(); i++ )
+    {
+        Queue& q = *queues[ ( queue + i ) % queues.size() ];
+        ScopedLock lock( q.mutex );
+
+        if ( !q.entries.empty() )
+        {
+            e = q.entries.front();
+            q.entries.pop_front();
+            found = true;
+        }
+    }
+
+    if ( found )
+    {
+        ScopedLock lock( sleepMutex );
+        queuedCount--;
+    }
+
+    return found;
+}
+
+const TaskPool::Entry*&
+TaskPool::currentEntry()
+{
+    static THREAD_LOCAL const Entry* entry = 0;
+    return entry;
+}
+
+bool
+TaskPool::isSubtask( const Entry* e,
+                     const Entry* parent )
+{
+    for ( const Entry* p = e->batch->parent; p; p = p->batch->parent )
+    {
+        if ( p == parent )
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * Entry <code>e</code> was executed while tasks below it on the
+ * thread's stack waited in run(), its time is stolen from those of
+ * them it isn't subtask of. Entries above such task which are not
+ * its subtasks already counted the time, so it's added only once.
+ */
+void
+TaskPool::addStolenTime( const Entry& e,
+                         double       time )
+{
+    for ( const Entry* x = e.outer; x; x = x->outer )
+    {
+        bool stolen = !isSubtask( &e, x );
+
+        for ( const Entry* y = e.outer; stolen && y != x; y = y->outer )
+        {
+            stolen = isSubtask( y, x );
+        }
+
+        if ( stolen )
+        {
+            x->task->stolenTime += time;
+        }
+    }
+}
+
+void
+TaskPool::execute( Entry& e )
+{
+    std::string error;
+    bool        failed = false;
+
+    // -- Track stack of tasks executed by thread --
+    // (tasks waiting in run() execute other tasks, whose time
+    // is stolen from them, see addStolenTime)
+    e.outer = currentEntry();
+    currentEntry() = &e;
+    e.task->stolenTime = 0;
+
+    const osg::Timer* timer = osg::Timer::instance();
+    const osg::Timer_t start = e.outer ? timer->tick() : 0;
+
+    try
+    {
+        e.task->run();
+    }
+    catch ( std::exception& ex )
+    {
+        error = ex.what();
+        failed = true;
+    }
+    catch ( ... )
+    {
+        error = "unknown exception";
+        failed = true;
+    }
+
+    currentEntry() = e.outer;
+
+    if ( e.outer )
+    {
+        addStolenTime( e, timer->delta_s( start, timer->tick() ) );
+    }
+
+    ScopedLock lock( e.batch->mutex );
+
+    if ( failed && !e.batch->failed )
+    {
+        e.batch->error = error;
+        e.batch->failed = true;
+    }
+
+    if ( --e.batch->remaining == 0 )
+    {
+        e.batch->done.broadcast();
+    }
+}
+
+void
+TaskPool::run( Task* const* tasks,
+               size_t       count )
+{
+    if ( count == 0 )
+    {
+        return;
+    }
+
+    Batch batch( count, currentEntry() );
+
+    const size_t queue = currentQueue();
+
+    {
+        // counted before pushing, so take() never sees it smaller
+        // than number of queued entries
+        ScopedLock lock( sleepMutex );
+        queuedCount += count;
+    }
+
+    // -- Submit --
+    if ( queue < workers.size() || workers.empty() )
+    {
+        // worker puts tasks to its own queue, others will steal them
+        Queue& q = *queues[ queue ];
+        ScopedLock lock( q.mutex );
+
+        for ( size_t i = 0; i < count; i++ )
+        {
+            Entry e = { tasks[i], &batch, 0 };
+            q.entries.push_back( e );
+        }
+    }
+    else
+    {
+        // spread tasks over all queues so workers start without stealing
+        for ( size_t i = 0; i < count; i++ )
+        {
+            Queue& q = *queues[ i % queues.size() ];
+            ScopedLock lock( q.mutex );
+            Entry e = { tasks[i], &batch, 0 };
+            q.entries.push_back( e );
+        }
+    }
+
+    {
+        ScopedLock lock( sleepMutex );
+        wakeUp.broadcast();
+    }
+
+    // -- Help until batch is finished --
+    int spins = 0;
+
+    while ( !batch.finished() )
+    {
+        Entry e;
+
+        if ( take( queue, e ) )
+        {
+            execute( e );
+            spins = 0;
+        }
+        else if ( ++spins < SPINS_BEFORE_WAIT )
+        {
+            // remaining tasks of the batch are executed by others
+            OpenThreads::Thread::YieldCurrentThread();
+        }
+        else
+        {
+            // they are long, sleep until the last one finishes
+            batch.wait();
+        }
+    }
+
+    if ( batch.failed )
+    {
+        throw std::runtime_error( "TaskPool::run(): " + batch.error );
+    }
+}
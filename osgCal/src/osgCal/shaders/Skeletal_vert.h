@@ -1,5 +1,12 @@
 shaderText += "// -*-c++-*-\n";
 shaderText += "\n";
+if ( BONE_PALETTE ) {
+shaderText += "# extension GL_EXT_gpu_shader4 : enable\n";
+if ( INSTANCED ) {
+shaderText += "# extension GL_ARB_draw_instanced : enable\n";
+}
+}
+shaderText += "\n";
 shaderText += "# ifndef __GLSL_CG_DATA_TYPES // the space after '#' is necessary to\n";
 shaderText += "                              // differentiate `sed' defines from GLSL one's\n";
 shaderText += "  // remove half float types on non-nVidia videocards\n";
@@ -15,8 +22,41 @@ if ( BONES_COUNT >= 1 ) {
 shaderText += "# define weight gl_MultiTexCoord2\n";
 shaderText += "# define index  gl_MultiTexCoord3\n";
 shaderText += "\n";
+if ( BONE_PALETTE ) {
+shaderText += "// model's bone palette, 3 texels per bone: rotation matrix columns\n";
+shaderText += "// with translation components in w\n";
+shaderText += "uniform samplerBuffer bonePalette;\n";
+shaderText += "\n";
+if ( INSTANCED ) {
+shaderText += "// crowd palette: palettes of all instances one after another, with\n";
+shaderText += "// instance transform premultiplied into bones\n";
+shaderText += "uniform int instanceStride;\n";
+shaderText += "# define paletteTexel( i ) (gl_InstanceIDARB * instanceStride + int(i) * 3)\n";
+} else {
+shaderText += "# define paletteTexel( i ) (int(i) * 3)\n";
+}
+shaderText += "\n";
+shaderText += "mat3 rotationMatrix( float i )\n";
+shaderText += "{\n";
+shaderText += "    int t = paletteTexel( i );\n";
+shaderText += "    return mat3( texelFetchBuffer( bonePalette, t ).xyz,\n";
+shaderText += "                 texelFetchBuffer( bonePalette, t + 1 ).xyz,\n";
+shaderText += "                 texelFetchBuffer( bonePalette, t + 2 ).xyz );\n";
+shaderText += "}\n";
+shaderText += "\n";
+shaderText += "vec3 translationVector( float i )\n";
+shaderText += "{\n";
+shaderText += "    int t = paletteTexel( i );\n";
+shaderText += "    return vec3( texelFetchBuffer( bonePalette, t ).w,\n";
+shaderText += "                 texelFetchBuffer( bonePalette, t + 1 ).w,\n";
+shaderText += "                 texelFetchBuffer( bonePalette, t + 2 ).w );\n";
+shaderText += "}\n";
+} else {
 shaderText += "uniform mat3 rotationMatrices[31];\n";
 shaderText += "uniform vec3 translationVectors[31];\n";
+shaderText += "# define rotationMatrix( i )    rotationMatrices[int(i)]\n";
+shaderText += "# define translationVector( i ) translationVectors[int(i)]\n";
+}
 }
 shaderText += "\n";
 shaderText += "varying vec3 vNormal;\n";
@@ -41,20 +81,20 @@ shaderText += "    gl_TexCoord[0].st = gl_MultiTexCoord0.st; // export texCoord
 }
 shaderText += "\n";
 if ( BONES_COUNT >= 1 ) {
-shaderText += "    mat3 totalRotation = weight.x * rotationMatrices[int(index.x)];\n";
-shaderText += "    vec3 transformedPosition = weight.x * translationVectors[int(index.x)];\n";
+shaderText += "    mat3 totalRotation = weight.x * rotationMatrix(index.x);\n";
+shaderText += "    vec3 transformedPosition = weight.x * translationVector(index.x);\n";
 shaderText += "\n";
 if ( BONES_COUNT >= 2 ) {
-shaderText += "    totalRotation += weight.y * rotationMatrices[int(index.y)];\n";
-shaderText += "    transformedPosition += weight.y * translationVectors[int(index.y)];\n";
+shaderText += "    totalRotation += weight.y * rotationMatrix(index.y);\n";
+shaderText += "    transformedPosition += weight.y * translationVector(index.y);\n";
 shaderText += "\n";
 if ( BONES_COUNT >= 3 ) {
-shaderText += "    totalRotation += weight.z * rotationMatrices[int(index.z)];\n";
-shaderText += "    transformedPosition += weight.z * translationVectors[int(index.z)];\n";
+shaderText += "    totalRotation += weight.z * rotationMatrix(index.z);\n";
+shaderText += "    transformedPosition += weight.z * translationVector(index.z);\n";
 shaderText += "\n";
 if ( BONES_COUNT >= 4 ) {
-shaderText += "    totalRotation += weight.w * rotationMatrices[int(index.w)];\n";
-shaderText += "    transformedPosition += weight.w * translationVectors[int(index.w)];\n";
+shaderText += "    totalRotation += weight.w * rotationMatrix(index.w);\n";
+shaderText += "    transformedPosition += weight.w * translationVector(index.w);\n";
 } // BONES_COUNT >= 4
 } // BONES_COUNT >= 3
 } // BONES_COUNT >= 2